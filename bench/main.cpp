@@ -0,0 +1,319 @@
+// Benchmarks the phases of building, saving, diffing and syncing trees on a
+// synthetic directory tree. The tree only depends on the parameters and the
+// seed, so runs on different machines and commits see the same workload.
+#include <libtree/print.hpp>
+#include <libtree/tree.hpp>
+
+#include <algorithm>
+#include <charconv>
+#include <chrono>
+#include <cstdint>
+#include <cstdlib>
+#include <filesystem>
+#include <format>
+#include <fstream>
+#include <optional>
+#include <random>
+#include <span>
+#include <stdexcept>
+#include <string>
+#include <string_view>
+#include <vector>
+
+namespace {
+
+namespace fs = std::filesystem;
+
+struct Config {
+    fs::path dir{fs::temp_directory_path() / "tree_bench"};
+    std::size_t depth{3};
+    std::size_t fanout{8};         // Subdirectories per directory
+    std::size_t files{16};         // Files per directory
+    std::uint64_t min_size{0};     // Bytes
+    std::uint64_t max_size{16384}; // Bytes
+    double change_ratio{0.05};     // Fraction of files touched between syncs
+    std::uint64_t seed{1};
+    std::size_t jobs{1};
+    HashMode hash_mode{HashMode::mtime};
+    bool fast_hash{false};
+};
+
+// Counters of the calling process. Syscalls are those counted by Linux's
+// I/O accounting (read and write like calls); zero elsewhere.
+struct IoCounters {
+    std::uint64_t syscalls{0};
+    std::uint64_t bytes_read{0};
+    std::uint64_t bytes_written{0};
+};
+
+IoCounters read_io_counters()
+{
+    IoCounters io;
+    std::ifstream proc{"/proc/self/io"};
+    std::string key;
+    std::uint64_t value{};
+    while (proc >> key >> value) {
+        if (key == "syscr:" || key == "syscw:") {
+            io.syscalls += value;
+        }
+        else if (key == "rchar:") {
+            io.bytes_read = value;
+        }
+        else if (key == "wchar:") {
+            io.bytes_written = value;
+        }
+    }
+    return io;
+}
+
+// Times `f` and prints one row of the report.
+template <typename F> void phase(std::string_view name, F &&f)
+{
+    auto const io0{read_io_counters()};
+    auto const t0{std::chrono::steady_clock::now()};
+    f();
+    auto const t1{std::chrono::steady_clock::now()};
+    auto const io1{read_io_counters()};
+    std::println("{:<22}{:>12.2f}{:>12}{:>14}{:>14}", name,
+                 std::chrono::duration<double, std::milli>(t1 - t0).count(),
+                 io1.syscalls - io0.syscalls,
+                 io1.bytes_read - io0.bytes_read,
+                 io1.bytes_written - io0.bytes_written);
+}
+
+// mt19937_64 is specified exactly, unlike the standard distributions, so
+// the numbers are drawn from it directly.
+class Random {
+  public:
+    explicit Random(std::uint64_t seed) : engine_(seed) {}
+
+    // Uniform in [lo, hi].
+    std::uint64_t between(std::uint64_t lo, std::uint64_t hi)
+    {
+        return lo + engine_() % (hi - lo + 1);
+    }
+
+    bool chance(double p)
+    {
+        return static_cast<double>(engine_() >> 11) * 0x1.0p-53 < p;
+    }
+
+    void fill(std::vector<char> &bytes)
+    {
+        for (std::size_t i{}; i < bytes.size(); i += 8) {
+            auto const v{engine_()};
+            for (std::size_t k{}; k != 8 && i + k != bytes.size(); ++k) {
+                bytes[i + k] = static_cast<char>(v >> (k * 8));
+            }
+        }
+    }
+
+  private:
+    std::mt19937_64 engine_;
+};
+
+// Fixed mtimes, so that mtime-mode hashes don't depend on when the tree was
+// generated.
+fs::file_time_type stamp(std::uint64_t n)
+{
+    return fs::file_time_type{std::chrono::seconds{1'600'000'000 + n}};
+}
+
+void write_file(fs::path const &path, Random &random, Config const &config,
+                std::uint64_t n)
+{
+    std::vector<char> bytes(random.between(config.min_size, config.max_size));
+    random.fill(bytes);
+    std::ofstream{path, std::ios::binary}.write(
+        bytes.data(), static_cast<std::streamsize>(bytes.size()));
+    fs::last_write_time(path, stamp(n));
+}
+
+void generate(fs::path const &dir, std::size_t depth, Random &random,
+              Config const &config, std::uint64_t &n)
+{
+    fs::create_directories(dir);
+    for (std::size_t i{}; i != config.files; ++i) {
+        write_file(dir / std::format("f{}", i), random, config, n++);
+    }
+    if (depth == 0) {
+        return;
+    }
+    for (std::size_t i{}; i != config.fanout; ++i) {
+        generate(dir / std::format("d{}", i), depth - 1, random, config, n);
+    }
+}
+
+// Modifies, deletes or adds next to about `change_ratio` of the files.
+void mutate(fs::path const &dir, Random &random, Config const &config,
+            std::uint64_t &n)
+{
+    std::vector<fs::path> files;
+    for (auto const &entry : fs::recursive_directory_iterator(dir)) {
+        if (entry.is_regular_file()) {
+            files.push_back(entry.path());
+        }
+    }
+    std::ranges::sort(files); // Iteration order isn't deterministic
+    for (auto const &file : files) {
+        if (!random.chance(config.change_ratio)) {
+            continue;
+        }
+        switch (random.between(0, 4)) {
+        case 0:
+            fs::remove(file);
+            break;
+        case 1: {
+            auto added{file};
+            added += ".new";
+            write_file(added, random, config, n++);
+            break;
+        }
+        default:
+            write_file(file, random, config, n++);
+            break;
+        }
+    }
+}
+
+template <typename Tree> void run(Config const &config)
+{
+    BasicBuildOptions<typename Tree::Policy> options;
+    options.jobs = config.jobs;
+    options.hash_mode = config.hash_mode;
+
+    auto const src{config.dir / "src"};
+    auto const dest{config.dir / "dest"};
+    auto const snap{config.dir / "src.snap"};
+    fs::remove_all(config.dir);
+
+    Random random{config.seed};
+    std::uint64_t n{};
+    std::println("{:<22}{:>12}{:>12}{:>14}{:>14}", "phase", "wall ms",
+                 "syscalls", "bytes read", "bytes written");
+    phase("generate", [&] { generate(src, config.depth, random, config, n); });
+
+    std::optional<Tree> a;
+    std::optional<Tree> b;
+    phase("from_directory", [&] { a = Tree::from_directory(src, options); });
+    phase("writeTree", [&] { a->writeTree(snap); });
+    phase("from_file", [&] { b = Tree::from_file(snap); });
+
+    fs::create_directory(dest);
+    b = Tree::from_directory(dest, options);
+    phase("diff (full)", [&] { (void)b->plan_sync_from(*a); });
+    phase("sync_from (full)", [&] { b->sync_from(*a); });
+
+    mutate(src, random, config, n);
+    phase("from_directory (src)",
+          [&] { a = Tree::from_directory(src, options); });
+    // After the sync, the last tree of the destination is up to date with
+    // its files, so they needn't be read again.
+    auto dest_options{options};
+    dest_options.reference = &*b;
+    phase("from_directory (dest)",
+          [&] { b = Tree::from_directory(dest, dest_options); });
+    SyncPlan plan;
+    phase("diff (changes)", [&] { plan = b->plan_sync_from(*a); });
+    phase("sync_from (changes)", [&] { b->sync_from(*a); });
+    phase("diff (synced)", [&] { (void)b->plan_sync_from(*a); });
+
+    std::println("changes: {} deletions, {} creations, {} modifications",
+                 plan.deletes.size(), plan.creates.size(),
+                 plan.modifies.size());
+}
+
+template <typename T> T parse_number(std::string_view value)
+{
+    T number{};
+    auto const [ptr, ec] =
+        std::from_chars(value.data(), value.data() + value.size(), number);
+    if (ec != std::errc{} || ptr != value.data() + value.size()) {
+        throw std::invalid_argument{std::format("invalid number {}", value)};
+    }
+    return number;
+}
+
+} // namespace
+
+int main(int argc, char **argv)
+{
+    std::span args{argv, static_cast<std::size_t>(argc)};
+    Config config;
+
+    try {
+        for (std::size_t i{1}; i < args.size(); ++i) {
+            std::string_view const arg{args[i]};
+            auto value{[&]() -> std::string_view {
+                if (i + 1 == args.size()) {
+                    throw std::invalid_argument{
+                        std::format("option {} requires a value", arg)};
+                }
+                return args[++i];
+            }};
+            if (arg == "--dir") {
+                config.dir = value();
+            }
+            else if (arg == "--depth") {
+                config.depth = parse_number<std::size_t>(value());
+            }
+            else if (arg == "--fanout") {
+                config.fanout = parse_number<std::size_t>(value());
+            }
+            else if (arg == "--files") {
+                config.files = parse_number<std::size_t>(value());
+            }
+            else if (arg == "--min-size") {
+                config.min_size = parse_number<std::uint64_t>(value());
+            }
+            else if (arg == "--max-size") {
+                config.max_size = parse_number<std::uint64_t>(value());
+            }
+            else if (arg == "--change-ratio") {
+                config.change_ratio = parse_number<double>(value());
+            }
+            else if (arg == "--seed") {
+                config.seed = parse_number<std::uint64_t>(value());
+            }
+            else if (arg == "-j" || arg == "--jobs") {
+                config.jobs = parse_number<std::size_t>(value());
+            }
+            else if (arg == "--hash") {
+                auto const mode{value()};
+                if (mode != "mtime" && mode != "content") {
+                    throw std::invalid_argument{
+                        std::format("unknown hash mode {}", mode)};
+                }
+                config.hash_mode =
+                    mode == "content" ? HashMode::content : HashMode::mtime;
+            }
+            else if (arg == "--fast-hash") {
+                config.fast_hash = true;
+            }
+            else {
+                throw std::invalid_argument{
+                    std::format("unknown option {}", arg)};
+            }
+        }
+        if (config.min_size > config.max_size) {
+            throw std::invalid_argument{"--min-size exceeds --max-size"};
+        }
+    }
+    catch (std::invalid_argument const &e) {
+        errorln("{}", e.what());
+        errorln("Usage: {} [--dir <dir>] [--depth <n>] [--fanout <n>] "
+                "[--files <n>] [--min-size <bytes>] [--max-size <bytes>] "
+                "[--change-ratio <r>] [--seed <n>] [-j <n>] "
+                "[--hash mtime|content] [--fast-hash]",
+                args[0]);
+        return EXIT_FAILURE;
+    }
+
+    if (config.fast_hash) {
+        run<BasicMerkleTree<Xxh64x4Policy>>(config);
+    }
+    else {
+        run<MerkleTree>(config);
+    }
+    return EXIT_SUCCESS;
+}
@@ -0,0 +1,386 @@
+#include <libtree/chunk_store.hpp>
+#include <libtree/copy_engine.hpp>
+#include <libtree/file_reader.hpp>
+#include <libtree/metrics.hpp>
+#include <libtree/snapshot.hpp>
+
+#include <algorithm>
+#include <array>
+#include <charconv>
+#include <cstring>
+#include <format>
+#include <fstream>
+#include <iterator>
+#include <optional>
+#include <stdexcept>
+#include <string>
+#include <string_view>
+#include <system_error>
+#include <utility>
+
+namespace {
+
+// Gear table: a pseudo-random 64-bit value per byte value, from splitmix64,
+// so that cut points are the same for every build.
+constexpr std::array<std::uint64_t, 256> gear_table{[] {
+    std::array<std::uint64_t, 256> table{};
+    std::uint64_t x{0};
+    for (auto &v : table) {
+        x += 0x9E3779B97F4A7C15ULL;
+        auto z{x};
+        z = (z ^ (z >> 30)) * 0xBF58476D1CE4E5B9ULL;
+        z = (z ^ (z >> 27)) * 0x94D049BB133111EBULL;
+        v = z ^ (z >> 31);
+    }
+    return table;
+}()};
+
+// Cut-point masks, on the top bits of the gear hash: those depend on the
+// most bytes. 16 bits give the 64 KiB average; 2 more below it and 2 fewer
+// above it normalize the sizes.
+constexpr std::uint64_t top_bits(unsigned n)
+{
+    return ~std::uint64_t{0} << (64 - n);
+}
+constexpr std::uint64_t mask_small{top_bits(18)};
+constexpr std::uint64_t mask_large{top_bits(14)};
+static_assert(chunk_avg_size == 1U << 16);
+
+std::optional<Digest> from_hex(std::string_view hex)
+{
+    Digest digest;
+    if (hex.size() != 2 * digest.size()) {
+        return std::nullopt;
+    }
+    for (std::size_t i{}; i != digest.size(); ++i) {
+        auto const *first{hex.data() + 2 * i};
+        auto const [ptr, ec] =
+            std::from_chars(first, first + 2, digest[i], 16);
+        if (ec != std::errc{} || ptr != first + 2) {
+            return std::nullopt;
+        }
+    }
+    return digest;
+}
+
+// The digest an entry of chunks/ or files/ is named by, if it is one.
+std::optional<Digest> digest_of(std::filesystem::path const &path)
+{
+    return from_hex(path.parent_path().filename().string() +
+                    path.filename().string());
+}
+
+std::filesystem::path digest_path(std::filesystem::path const &dir,
+                                  Digest const &digest)
+{
+    auto const hex{to_hex(digest)};
+    return dir / hex.substr(0, 2) / hex.substr(2);
+}
+
+// Replaces `path` with `bytes`, all at once.
+void write_file(std::filesystem::path const &path,
+                std::span<unsigned char const> bytes)
+{
+    std::filesystem::create_directories(path.parent_path());
+    auto tmp{path};
+    tmp += ".tmp";
+    {
+        std::ofstream ofile(tmp, std::ios::binary | std::ios::trunc);
+        ofile.write(reinterpret_cast<char const *>(bytes.data()),
+                    static_cast<std::streamsize>(bytes.size()));
+        if (!ofile.flush()) {
+            throw std::runtime_error("can't write file " + tmp.string());
+        }
+    }
+    std::filesystem::rename(tmp, path);
+}
+
+std::vector<unsigned char> read_file(std::filesystem::path const &path)
+{
+    std::ifstream ifile(path, std::ios::binary);
+    if (!ifile) {
+        throw std::runtime_error("can't open file " + path.string());
+    }
+    return {std::istreambuf_iterator<char>{ifile},
+            std::istreambuf_iterator<char>{}};
+}
+
+void sort_unique(std::vector<Digest> &digests)
+{
+    std::ranges::sort(digests);
+    digests.erase(std::ranges::unique(digests).begin(), digests.end());
+}
+
+} // namespace
+
+std::size_t next_chunk(std::span<unsigned char const> data)
+{
+    if (data.size() <= chunk_min_size) {
+        return data.size();
+    }
+    auto const end{std::min(data.size(), chunk_max_size)};
+    auto const normal{std::min(end, chunk_avg_size)};
+    std::uint64_t h{0};
+    std::size_t i{chunk_min_size};
+    for (; i != normal; ++i) {
+        h = (h << 1) + gear_table[data[i]];
+        if ((h & mask_small) == 0) {
+            return i + 1;
+        }
+    }
+    for (; i != end; ++i) {
+        h = (h << 1) + gear_table[data[i]];
+        if ((h & mask_large) == 0) {
+            return i + 1;
+        }
+    }
+    return end;
+}
+
+ChunkStore::ChunkStore(std::filesystem::path root) : root_(std::move(root))
+{
+    for (auto const *dir : {"chunks", "files", "versions"}) {
+        std::filesystem::create_directories(root_ / dir);
+    }
+}
+
+bool ChunkStore::is_store(std::filesystem::path const &root)
+{
+    namespace fs = std::filesystem;
+    return fs::is_directory(root / "chunks") &&
+           fs::is_directory(root / "files") &&
+           fs::is_directory(root / "versions");
+}
+
+std::filesystem::path ChunkStore::chunk_path(Digest const &digest) const
+{
+    return digest_path(root_ / "chunks", digest);
+}
+
+std::filesystem::path ChunkStore::file_path(Digest const &content) const
+{
+    return digest_path(root_ / "files", content);
+}
+
+bool ChunkStore::has_file(Digest const &content) const
+{
+    Metrics::add(Counter::stat_calls);
+    return std::filesystem::exists(file_path(content));
+}
+
+std::uint64_t ChunkStore::put_file(std::filesystem::path const &file,
+                                   Digest const &content)
+{
+    static Digest const empty{sha256({})};
+    if (content == empty) {
+        write_file(file_path(content), {});
+        return 0;
+    }
+
+    MappedFile const mapped{file};
+    auto const bytes{mapped.data()};
+    {
+        PhaseTimer const timer{Phase::hash};
+        Metrics::add(Counter::hash_calls);
+        Metrics::add(Counter::bytes_hashed, bytes.size());
+        if (content_digest(bytes) != content) {
+            throw std::runtime_error{std::format(
+                "{} changed while it was backed up", file.string())};
+        }
+    }
+
+    std::vector<Digest> chunks;
+    std::uint64_t written{};
+    for (std::size_t offset{}; offset != bytes.size();) {
+        auto const chunk{
+            bytes.subspan(offset, next_chunk(bytes.subspan(offset)))};
+        offset += chunk.size();
+        auto const &digest{chunks.emplace_back(sha256(chunk))};
+        auto const path{chunk_path(digest)};
+        Metrics::add(Counter::stat_calls);
+        if (std::filesystem::exists(path)) {
+            Metrics::add(Counter::chunks_reused);
+            continue;
+        }
+        write_file(path, chunk);
+        written += chunk.size();
+        Metrics::add(Counter::chunks_stored);
+        Metrics::add(Counter::bytes_stored, chunk.size());
+    }
+
+    // Only once all of its chunks are there.
+    std::span<unsigned char const> const recipe{
+        reinterpret_cast<unsigned char const *>(chunks.data()),
+        chunks.size() * sizeof(Digest)};
+    write_file(file_path(content), recipe);
+    Metrics::add(Counter::bytes_stored, recipe.size());
+    return written + recipe.size();
+}
+
+std::vector<Digest> ChunkStore::recipe(Digest const &content) const
+{
+    auto const path{file_path(content)};
+    if (!std::filesystem::exists(path)) {
+        throw std::runtime_error{std::format(
+            "content {} is missing from the store", to_hex(content))};
+    }
+    auto const bytes{read_file(path)};
+    if (bytes.size() % sizeof(Digest) != 0) {
+        throw std::runtime_error{"corrupt recipe " + path.string()};
+    }
+    std::vector<Digest> chunks(bytes.size() / sizeof(Digest));
+    if (!chunks.empty()) {
+        std::memcpy(chunks.data(), bytes.data(), bytes.size());
+    }
+    return chunks;
+}
+
+std::uint64_t ChunkStore::get_file(Digest const &content,
+                                   std::filesystem::path const &target) const
+{
+    // Put together next to it first: a missing or corrupt chunk leaves
+    // `target` as it was, and a symlink there is replaced, not written
+    // through.
+    auto const tmp{temporary_path(target)};
+    std::uint64_t written{};
+    try {
+        std::ofstream ofile(tmp, std::ios::binary | std::ios::trunc);
+        if (!ofile) {
+            throw std::runtime_error("can't open file " + tmp.string());
+        }
+        for (auto const &digest : recipe(content)) {
+            auto const chunk{read_file(chunk_path(digest))};
+            if (sha256(chunk) != digest) {
+                throw std::runtime_error{
+                    std::format("corrupt chunk {}", to_hex(digest))};
+            }
+            ofile.write(reinterpret_cast<char const *>(chunk.data()),
+                        static_cast<std::streamsize>(chunk.size()));
+            written += chunk.size();
+        }
+        if (!ofile.flush()) {
+            throw std::runtime_error("can't write file " + tmp.string());
+        }
+    }
+    catch (...) {
+        std::error_code ec;
+        std::filesystem::remove(tmp, ec);
+        throw;
+    }
+    std::filesystem::rename(tmp, target);
+    Metrics::add(Counter::bytes_copied, written);
+    return written;
+}
+
+std::vector<std::uint64_t> ChunkStore::versions() const
+{
+    std::vector<std::uint64_t> versions;
+    for (auto const &entry :
+         std::filesystem::directory_iterator{root_ / "versions"}) {
+        if (entry.path().extension() != ".snap") {
+            continue;
+        }
+        auto const stem{entry.path().stem().string()};
+        std::uint64_t version{};
+        auto const [ptr, ec] =
+            std::from_chars(stem.data(), stem.data() + stem.size(), version);
+        if (ec == std::errc{} && ptr == stem.data() + stem.size()) {
+            versions.push_back(version);
+        }
+    }
+    std::ranges::sort(versions);
+    return versions;
+}
+
+std::filesystem::path ChunkStore::version_path(std::uint64_t version) const
+{
+    return root_ / "versions" / std::format("{}.snap", version);
+}
+
+std::uint64_t ChunkStore::latest_of(std::filesystem::path const &dir) const
+{
+    auto const all{versions()};
+    for (auto it{all.rbegin()}; it != all.rend(); ++it) {
+        SnapshotView const view{version_path(*it), SnapshotView::Check::layout};
+        if (view.name(view.nodes()[0]) == dir.string()) {
+            return *it;
+        }
+    }
+    return 0;
+}
+
+std::filesystem::path ChunkStore::staging_path() const
+{
+    return root_ / "versions" / "next.snap.tmp";
+}
+
+std::uint64_t ChunkStore::add_version()
+{
+    auto const all{versions()};
+    auto const version{all.empty() ? 1 : all.back() + 1};
+    std::filesystem::rename(staging_path(), version_path(version));
+    return version;
+}
+
+ChunkStore::PruneResult ChunkStore::prune(std::size_t keep)
+{
+    namespace fs = std::filesystem;
+
+    PruneResult result;
+    auto const all{versions()};
+    auto const drop{all.size() > keep ? all.size() - keep : 0};
+    for (std::size_t i{}; i != drop; ++i) {
+        result.bytes += fs::file_size(version_path(all[i]));
+        fs::remove(version_path(all[i]));
+        ++result.versions;
+    }
+
+    // What the remaining versions have, then what that is made of.
+    std::vector<Digest> files;
+    for (std::size_t i{drop}; i != all.size(); ++i) {
+        SnapshotView const view{version_path(all[i])};
+        auto const nodes{view.nodes()};
+        for (std::size_t k{}; k != nodes.size(); ++k) {
+            if ((nodes[k].flags & SnapshotNode::folder) == 0 &&
+                (nodes[k].flags & SnapshotNode::has_content) != 0) {
+                files.push_back(view.contents()[k]);
+            }
+        }
+    }
+    sort_unique(files);
+
+    // Entries are collected first and removed after, not while the
+    // directory is being iterated.
+    auto sweep{[&](fs::path const &dir, std::vector<Digest> const &live,
+                   std::size_t &count, auto keepEntry) {
+        std::vector<fs::path> gone;
+        for (auto const &entry : fs::recursive_directory_iterator{dir}) {
+            if (!entry.is_regular_file()) {
+                continue;
+            }
+            auto const digest{digest_of(entry.path())};
+            if (digest && std::ranges::binary_search(live, *digest)) {
+                keepEntry(*digest);
+                continue;
+            }
+            // Not a digest: a temporary left behind by an interrupted write.
+            if (digest) {
+                ++count;
+            }
+            result.bytes += entry.file_size();
+            gone.push_back(entry.path());
+        }
+        for (auto const &path : gone) {
+            fs::remove(path);
+        }
+    }};
+
+    std::vector<Digest> chunks;
+    sweep(root_ / "files", files, result.files, [&](Digest const &content) {
+        auto const parts{recipe(content)};
+        chunks.insert(chunks.end(), parts.begin(), parts.end());
+    });
+    sort_unique(chunks);
+    sweep(root_ / "chunks", chunks, result.chunks, [](Digest const &) {});
+    return result;
+}
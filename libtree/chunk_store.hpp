@@ -0,0 +1,106 @@
+#pragma once
+
+#include <libtree/hash.hpp>
+
+#include <cstddef>
+#include <cstdint>
+#include <filesystem>
+#include <span>
+#include <vector>
+
+// Sizes of the chunks `next_chunk` cuts. Cut points are normalized around
+// the average: harder to find below it, easier above it, so that sizes
+// cluster there.
+inline constexpr std::size_t chunk_min_size{16U << 10};
+inline constexpr std::size_t chunk_avg_size{64U << 10};
+inline constexpr std::size_t chunk_max_size{256U << 10};
+
+// Length of the content-defined chunk at the start of `data` (FastCDC, with
+// a gear hash). A cut point only depends on the 64 bytes before it, so an
+// insertion or deletion moves the cut points near it, and the chunks
+// elsewhere in the file stay the same.
+std::size_t next_chunk(std::span<unsigned char const> data);
+
+// A directory of deduplicated, versioned backups:
+//
+//   chunks/ab/cdef...  bytes of a chunk, named by its SHA-256
+//   files/ab/cdef...   recipe of a file content: the digests of its chunks
+//                      in order, named by the content digest (hash.hpp)
+//   versions/N.snap    snapshot of the N-th backup, in content mode
+//
+// Every chunk and every file content is stored once, however many files
+// and versions have it. Entries are written under a temporary name and
+// renamed in place, chunks before the recipes naming them and recipes
+// before the snapshots referring to them, so whatever is there is whole.
+// One backup or prune at a time.
+class ChunkStore {
+  public:
+    // Creates the store's directories if they don't exist.
+    explicit ChunkStore(std::filesystem::path root);
+
+    // Whether `root` has the directories of a store.
+    static bool is_store(std::filesystem::path const &root);
+
+    [[nodiscard]] std::filesystem::path const &root() const
+    {
+        return root_;
+    }
+
+    // Whether the file content with digest `content` is stored.
+    [[nodiscard]] bool has_file(Digest const &content) const;
+
+    // Stores `file`, whose content digest is `content`, writing the chunks
+    // the store doesn't have yet. Empty content is recorded without opening
+    // `file`. Throws if the file doesn't hash to `content`, i.e. it changed
+    // since it was scanned. Returns the number of bytes written.
+    std::uint64_t put_file(std::filesystem::path const &file,
+                           Digest const &content);
+
+    // Writes the file content with digest `content` to `target`, checking
+    // every chunk on the way. `target` is only replaced once all of it
+    // checked out. Returns the number of bytes written.
+    std::uint64_t get_file(Digest const &content,
+                           std::filesystem::path const &target) const;
+
+    // Numbers of the versions, oldest first.
+    [[nodiscard]] std::vector<std::uint64_t> versions() const;
+
+    [[nodiscard]] std::filesystem::path
+    version_path(std::uint64_t version) const;
+
+    // The newest version taken of directory `dir`, 0 if there is none.
+    [[nodiscard]] std::uint64_t
+    latest_of(std::filesystem::path const &dir) const;
+
+    // Where the snapshot of the next version is written, before
+    // `add_version`.
+    [[nodiscard]] std::filesystem::path staging_path() const;
+
+    // Makes the snapshot at `staging_path()` the newest version. Returns its
+    // number.
+    std::uint64_t add_version();
+
+    struct PruneResult {
+        std::size_t versions{0};
+        std::size_t files{0};
+        std::size_t chunks{0};
+        std::uint64_t bytes{0}; // Freed, including leftover temporaries
+    };
+
+    // Deletes all but the newest `keep` versions, then every file content
+    // that no remaining version has and every chunk no remaining file
+    // content is made of.
+    PruneResult prune(std::size_t keep);
+
+  private:
+    [[nodiscard]] std::filesystem::path
+    chunk_path(Digest const &digest) const;
+
+    [[nodiscard]] std::filesystem::path
+    file_path(Digest const &content) const;
+
+    // Digests of the chunks of the stored content `content`.
+    [[nodiscard]] std::vector<Digest> recipe(Digest const &content) const;
+
+    std::filesystem::path root_;
+};
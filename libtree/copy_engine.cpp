@@ -0,0 +1,405 @@
+#include <libtree/copy_engine.hpp>
+#include <libtree/file_reader.hpp>
+#include <libtree/metrics.hpp>
+
+#include <algorithm>
+#include <array>
+#include <cerrno>
+#include <cstring>
+#include <deque>
+#include <system_error>
+#include <utility>
+#include <vector>
+
+#if defined(__linux__)
+#include <fcntl.h>
+#include <linux/fs.h>
+#include <sys/ioctl.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+namespace {
+
+std::uint64_t copy_generic(std::filesystem::path const &source,
+                           std::filesystem::path const &target)
+{
+    namespace fs = std::filesystem;
+    // Devices, pipes and the like would only be half copied, if at all.
+    if (!fs::is_regular_file(source)) {
+        throw fs::filesystem_error{
+            "can't copy, not a regular file", source,
+            std::make_error_code(std::errc::not_supported)};
+    }
+    fs::copy(source, target, fs::copy_options::overwrite_existing);
+    fs::last_write_time(target, fs::last_write_time(source));
+    std::error_code ec;
+    auto const size{fs::file_size(target, ec)};
+    return ec ? 0 : size;
+}
+
+#if defined(__linux__)
+
+class FileDescriptor {
+  public:
+    explicit FileDescriptor(int fd) : fd_(fd) {}
+
+    FileDescriptor(FileDescriptor const &) = delete;
+    FileDescriptor &operator=(FileDescriptor const &) = delete;
+
+    ~FileDescriptor()
+    {
+        if (fd_ >= 0) {
+            ::close(fd_);
+        }
+    }
+
+    [[nodiscard]] int get() const
+    {
+        return fd_;
+    }
+
+  private:
+    int fd_;
+};
+
+[[noreturn]] void throw_errno(char const *what,
+                              std::filesystem::path const &path)
+{
+    throw std::filesystem::filesystem_error{
+        what, path, std::error_code{errno, std::system_category()}};
+}
+
+// Copies with copy_file_range. Returns false, having copied nothing, if the
+// kernel or file system can't (e.g. across file systems on older kernels).
+bool copy_in_kernel(int in, int out, std::filesystem::path const &target)
+{
+    bool copied{false};
+    for (;;) {
+        auto const n{::copy_file_range(in, nullptr, out, nullptr, 1U << 30, 0)};
+        if (n > 0) {
+            copied = true;
+            continue;
+        }
+        if (n == 0) {
+            return true;
+        }
+        if (errno == EINTR) {
+            continue;
+        }
+        if (!copied && (errno == EXDEV || errno == ENOSYS ||
+                        errno == EINVAL || errno == EOPNOTSUPP)) {
+            return false;
+        }
+        throw_errno("can't copy to", target);
+    }
+}
+
+// Reads up to `n` bytes at `offset`, fewer only at end of file.
+std::size_t read_at(int fd, unsigned char *p, std::size_t n, off_t offset,
+                    std::filesystem::path const &path)
+{
+    std::size_t done{};
+    while (done != n) {
+        auto const r{::pread(fd, p + done, n - done,
+                             offset + static_cast<off_t>(done))};
+        if (r == 0) {
+            break;
+        }
+        if (r < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            throw_errno("can't read", path);
+        }
+        done += static_cast<std::size_t>(r);
+    }
+    return done;
+}
+
+void write_at(int fd, unsigned char const *p, std::size_t n, off_t offset,
+              std::filesystem::path const &path)
+{
+    std::size_t done{};
+    while (done != n) {
+        auto const w{::pwrite(fd, p + done, n - done,
+                              offset + static_cast<off_t>(done))};
+        if (w < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            throw_errno("can't write", path);
+        }
+        done += static_cast<std::size_t>(w);
+    }
+}
+
+// Reads `in` once, writing every block to each of `outs`.
+void copy_in_user(int in, std::span<int const> outs,
+                  std::filesystem::path const &source,
+                  std::span<std::filesystem::path const> targets)
+{
+    std::array<char, 1U << 17> buffer;
+    for (;;) {
+        auto const n{::read(in, buffer.data(), buffer.size())};
+        if (n == 0) {
+            return;
+        }
+        if (n < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            throw_errno("can't read", source);
+        }
+        for (std::size_t k{}; k != outs.size(); ++k) {
+            for (ssize_t done{}; done != n;) {
+                auto const w{::write(outs[k], buffer.data() + done,
+                                     static_cast<std::size_t>(n - done))};
+                if (w < 0) {
+                    if (errno == EINTR) {
+                        continue;
+                    }
+                    throw_errno("can't write", targets[k]);
+                }
+                done += w;
+            }
+        }
+    }
+}
+
+void copy_times(int out, struct stat const &from,
+                std::filesystem::path const &target)
+{
+    // Same nanoseconds as the source, so a rescan sees an unchanged file.
+    std::array<timespec, 2> const times{from.st_atim, from.st_mtim};
+    if (::futimens(out, times.data()) != 0) {
+        throw_errno("can't set times of", target);
+    }
+}
+
+#endif
+
+} // namespace
+
+std::filesystem::path temporary_path(std::filesystem::path const &target)
+{
+    // Hidden, and not a name anyone would give a file of their own.
+    return target.parent_path() /
+           ("." + target.filename().string() + ".tree-tmp");
+}
+
+std::uint64_t transfer_file(std::filesystem::path const &source,
+                            std::filesystem::path const &target)
+{
+#if defined(__linux__)
+    FileDescriptor const in{::open(source.c_str(), O_RDONLY | O_CLOEXEC)};
+    if (in.get() < 0) {
+        throw_errno("can't open", source);
+    }
+    struct stat st{};
+    if (::fstat(in.get(), &st) != 0) {
+        throw_errno("can't stat", source);
+    }
+    if (!S_ISREG(st.st_mode)) {
+        return copy_generic(source, target);
+    }
+
+    FileDescriptor const out{::open(target.c_str(),
+                                    O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC,
+                                    st.st_mode & 07777)};
+    if (out.get() < 0) {
+        throw_errno("can't create", target);
+    }
+
+    // Files reporting size 0 may still have contents (procfs and the like),
+    // only a plain read finds out.
+    if (st.st_size == 0 || (::ioctl(out.get(), FICLONE, in.get()) != 0 &&
+                            !copy_in_kernel(in.get(), out.get(), target))) {
+        copy_in_user(in.get(), std::array{out.get()}, source, {&target, 1});
+    }
+
+    copy_times(out.get(), st, target);
+    return static_cast<std::uint64_t>(st.st_size);
+#else
+    return copy_generic(source, target);
+#endif
+}
+
+std::uint64_t transfer_file(std::filesystem::path const &source,
+                            std::span<std::filesystem::path const> targets)
+{
+    if (targets.size() == 1) {
+        return transfer_file(source, targets.front());
+    }
+#if defined(__linux__)
+    FileDescriptor const in{::open(source.c_str(), O_RDONLY | O_CLOEXEC)};
+    if (in.get() < 0) {
+        throw_errno("can't open", source);
+    }
+    struct stat st{};
+    if (::fstat(in.get(), &st) != 0) {
+        throw_errno("can't stat", source);
+    }
+    if (!S_ISREG(st.st_mode)) {
+        std::uint64_t written{};
+        for (auto const &target : targets) {
+            written += copy_generic(source, target);
+        }
+        return written;
+    }
+
+    // Targets on the source's file system share its extents; the others
+    // are written from one read of the source. copy_file_range would read
+    // it again for every target.
+    std::deque<FileDescriptor> outs;
+    std::vector<int> rest;
+    std::vector<std::filesystem::path> restTargets;
+    for (auto const &target : targets) {
+        auto const &out{outs.emplace_back(::open(
+            target.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC,
+            st.st_mode & 07777))};
+        if (out.get() < 0) {
+            throw_errno("can't create", target);
+        }
+        if (st.st_size == 0 || ::ioctl(out.get(), FICLONE, in.get()) != 0) {
+            rest.push_back(out.get());
+            restTargets.push_back(target);
+        }
+    }
+    if (!rest.empty()) {
+        copy_in_user(in.get(), rest, source, restTargets);
+    }
+
+    for (std::size_t k{}; k != targets.size(); ++k) {
+        copy_times(outs[k].get(), st, targets[k]);
+    }
+    return static_cast<std::uint64_t>(st.st_size) * targets.size();
+#else
+    std::uint64_t written{};
+    for (auto const &target : targets) {
+        written += transfer_file(source, target);
+    }
+    return written;
+#endif
+}
+
+std::uint64_t delta_transfer_file(std::filesystem::path const &source,
+                                  std::filesystem::path const &target,
+                                  std::size_t block_size)
+{
+#if defined(__linux__)
+    struct stat from{};
+    if (::stat(source.c_str(), &from) != 0) {
+        throw_errno("can't stat", source);
+    }
+    FileDescriptor const out{::open(target.c_str(), O_RDWR | O_CLOEXEC)};
+    struct stat to{};
+    if (!S_ISREG(from.st_mode) || out.get() < 0 ||
+        ::fstat(out.get(), &to) != 0 || !S_ISREG(to.st_mode)) {
+        return transfer_file(source, target);
+    }
+
+    MappedFile const file{source};
+    auto const bytes{file.data()};
+    auto const oldSize{static_cast<std::size_t>(to.st_size)};
+    std::vector<unsigned char> block(block_size);
+    std::uint64_t written{};
+
+    // Adjacent changed blocks are written with one pwrite.
+    std::size_t dirty{0};
+    auto flush{[&](std::size_t end) {
+        if (end != dirty) {
+            write_at(out.get(), bytes.data() + dirty, end - dirty,
+                     static_cast<off_t>(dirty), target);
+            written += end - dirty;
+        }
+    }};
+    for (std::size_t offset{}; offset < bytes.size(); offset += block_size) {
+        auto const n{std::min(block_size, bytes.size() - offset)};
+        bool const same{offset + n <= oldSize &&
+                        read_at(out.get(), block.data(), n,
+                                static_cast<off_t>(offset), target) == n &&
+                        std::memcmp(block.data(), bytes.data() + offset, n) ==
+                            0};
+        if (same) {
+            flush(offset);
+            dirty = offset + n;
+        }
+    }
+    flush(bytes.size());
+
+    if (oldSize != bytes.size() &&
+        ::ftruncate(out.get(), static_cast<off_t>(bytes.size())) != 0) {
+        throw_errno("can't truncate", target);
+    }
+    copy_times(out.get(), from, target);
+    return written;
+#else
+    (void)block_size;
+    return transfer_file(source, target);
+#endif
+}
+
+CopyEngine::CopyEngine(std::size_t jobs)
+{
+    if (jobs > 1) {
+        pool_.emplace(jobs);
+        group_.emplace(*pool_);
+    }
+}
+
+CopyEngine::CopyEngine(ThreadPool *pool)
+{
+    if (pool != nullptr) {
+        group_.emplace(*pool);
+    }
+}
+
+template <typename F> void CopyEngine::dispatch(F f, std::size_t files)
+{
+    auto copy{[this, f{std::move(f)}, files] {
+        auto const n{f()};
+        written_ += n;
+        Metrics::add(Counter::files_copied, files);
+        Metrics::add(Counter::bytes_copied, n);
+    }};
+    if (!group_) {
+        copy();
+        return;
+    }
+    group_->run(std::move(copy));
+}
+
+void CopyEngine::submit(std::filesystem::path source,
+                        std::filesystem::path target)
+{
+    dispatch([source{std::move(source)}, target{std::move(target)}] {
+        return transfer_file(source, target);
+    });
+}
+
+void CopyEngine::submit(std::filesystem::path source,
+                        std::vector<std::filesystem::path> targets)
+{
+    auto const files{targets.size()};
+    dispatch(
+        [source{std::move(source)}, targets{std::move(targets)}] {
+            return transfer_file(source, targets);
+        },
+        files);
+}
+
+void CopyEngine::submit_delta(std::filesystem::path source,
+                              std::filesystem::path target)
+{
+    dispatch([source{std::move(source)}, target{std::move(target)}] {
+        return delta_transfer_file(source, target);
+    });
+}
+
+void CopyEngine::wait()
+{
+    if (group_) {
+        group_->wait();
+    }
+}
@@ -0,0 +1,85 @@
+#pragma once
+
+#include <libtree/thread_pool.hpp>
+
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <filesystem>
+#include <optional>
+#include <span>
+#include <vector>
+
+// Where a new version of `target` is written, next to it, before it's
+// renamed over it: a write that fails halfway leaves `target` as it was.
+std::filesystem::path temporary_path(std::filesystem::path const &target);
+
+// Copies `source` over `target` and gives it the source's mtime. Returns the
+// number of bytes written.
+//
+// On Linux, regular files are first cloned (FICLONE, shares the extents on
+// btrfs/XFS/bcachefs), then copied in the kernel with copy_file_range, and
+// only then read and written through a buffer. On other platforms, files go
+// through std::filesystem::copy. Anything but a regular file (or a symlink
+// to one) isn't copied: that throws.
+std::uint64_t transfer_file(std::filesystem::path const &source,
+                            std::filesystem::path const &target);
+
+// Same, for several targets at once, e.g. replicas of one tree: the source
+// is read once, each block written to every target that wasn't cloned.
+// Returns the number of bytes written, to all targets together.
+std::uint64_t transfer_file(std::filesystem::path const &source,
+                            std::span<std::filesystem::path const> targets);
+
+inline constexpr std::size_t delta_block_size{64U << 10};
+
+// Like `transfer_file`, but rewrites an existing `target` in place: blocks
+// at the same offset in both files are compared and only the ranges that
+// differ are written, so the bytes written follow the size of the change
+// rather than the size of the file. Falls back to `transfer_file` if
+// `target` isn't a regular file, and off Linux.
+std::uint64_t delta_transfer_file(std::filesystem::path const &source,
+                                  std::filesystem::path const &target,
+                                  std::size_t block_size = delta_block_size);
+
+// Keeps up to `jobs` file copies in flight. Copying many small files is
+// bound by per-file latency (open, create, close, set time) rather than by
+// bandwidth, so overlapping copies is what makes it faster.
+class CopyEngine {
+  public:
+    // With 1 job, `submit` copies right away on the calling thread.
+    explicit CopyEngine(std::size_t jobs);
+
+    // Copies as tasks of `pool`, shared with other work, or right away
+    // without one.
+    explicit CopyEngine(ThreadPool *pool);
+
+    CopyEngine(CopyEngine const &) = delete;
+    CopyEngine &operator=(CopyEngine const &) = delete;
+
+    void submit(std::filesystem::path source, std::filesystem::path target);
+
+    // Submits a copy to several targets, which count as a file copied each.
+    void submit(std::filesystem::path source,
+                std::vector<std::filesystem::path> targets);
+
+    // Submits a `delta_transfer_file`.
+    void submit_delta(std::filesystem::path source,
+                      std::filesystem::path target);
+
+    // Waits for all submitted copies. Rethrows the first failure.
+    void wait();
+
+    // Bytes written by the copies finished so far.
+    [[nodiscard]] std::uint64_t bytes_written() const
+    {
+        return written_;
+    }
+
+  private:
+    template <typename F> void dispatch(F f, std::size_t files = 1);
+
+    std::atomic<std::uint64_t> written_{0};
+    std::optional<ThreadPool> pool_;
+    std::optional<TaskGroup> group_;
+};
@@ -0,0 +1,326 @@
+#include <libtree/directory.hpp>
+#include <libtree/metrics.hpp>
+
+#include <algorithm>
+#include <array>
+#include <cerrno>
+#include <chrono>
+#include <string_view>
+#include <system_error>
+#include <utility>
+
+#if defined(__linux__)
+#include <dirent.h>
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <sys/sysmacros.h>
+#include <unistd.h>
+#endif
+
+namespace {
+
+namespace fs = std::filesystem;
+
+[[noreturn]] void throw_errno(char const *what, fs::path const &path)
+{
+    throw fs::filesystem_error{
+        what, path, std::error_code{errno, std::system_category()}};
+}
+
+void sort_by_name(std::vector<DirEntry> &entries)
+{
+    // Same order as sorting the relative paths of one directory.
+    std::ranges::sort(entries, {}, &DirEntry::name);
+}
+
+#if defined(__linux__)
+
+FileType type_of_mode(unsigned mode)
+{
+    switch (mode & S_IFMT) {
+    case S_IFREG:
+        return FileType::regular;
+    case S_IFDIR:
+        return FileType::directory;
+    case S_IFLNK:
+        return FileType::symlink;
+    default:
+        return FileType::other;
+    }
+}
+
+FileType type_of_dirent(unsigned char type)
+{
+    switch (type) {
+    case DT_UNKNOWN:
+        return FileType::unknown;
+    case DT_REG:
+        return FileType::regular;
+    case DT_DIR:
+        return FileType::directory;
+    case DT_LNK:
+        return FileType::symlink;
+    default:
+        return FileType::other;
+    }
+}
+
+std::int64_t unix_nanoseconds(struct statx_timestamp const &t)
+{
+    return std::int64_t{t.tv_sec} * 1'000'000'000 + t.tv_nsec;
+}
+
+FileIdentity identity_of(struct statx const &sx)
+{
+    return FileIdentity{
+        .device = ::makedev(sx.stx_dev_major, sx.stx_dev_minor),
+        .inode = sx.stx_ino,
+        .size = sx.stx_size,
+        .mtime = unix_nanoseconds(sx.stx_mtime),
+        .ctime = unix_nanoseconds(sx.stx_ctime),
+    };
+}
+
+// What fs::last_write_time would have returned.
+std::int64_t file_clock_ticks(struct statx_timestamp const &t)
+{
+    using namespace std::chrono;
+    sys_time<nanoseconds> const time{seconds{t.tv_sec} +
+                                     nanoseconds{t.tv_nsec}};
+    return time_point_cast<fs::file_time_type::duration>(
+               file_clock::from_sys(time))
+        .time_since_epoch()
+        .count();
+}
+
+constexpr unsigned statx_mask{STATX_TYPE | STATX_MODE | STATX_INO |
+                              STATX_SIZE | STATX_MTIME | STATX_CTIME};
+
+#else
+
+FileType type_of_status(fs::file_status const &status)
+{
+    switch (status.type()) {
+    case fs::file_type::not_found:
+    case fs::file_type::none:
+    case fs::file_type::unknown:
+        return FileType::unknown;
+    case fs::file_type::regular:
+        return FileType::regular;
+    case fs::file_type::directory:
+        return FileType::directory;
+    case fs::file_type::symlink:
+        return FileType::symlink;
+    default:
+        return FileType::other;
+    }
+}
+
+#endif
+
+} // namespace
+
+#if defined(__linux__)
+
+DirectoryHandle::DirectoryHandle(fs::path const &path)
+    : fd_(::open(path.c_str(), O_RDONLY | O_DIRECTORY | O_CLOEXEC)),
+      path_(path)
+{
+    if (fd_ < 0) {
+        throw_errno("can't open directory", path_);
+    }
+}
+
+DirectoryHandle::DirectoryHandle(DirectoryHandle const &parent,
+                                 std::string const &name, bool follow)
+    : fd_(::openat(parent.fd_, name.c_str(),
+                   O_RDONLY | O_DIRECTORY | O_CLOEXEC |
+                       (follow ? 0 : O_NOFOLLOW))),
+      path_(parent.path_ / name), parent_(&parent)
+{
+    if (fd_ < 0) {
+        throw_errno("can't open directory", path_);
+    }
+}
+
+DirectoryHandle::DirectoryHandle(DirectoryHandle &&other) noexcept
+    : fd_(std::exchange(other.fd_, -1)), path_(std::move(other.path_)),
+      parent_(other.parent_)
+{
+}
+
+DirectoryHandle::~DirectoryHandle()
+{
+    if (fd_ >= 0) {
+        ::close(fd_);
+    }
+}
+
+std::vector<DirEntry> DirectoryHandle::entries()
+{
+    std::vector<DirEntry> entries;
+    alignas(dirent64) std::array<char, 32U << 10> buffer;
+    for (;;) {
+        auto const n{::getdents64(fd_, buffer.data(), buffer.size())};
+        if (n == 0) {
+            break;
+        }
+        if (n < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            throw_errno("can't read directory", path_);
+        }
+        for (auto const *p{buffer.data()}; p < buffer.data() + n;) {
+            auto const &d{*reinterpret_cast<dirent64 const *>(p)};
+            p += d.d_reclen;
+            std::string_view const name{d.d_name};
+            if (name == "." || name == "..") {
+                continue;
+            }
+            entries.push_back({std::string{name}, type_of_dirent(d.d_type)});
+        }
+    }
+    sort_by_name(entries);
+    return entries;
+}
+
+FileStat DirectoryHandle::stat(std::string const &name) const
+{
+    FileStat st;
+    struct statx sx{};
+    Metrics::add(Counter::stat_calls);
+    if (::statx(fd_, name.c_str(), AT_SYMLINK_NOFOLLOW | AT_NO_AUTOMOUNT,
+                statx_mask, &sx) != 0) {
+        return st; // Gone since it was listed
+    }
+    st.type = type_of_mode(sx.stx_mode);
+    st.identity = identity_of(sx);
+
+    // Symlinks stand for what they point to: the file, or the directory.
+    if (st.type == FileType::symlink) {
+        Metrics::add(Counter::stat_calls);
+        if (::statx(fd_, name.c_str(), AT_NO_AUTOMOUNT, statx_mask, &sx) !=
+            0) {
+            return st; // Dangling
+        }
+        if (S_ISDIR(sx.stx_mode) && !loops(name)) {
+            st.directory = true;
+            st.identity = identity_of(sx);
+        }
+    }
+    else {
+        st.directory = st.type == FileType::directory;
+    }
+    st.regular = S_ISREG(sx.stx_mode);
+    st.size = st.regular ? sx.stx_size : 0;
+    st.mtime = file_clock_ticks(sx.stx_mtime);
+    return st;
+}
+
+std::optional<FileIdentity> DirectoryHandle::identity() const
+{
+    Metrics::add(Counter::stat_calls);
+    struct statx sx{};
+    if (::statx(fd_, "", AT_EMPTY_PATH, statx_mask, &sx) != 0) {
+        return std::nullopt;
+    }
+    return identity_of(sx);
+}
+
+bool DirectoryHandle::loops(std::string const &name) const
+{
+    struct statx target{};
+    Metrics::add(Counter::stat_calls);
+    if (::statx(fd_, name.c_str(), AT_NO_AUTOMOUNT, statx_mask, &target) !=
+        0) {
+        return false;
+    }
+    for (auto const *dir{this}; dir != nullptr; dir = dir->parent_) {
+        struct statx sx{};
+        Metrics::add(Counter::stat_calls);
+        if (::statx(dir->fd_, "", AT_EMPTY_PATH, statx_mask, &sx) == 0 &&
+            sx.stx_ino == target.stx_ino &&
+            sx.stx_dev_major == target.stx_dev_major &&
+            sx.stx_dev_minor == target.stx_dev_minor) {
+            return true;
+        }
+    }
+    return false;
+}
+
+#else
+
+DirectoryHandle::DirectoryHandle(fs::path const &path) : path_(path)
+{
+    if (!fs::is_directory(path_)) {
+        throw fs::filesystem_error{
+            "can't open directory", path_,
+            std::make_error_code(std::errc::not_a_directory)};
+    }
+}
+
+DirectoryHandle::DirectoryHandle(DirectoryHandle const &parent,
+                                 std::string const &name, bool /*follow*/)
+    : DirectoryHandle(parent.path_ / name)
+{
+    parent_ = &parent;
+}
+
+DirectoryHandle::DirectoryHandle(DirectoryHandle &&other) noexcept = default;
+
+DirectoryHandle::~DirectoryHandle() = default;
+
+std::vector<DirEntry> DirectoryHandle::entries()
+{
+    std::vector<DirEntry> entries;
+    for (auto const &entry : fs::directory_iterator(path_)) {
+        std::error_code ec;
+        entries.push_back({entry.path().filename().string(),
+                           type_of_status(entry.symlink_status(ec))});
+    }
+    sort_by_name(entries);
+    return entries;
+}
+
+FileStat DirectoryHandle::stat(std::string const &name) const
+{
+    FileStat st;
+    auto const path{path_ / name};
+    std::error_code ec;
+    Metrics::add(Counter::stat_calls, 3);
+    st.type = type_of_status(fs::symlink_status(path, ec));
+    st.regular = fs::is_regular_file(path, ec);
+    st.directory = fs::is_directory(path, ec) &&
+                   (st.type != FileType::symlink || !loops(name));
+    st.size = st.regular ? fs::file_size(path, ec) : 0;
+    st.mtime = fs::last_write_time(path, ec).time_since_epoch().count();
+    if (ec) {
+        st.mtime = 0;
+    }
+    // That of a symlink says nothing about the directory it links to.
+    if (st.type != FileType::symlink || !st.directory) {
+        bool isDirectory{};
+        st.identity = identify(path, isDirectory);
+    }
+    return st;
+}
+
+std::optional<FileIdentity> DirectoryHandle::identity() const
+{
+    bool isDirectory{};
+    return identify(path_, isDirectory);
+}
+
+bool DirectoryHandle::loops(std::string const &name) const
+{
+    for (auto const *dir{this}; dir != nullptr; dir = dir->parent_) {
+        std::error_code ec;
+        if (fs::equivalent(path_ / name, dir->path_, ec)) {
+            return true;
+        }
+    }
+    return false;
+}
+
+#endif
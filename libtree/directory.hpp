@@ -0,0 +1,88 @@
+#pragma once
+
+#include <libtree/hash_cache.hpp>
+
+#include <cstdint>
+#include <filesystem>
+#include <optional>
+#include <string>
+#include <vector>
+
+// Type of a directory entry itself: symlinks aren't followed.
+enum class FileType : std::uint8_t {
+    unknown, // The file system didn't say, or the entry is gone
+    regular,
+    directory,
+    symlink,
+    other, // Devices, sockets, pipes
+};
+
+struct DirEntry {
+    std::string name;
+    FileType type; // From the directory listing, unknown if it doesn't say
+};
+
+// What a scan needs from a file's inode.
+struct FileStat {
+    FileType type{FileType::unknown};
+
+    // The entry, or what it links to, is a regular file.
+    bool regular{false};
+
+    // The entry, or what it links to, is a directory, to be scanned as one.
+    // Not for a symlink leading back to the directory it is in or to one
+    // above it: following it would never end.
+    bool directory{false};
+
+    // Size and last write time through symlinks, as FileNode keeps them:
+    // the size only of regular files, the time in file clock ticks, and
+    // both 0 for dangling symlinks and entries that are gone.
+    std::uint64_t size{0};
+    std::int64_t mtime{0};
+
+    // Of the entry itself, or of the directory a symlink links to; nullopt
+    // on platforms without inode numbers.
+    std::optional<FileIdentity> identity;
+};
+
+// An open directory that entries are listed and stat'ed relative to, so that
+// a scan resolves every path component once instead of once per file below
+// it. On Linux, entries are read in bulk with getdents64 and stat'ed with
+// one statx each (two for symlinks); elsewhere this goes through
+// std::filesystem.
+class DirectoryHandle {
+  public:
+    explicit DirectoryHandle(std::filesystem::path const &path);
+
+    // Opens subdirectory `name` of `parent`, following a symlink only with
+    // `follow`. `parent` has to stay open as long as the handle does.
+    DirectoryHandle(DirectoryHandle const &parent, std::string const &name,
+                    bool follow = false);
+
+    DirectoryHandle(DirectoryHandle &&other) noexcept;
+    DirectoryHandle &operator=(DirectoryHandle &&) = delete;
+    DirectoryHandle(DirectoryHandle const &) = delete;
+    DirectoryHandle &operator=(DirectoryHandle const &) = delete;
+
+    ~DirectoryHandle();
+
+    // All entries but "." and "..", sorted by name. Reads the directory
+    // once: call it at most once per handle.
+    std::vector<DirEntry> entries();
+
+    FileStat stat(std::string const &name) const;
+
+    // Identity of the directory itself.
+    std::optional<FileIdentity> identity() const;
+
+  private:
+    // Whether symlink `name` leads to this directory or to one this handle
+    // was opened below.
+    bool loops(std::string const &name) const;
+
+#if defined(__linux__)
+    int fd_{-1};
+#endif
+    std::filesystem::path path_; // For error messages, and the fallback
+    DirectoryHandle const *parent_{nullptr};
+};
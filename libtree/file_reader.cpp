@@ -0,0 +1,105 @@
+#include <libtree/file_reader.hpp>
+
+#include <format>
+#include <fstream>
+#include <stdexcept>
+#include <utility>
+
+#if !defined(_WIN32)
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+BufferedFileReader::BufferedFileReader(std::filesystem::path const &path,
+                                       std::size_t buffer_size)
+    : file_(std::fopen(path.string().c_str(), "rb")), buffer_(buffer_size)
+{
+    if (file_ == nullptr) {
+        throw std::runtime_error{
+            std::format("can't open {} for reading", path.string())};
+    }
+    // Our buffer is already large, don't copy everything through stdio's.
+    std::setvbuf(file_, nullptr, _IONBF, 0);
+}
+
+BufferedFileReader::~BufferedFileReader()
+{
+    std::fclose(file_);
+}
+
+std::span<unsigned char const> BufferedFileReader::next()
+{
+    auto const n{std::fread(buffer_.data(), 1, buffer_.size(), file_)};
+    if (n == 0 && std::ferror(file_) != 0) {
+        throw std::runtime_error{"read error"};
+    }
+    return {buffer_.data(), n};
+}
+
+MappedFile::MappedFile(std::filesystem::path const &path, Access access)
+{
+#if !defined(_WIN32)
+    int const fd{::open(path.c_str(), O_RDONLY | O_CLOEXEC)};
+    if (fd < 0) {
+        throw std::runtime_error{
+            std::format("can't open {} for reading", path.string())};
+    }
+    struct stat st{};
+    if (::fstat(fd, &st) != 0) {
+        ::close(fd);
+        throw std::runtime_error{std::format("can't stat {}", path.string())};
+    }
+    size_ = static_cast<std::size_t>(st.st_size);
+    if (size_ != 0) {
+        void *p{::mmap(nullptr, size_, PROT_READ, MAP_PRIVATE, fd, 0)};
+        if (p == MAP_FAILED) {
+            ::close(fd);
+            throw std::runtime_error{
+                std::format("can't map {}", path.string())};
+        }
+        ::madvise(p, size_,
+                  access == Access::random ? MADV_RANDOM : MADV_SEQUENTIAL);
+        data_ = static_cast<unsigned char const *>(p);
+    }
+    ::close(fd);
+#else
+    static_cast<void>(access);
+    std::ifstream ifs(path, std::ios::binary);
+    if (!ifs) {
+        throw std::runtime_error{
+            std::format("can't open {} for reading", path.string())};
+    }
+    fallback_.assign(std::istreambuf_iterator<char>{ifs}, {});
+    data_ = fallback_.data();
+    size_ = fallback_.size();
+#endif
+}
+
+MappedFile::MappedFile(MappedFile &&other) noexcept
+    : data_(std::exchange(other.data_, nullptr)),
+      size_(std::exchange(other.size_, 0)),
+      fallback_(std::move(other.fallback_))
+{
+}
+
+MappedFile &MappedFile::operator=(MappedFile &&other) noexcept
+{
+    if (this != &other) {
+        MappedFile tmp{std::move(*this)};
+        data_ = std::exchange(other.data_, nullptr);
+        size_ = std::exchange(other.size_, 0);
+        fallback_ = std::move(other.fallback_);
+    }
+    return *this;
+}
+
+MappedFile::~MappedFile()
+{
+#if !defined(_WIN32)
+    if (data_ != nullptr) {
+        ::munmap(const_cast<unsigned char *>(data_), size_);
+    }
+#endif
+}
@@ -0,0 +1,62 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdio>
+#include <filesystem>
+#include <span>
+#include <vector>
+
+// Reads a file front to back through one large reusable buffer, so hashing a
+// file costs one read syscall per `buffer_size` bytes.
+class BufferedFileReader {
+  public:
+    static constexpr std::size_t default_buffer_size{1U << 20};
+
+    explicit BufferedFileReader(std::filesystem::path const &path,
+                                std::size_t buffer_size = default_buffer_size);
+
+    BufferedFileReader(BufferedFileReader const &) = delete;
+    BufferedFileReader &operator=(BufferedFileReader const &) = delete;
+
+    ~BufferedFileReader();
+
+    // Returns the next block of the file, or an empty span at end of file.
+    // The block stays valid until the next call.
+    std::span<unsigned char const> next();
+
+  private:
+    std::FILE *file_{nullptr};
+    std::vector<unsigned char> buffer_;
+};
+
+// Read-only memory mapping of a whole file. Falls back to reading the file
+// into memory on platforms without mmap.
+class MappedFile {
+  public:
+    // How the mapping will be read, a hint for read-ahead.
+    enum class Access {
+        sequential, // Front to back, once
+        random,     // Scattered pages, only some of them
+    };
+
+    explicit MappedFile(std::filesystem::path const &path,
+                        Access access = Access::sequential);
+
+    MappedFile(MappedFile const &) = delete;
+    MappedFile &operator=(MappedFile const &) = delete;
+
+    MappedFile(MappedFile &&other) noexcept;
+    MappedFile &operator=(MappedFile &&other) noexcept;
+
+    ~MappedFile();
+
+    [[nodiscard]] std::span<unsigned char const> data() const
+    {
+        return {data_, size_};
+    }
+
+  private:
+    unsigned char const *data_{nullptr};
+    std::size_t size_{0};
+    std::vector<unsigned char> fallback_;
+};
@@ -0,0 +1,356 @@
+#include <libtree/filter.hpp>
+
+#include <format>
+#include <stdexcept>
+
+namespace {
+
+// Splits `pattern` at unescaped slashes.
+std::vector<std::string> split_pattern(std::string_view pattern)
+{
+    std::vector<std::string> parts(1);
+    for (std::size_t i{}; i != pattern.size(); ++i) {
+        if (pattern[i] == '\\' && i + 1 != pattern.size()) {
+            parts.back() += pattern.substr(i, 2);
+            ++i;
+        }
+        else if (pattern[i] == '/') {
+            parts.emplace_back();
+        }
+        else {
+            parts.back() += pattern[i];
+        }
+    }
+    return parts;
+}
+
+bool has_wildcards(std::string_view part)
+{
+    for (std::size_t i{}; i != part.size(); ++i) {
+        if (part[i] == '\\') {
+            ++i;
+        }
+        else if (part[i] == '*' || part[i] == '?' || part[i] == '[') {
+            return true;
+        }
+    }
+    return false;
+}
+
+std::string unescape(std::string_view part)
+{
+    std::string s;
+    for (std::size_t i{}; i != part.size(); ++i) {
+        if (part[i] == '\\' && i + 1 != part.size()) {
+            ++i;
+        }
+        s += part[i];
+    }
+    return s;
+}
+
+std::vector<std::string_view> split_path(std::string_view path)
+{
+    std::vector<std::string_view> parts;
+    while (!path.empty()) {
+        auto const slash{path.find('/')};
+        if (slash != 0) {
+            parts.push_back(path.substr(0, slash));
+        }
+        if (slash == std::string_view::npos) {
+            break;
+        }
+        path.remove_prefix(slash + 1);
+    }
+    return parts;
+}
+
+} // namespace
+
+bool PathFilter::Segment::matches(std::string_view name) const
+{
+    if (literal) {
+        return name == text;
+    }
+
+    // Tokens and name are walked together; on a mismatch after a star, the
+    // star takes one more character and the walk resumes from there.
+    std::size_t t{};
+    std::size_t n{};
+    std::size_t star{tokens.size()};
+    std::size_t resume{};
+    while (n != name.size()) {
+        if (t != tokens.size()) {
+            auto const &token{tokens[t]};
+            auto const c{static_cast<unsigned char>(name[n])};
+            if (token.kind == Token::Kind::star) {
+                star = t++;
+                resume = n;
+                continue;
+            }
+            if (token.kind == Token::Kind::chars &&
+                name.substr(n).starts_with(token.chars)) {
+                ++t;
+                n += token.chars.size();
+                continue;
+            }
+            if (token.kind == Token::Kind::any ||
+                (token.kind == Token::Kind::set && token.set.test(c))) {
+                ++t;
+                ++n;
+                continue;
+            }
+        }
+        if (star == tokens.size()) {
+            return false;
+        }
+        t = star + 1;
+        n = ++resume;
+    }
+    while (t != tokens.size() && tokens[t].kind == Token::Kind::star) {
+        ++t;
+    }
+    return t == tokens.size();
+}
+
+PathFilter::PathFilter(std::string_view text)
+{
+    add_rules(text);
+}
+
+void PathFilter::add_rules(std::string_view text)
+{
+    while (!text.empty()) {
+        auto const eol{text.find('\n')};
+        add(text.substr(0, eol));
+        if (eol == std::string_view::npos) {
+            break;
+        }
+        text.remove_prefix(eol + 1);
+    }
+}
+
+void PathFilter::add(std::string_view rule)
+{
+    using Token = Segment::Token;
+
+    auto const line{rule};
+    if (rule.ends_with('\r')) {
+        rule.remove_suffix(1);
+    }
+    // Trailing spaces don't count unless escaped.
+    while (rule.ends_with(' ') && !rule.ends_with("\\ ")) {
+        rule.remove_suffix(1);
+    }
+    if (rule.empty() || rule.starts_with('#')) {
+        return;
+    }
+
+    Rule compiled;
+    if (rule.starts_with('!')) {
+        compiled.negated = true;
+        rule.remove_prefix(1);
+    }
+    if (rule.ends_with('/')) {
+        compiled.directory_only = true;
+        rule.remove_suffix(1);
+    }
+    // A slash anywhere but at the end anchors the rule to the root.
+    bool anchored{split_pattern(rule).size() > 1};
+    if (rule.starts_with('/')) {
+        rule.remove_prefix(1);
+    }
+    auto parts{split_pattern(rule)};
+    if (anchored && parts.size() == 2 && parts[0] == "**") {
+        // "**/name" is just "name".
+        parts.erase(parts.begin());
+        anchored = false;
+    }
+
+    for (auto const &part : parts) {
+        if (part.empty()) {
+            throw std::invalid_argument{
+                std::format("empty path component in filter rule {}", line)};
+        }
+        Segment segment;
+        if (part == "**") {
+            segment.any_path = true;
+        }
+        else if (!has_wildcards(part)) {
+            segment.literal = true;
+            segment.text = unescape(part);
+        }
+        else {
+            for (std::size_t i{}; i != part.size(); ++i) {
+                auto const c{part[i]};
+                if (c == '*') {
+                    if (segment.tokens.empty() ||
+                        segment.tokens.back().kind != Token::Kind::star) {
+                        segment.tokens.push_back({Token::Kind::star, {}, {}});
+                    }
+                }
+                else if (c == '?') {
+                    segment.tokens.push_back({Token::Kind::any, {}, {}});
+                }
+                else if (c == '[') {
+                    Token token{Token::Kind::set, {}, {}};
+                    auto j{i + 1};
+                    bool const negate{j < part.size() &&
+                                      (part[j] == '!' || part[j] == '^')};
+                    if (negate) {
+                        ++j;
+                    }
+                    // A ']' right after the '[' is part of the set.
+                    for (bool first{true};
+                         j < part.size() && (part[j] != ']' || first);
+                         first = false) {
+                        auto lo{static_cast<unsigned char>(part[j])};
+                        if (lo == '\\' && j + 1 < part.size()) {
+                            lo = static_cast<unsigned char>(part[++j]);
+                        }
+                        auto hi{lo};
+                        if (j + 2 < part.size() && part[j + 1] == '-' &&
+                            part[j + 2] != ']') {
+                            hi = static_cast<unsigned char>(part[j + 2]);
+                            j += 2;
+                        }
+                        for (unsigned k{lo}; k <= hi; ++k) {
+                            token.set.set(k);
+                        }
+                        ++j;
+                    }
+                    if (j >= part.size()) {
+                        throw std::invalid_argument{std::format(
+                            "unterminated [ in filter rule {}", line)};
+                    }
+                    if (negate) {
+                        token.set.flip();
+                    }
+                    segment.tokens.push_back(std::move(token));
+                    i = j;
+                }
+                else {
+                    if (c == '\\' && i + 1 != part.size()) {
+                        ++i;
+                    }
+                    if (segment.tokens.empty() ||
+                        segment.tokens.back().kind != Token::Kind::chars) {
+                        segment.tokens.push_back({Token::Kind::chars, {}, {}});
+                    }
+                    segment.tokens.back().chars += part[i];
+                }
+            }
+        }
+        compiled.segments.push_back(std::move(segment));
+    }
+
+    auto const index{static_cast<std::uint32_t>(rules_.size())};
+    if (!anchored && compiled.segments.front().literal) {
+        names_[compiled.segments.front().text].push_back(index);
+        compiled.segments.clear();
+    }
+    else if (!anchored && !compiled.segments.front().any_path) {
+        name_globs_.push_back(index);
+    }
+    else {
+        // The literal leading components go into the trie, the rule keeps
+        // the rest.
+        std::uint32_t node{0};
+        std::size_t k{};
+        for (; k != compiled.segments.size() && compiled.segments[k].literal;
+             ++k) {
+            auto const &text{compiled.segments[k].text};
+            auto const it{trie_[node].children.find(text)};
+            if (it != trie_[node].children.end()) {
+                node = it->second;
+                continue;
+            }
+            auto const child{static_cast<std::uint32_t>(trie_.size())};
+            trie_[node].children.emplace(text, child);
+            trie_.emplace_back();
+            node = child;
+        }
+        compiled.segments.erase(compiled.segments.begin(),
+                                compiled.segments.begin() +
+                                    static_cast<std::ptrdiff_t>(k));
+        trie_[node].rules.push_back(index);
+    }
+    directory_rules_ = directory_rules_ || compiled.directory_only;
+    rules_.push_back(std::move(compiled));
+    text_ += line;
+    text_ += '\n';
+}
+
+bool PathFilter::matchSegments(std::span<Segment const> segments,
+                               Components path)
+{
+    if (segments.empty()) {
+        return path.empty();
+    }
+    if (segments.front().any_path) {
+        // A trailing "**" is everything inside, not the directory itself.
+        if (segments.size() == 1) {
+            return !path.empty();
+        }
+        for (std::size_t k{}; k <= path.size(); ++k) {
+            if (matchSegments(segments.subspan(1), path.subspan(k))) {
+                return true;
+            }
+        }
+        return false;
+    }
+    return !path.empty() && segments.front().matches(path.front()) &&
+           matchSegments(segments.subspan(1), path.subspan(1));
+}
+
+bool PathFilter::excludes(std::string_view relative, bool is_directory) const
+{
+    if (rules_.empty()) {
+        return false;
+    }
+    auto const parts{split_path(relative)};
+    if (parts.empty()) {
+        return false;
+    }
+
+    // Highest index of a matching rule so far, or -1.
+    std::int64_t best{-1};
+    auto applies{[&](std::uint32_t r) {
+        return r > best && (is_directory || !rules_[r].directory_only);
+    }};
+
+    if (auto const it{names_.find(parts.back())}; it != names_.end()) {
+        for (auto const r : it->second) {
+            if (applies(r)) {
+                best = r;
+            }
+        }
+    }
+    for (auto it{name_globs_.rbegin()};
+         it != name_globs_.rend() && *it > best; ++it) {
+        if (applies(*it) &&
+            rules_[*it].segments.front().matches(parts.back())) {
+            best = *it;
+            break;
+        }
+    }
+    std::uint32_t node{0};
+    for (std::size_t depth{};; ++depth) {
+        for (auto const r : trie_[node].rules) {
+            if (applies(r) &&
+                matchSegments(rules_[r].segments,
+                              Components{parts}.subspan(depth))) {
+                best = r;
+            }
+        }
+        if (depth == parts.size()) {
+            break;
+        }
+        auto const it{trie_[node].children.find(parts[depth])};
+        if (it == trie_[node].children.end()) {
+            break;
+        }
+        node = it->second;
+    }
+    return best >= 0 && !rules_[best].negated;
+}
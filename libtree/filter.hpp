@@ -0,0 +1,112 @@
+#pragma once
+
+#include <bitset>
+#include <cstdint>
+#include <functional>
+#include <map>
+#include <span>
+#include <string>
+#include <string_view>
+#include <vector>
+
+// Which entries of a tree are scanned, from gitignore-style rules, one per
+// line:
+//
+//   build/         excludes every directory named "build"
+//   *.o            excludes matching names at any depth
+//   /out           excludes "out" at the root only (so does "doc/out")
+//   src/**/gen     "**" matches any number of directories
+//   !keep.o        includes again what an earlier rule excluded
+//   # comment      blank lines and comments are skipped
+//
+// The last rule that matches decides. A scan never enters an excluded
+// directory, so nothing below it can be included again.
+//
+// Rules are compiled when added: names without wildcards go into a hash of
+// names, rules anchored to the root are split into a leading run of literal
+// components, kept in a trie, and what follows, kept as compiled globs. A
+// lookup costs one hash probe, one trie walk along the path and only then
+// the globs that could still win.
+class PathFilter {
+  public:
+    PathFilter() = default;
+
+    // Adds the rules of `text`, one per line.
+    explicit PathFilter(std::string_view text);
+
+    void add_rules(std::string_view text);
+
+    // Adds one rule. Throws std::invalid_argument on a malformed pattern.
+    void add(std::string_view rule);
+
+    // The rules added, one per line, without comments and blank lines: what
+    // snapshots and the remote protocol record. Equal rules compile to equal
+    // filters.
+    [[nodiscard]] std::string const &rules() const
+    {
+        return text_;
+    }
+
+    [[nodiscard]] bool empty() const
+    {
+        return rules_.empty();
+    }
+
+    // Whether a rule only applies to directories, so that callers know if
+    // they need an entry's type.
+    [[nodiscard]] bool has_directory_rules() const
+    {
+        return directory_rules_;
+    }
+
+    // Whether the entry at `relative`, '/'-separated from the root (which
+    // is never excluded), is excluded. `is_directory` is about the entry
+    // itself: symlinks to directories aren't directories.
+    [[nodiscard]] bool excludes(std::string_view relative,
+                                bool is_directory) const;
+
+  private:
+    // One path component of a pattern.
+    struct Segment {
+        struct Token {
+            enum class Kind : std::uint8_t { chars, any, set, star };
+            Kind kind;
+            std::string chars;  // kind == chars
+            std::bitset<256> set; // kind == set
+        };
+
+        bool any_path{false}; // "**": any number of components
+        bool literal{false};  // No wildcards: `text` is the name
+        std::string text;
+        std::vector<Token> tokens; // Otherwise
+
+        [[nodiscard]] bool matches(std::string_view name) const;
+    };
+
+    struct Rule {
+        std::vector<Segment> segments; // After the literal trie prefix
+        bool negated{false};
+        bool directory_only{false};
+    };
+
+    struct TrieNode {
+        std::map<std::string, std::uint32_t, std::less<>> children;
+        std::vector<std::uint32_t> rules; // Match from here on
+    };
+
+    using Components = std::span<std::string_view const>;
+
+    static bool matchSegments(std::span<Segment const> segments,
+                              Components path);
+
+    std::string text_;
+    std::vector<Rule> rules_;
+    bool directory_rules_{false};
+
+    // Names without wildcards, matching at any depth.
+    std::map<std::string, std::vector<std::uint32_t>, std::less<>> names_;
+    // Single-component globs, matching at any depth.
+    std::vector<std::uint32_t> name_globs_;
+    // Rules anchored to the root, by their literal leading components.
+    std::vector<TrieNode> trie_{1};
+};
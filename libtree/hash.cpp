@@ -0,0 +1,338 @@
+#include <libtree/file_reader.hpp>
+#include <libtree/hash.hpp>
+#include <libtree/metrics.hpp>
+#include <libtree/thread_pool.hpp>
+
+#include <openssl/evp.h>
+
+#include <algorithm>
+#include <bit>
+#include <cstring>
+#include <memory>
+#include <stdexcept>
+#include <vector>
+
+namespace {
+
+struct EvpContextDeleter {
+    void operator()(EVP_MD_CTX *ctx) const
+    {
+        EVP_MD_CTX_free(ctx);
+    }
+};
+
+using EvpContext = std::unique_ptr<EVP_MD_CTX, EvpContextDeleter>;
+
+struct EvpMdDeleter {
+    void operator()(EVP_MD *md) const
+    {
+        EVP_MD_free(md);
+    }
+};
+
+// Fetched once: EVP_sha256() would be looked up again on every init.
+EVP_MD const *sha256_md()
+{
+    static std::unique_ptr<EVP_MD, EvpMdDeleter> const md{
+        EVP_MD_fetch(nullptr, "SHA256", nullptr)};
+    if (!md) {
+        throw std::runtime_error{"can't fetch sha256"};
+    }
+    return md.get();
+}
+
+EVP_MD_CTX *thread_context()
+{
+    thread_local EvpContext const ctx{EVP_MD_CTX_new()};
+    if (!ctx) {
+        throw std::runtime_error{"can't allocate a digest context"};
+    }
+    return ctx.get();
+}
+
+void sha256_into(EVP_MD_CTX *ctx, void const *data, std::size_t size,
+                 Digest &digest)
+{
+    if (EVP_DigestInit_ex(ctx, sha256_md(), nullptr) != 1 ||
+        EVP_DigestUpdate(ctx, data, size) != 1 ||
+        EVP_DigestFinal_ex(ctx, digest.data(), nullptr) != 1) {
+        throw std::runtime_error{"sha256 failed"};
+    }
+}
+
+Digest stream_sha256(std::filesystem::path const &path)
+{
+    auto *const ctx{thread_context()};
+    if (EVP_DigestInit_ex(ctx, sha256_md(), nullptr) != 1) {
+        throw std::runtime_error{"can't initialize sha256"};
+    }
+
+    BufferedFileReader reader{path};
+    for (auto block{reader.next()}; !block.empty(); block = reader.next()) {
+        EVP_DigestUpdate(ctx, block.data(), block.size());
+    }
+
+    Digest digest;
+    EVP_DigestFinal_ex(ctx, digest.data(), nullptr);
+    return digest;
+}
+
+Digest chunked_sha256(std::filesystem::path const &path, ThreadPool *pool)
+{
+    MappedFile const file{path};
+    return content_digest(file.data(), pool);
+}
+
+constexpr std::uint64_t xxh_prime1{0x9E3779B185EBCA87ULL};
+constexpr std::uint64_t xxh_prime2{0xC2B2AE3D27D4EB4FULL};
+constexpr std::uint64_t xxh_prime3{0x165667B19E3779F9ULL};
+constexpr std::uint64_t xxh_prime4{0x85EBCA77C2B2AE63ULL};
+constexpr std::uint64_t xxh_prime5{0x27D4EB2F165667C5ULL};
+
+std::uint64_t read64(unsigned char const *p)
+{
+    std::uint64_t v;
+    std::memcpy(&v, p, sizeof(v));
+    if constexpr (std::endian::native == std::endian::big) {
+        v = std::byteswap(v);
+    }
+    return v;
+}
+
+std::uint32_t read32(unsigned char const *p)
+{
+    std::uint32_t v;
+    std::memcpy(&v, p, sizeof(v));
+    if constexpr (std::endian::native == std::endian::big) {
+        v = std::byteswap(v);
+    }
+    return v;
+}
+
+std::uint64_t xxh_round(std::uint64_t acc, std::uint64_t input)
+{
+    acc += input * xxh_prime2;
+    acc = std::rotl(acc, 31);
+    return acc * xxh_prime1;
+}
+
+std::uint64_t xxh_merge(std::uint64_t acc, std::uint64_t v)
+{
+    acc ^= xxh_round(0, v);
+    return acc * xxh_prime1 + xxh_prime4;
+}
+
+// Folds the four lanes of a hash of at least 32 bytes together.
+std::uint64_t xxh_converge(std::array<std::uint64_t, 4> const &v)
+{
+    auto h{std::rotl(v[0], 1) + std::rotl(v[1], 7) + std::rotl(v[2], 12) +
+           std::rotl(v[3], 18)};
+    for (auto const lane : v) {
+        h = xxh_merge(h, lane);
+    }
+    return h;
+}
+
+// Mixes in the last, less than 32, bytes [p, end) and finalizes.
+std::uint64_t xxh_finish(std::uint64_t h, unsigned char const *p,
+                         unsigned char const *end)
+{
+    for (; end - p >= 8; p += 8) {
+        h ^= xxh_round(0, read64(p));
+        h = std::rotl(h, 27) * xxh_prime1 + xxh_prime4;
+    }
+    if (end - p >= 4) {
+        h ^= std::uint64_t{read32(p)} * xxh_prime1;
+        h = std::rotl(h, 23) * xxh_prime2 + xxh_prime3;
+        p += 4;
+    }
+    for (; p != end; ++p) {
+        h ^= *p * xxh_prime5;
+        h = std::rotl(h, 11) * xxh_prime1;
+    }
+
+    h ^= h >> 33;
+    h *= xxh_prime2;
+    h ^= h >> 29;
+    h *= xxh_prime3;
+    h ^= h >> 32;
+    return h;
+}
+
+} // namespace
+
+Digest sha256(std::span<unsigned char const> data)
+{
+    Digest digest;
+    sha256_into(thread_context(), data.data(), data.size(), digest);
+    return digest;
+}
+
+void Sha256Policy::hash_batch(std::span<std::string const> inputs,
+                              std::span<Digest> digests)
+{
+    auto *const ctx{thread_context()};
+    for (std::size_t i{}; i != inputs.size(); ++i) {
+        sha256_into(ctx, inputs[i].data(), inputs[i].size(), digests[i]);
+    }
+}
+
+Digest Xxh64x4Policy::hash(std::span<unsigned char const> data)
+{
+    Digest digest;
+    for (std::uint64_t lane{}; lane != 4; ++lane) {
+        auto h{xxh64(data, lane)};
+        if constexpr (std::endian::native == std::endian::big) {
+            h = std::byteswap(h);
+        }
+        std::memcpy(digest.data() + lane * sizeof(h), &h, sizeof(h));
+    }
+    return digest;
+}
+
+void Xxh64x4Policy::hash_batch(std::span<std::string const> inputs,
+                               std::span<Digest> digests)
+{
+    for (std::size_t i{}; i != inputs.size(); ++i) {
+        digests[i] =
+            hash({reinterpret_cast<unsigned char const *>(inputs[i].data()),
+                  inputs[i].size()});
+    }
+}
+
+Digest content_digest(std::span<unsigned char const> bytes, ThreadPool *pool)
+{
+    if (bytes.size() <= content_chunk_size) {
+        return sha256(bytes);
+    }
+    auto const chunks{(bytes.size() + content_chunk_size - 1) /
+                      content_chunk_size};
+    std::vector<Digest> digests(chunks);
+    auto hash_chunk{[&](std::size_t k) {
+        digests[k] = sha256(bytes.subspan(k * content_chunk_size,
+                                          std::min(content_chunk_size,
+                                                   bytes.size() -
+                                                       k * content_chunk_size)));
+    }};
+
+    if (pool != nullptr) {
+        TaskGroup group{*pool};
+        for (std::size_t k{}; k != chunks; ++k) {
+            group.run([&hash_chunk, k] { hash_chunk(k); });
+        }
+        group.wait();
+    }
+    else {
+        for (std::size_t k{}; k != chunks; ++k) {
+            hash_chunk(k);
+        }
+    }
+
+    return sha256({digests.front().data(), digests.size() * sizeof(Digest)});
+}
+
+Digest hash_file_content(std::filesystem::path const &path, ThreadPool *pool)
+{
+    namespace fs = std::filesystem;
+
+    Metrics::add(Counter::stat_calls);
+    if (!fs::is_regular_file(path)) {
+        Metrics::add(Counter::hash_calls);
+        return sha256({});
+    }
+    Metrics::add(Counter::stat_calls);
+    return hash_file_content(path, fs::file_size(path), pool);
+}
+
+Digest hash_file_content(std::filesystem::path const &path, std::uint64_t size,
+                         ThreadPool *pool)
+{
+    PhaseTimer const timer{Phase::hash};
+    Metrics::add(Counter::hash_calls);
+    Metrics::add(Counter::bytes_hashed, size);
+    if (size <= content_chunk_size) {
+        return stream_sha256(path);
+    }
+    return chunked_sha256(path, pool);
+}
+
+std::string to_hex(Digest const &digest)
+{
+    static constexpr char digits[]{"0123456789abcdef"};
+    std::string hex;
+    hex.reserve(digest.size() * 2);
+    for (auto const byte : digest) {
+        hex.push_back(digits[byte >> 4]);
+        hex.push_back(digits[byte & 0xF]);
+    }
+    return hex;
+}
+
+std::uint64_t xxh64(std::span<unsigned char const> data, std::uint64_t seed)
+{
+    auto const *p{data.data()};
+    auto const *const end{p + data.size()};
+    std::uint64_t h;
+
+    if (data.size() >= 32) {
+        std::array<std::uint64_t, 4> v{seed + xxh_prime1 + xxh_prime2,
+                                       seed + xxh_prime2, seed,
+                                       seed - xxh_prime1};
+        for (; end - p >= 32; p += 32) {
+            v[0] = xxh_round(v[0], read64(p));
+            v[1] = xxh_round(v[1], read64(p + 8));
+            v[2] = xxh_round(v[2], read64(p + 16));
+            v[3] = xxh_round(v[3], read64(p + 24));
+        }
+        h = xxh_converge(v);
+    }
+    else {
+        h = seed + xxh_prime5;
+    }
+    return xxh_finish(h + data.size(), p, end);
+}
+
+Xxh64State::Xxh64State(std::uint64_t seed)
+    : lanes_{seed + xxh_prime1 + xxh_prime2, seed + xxh_prime2, seed,
+             seed - xxh_prime1},
+      seed_(seed)
+{
+}
+
+void Xxh64State::update(std::span<unsigned char const> data)
+{
+    auto const *p{data.data()};
+    auto const *const end{p + data.size()};
+    total_ += data.size();
+    auto stripe{[this](unsigned char const *q) {
+        for (std::size_t i{}; i != lanes_.size(); ++i) {
+            lanes_[i] = xxh_round(lanes_[i], read64(q + 8 * i));
+        }
+    }};
+
+    // Tops up a partial stripe first.
+    if (buffered_ != 0) {
+        auto const n{std::min<std::size_t>(buffer_.size() - buffered_,
+                                           static_cast<std::size_t>(end - p))};
+        std::memcpy(buffer_.data() + buffered_, p, n);
+        buffered_ += n;
+        p += n;
+        if (buffered_ != buffer_.size()) {
+            return;
+        }
+        stripe(buffer_.data());
+        buffered_ = 0;
+    }
+    for (; end - p >= 32; p += 32) {
+        stripe(p);
+    }
+    buffered_ = static_cast<std::size_t>(end - p);
+    std::memcpy(buffer_.data(), p, buffered_);
+}
+
+std::uint64_t Xxh64State::digest() const
+{
+    auto const h{total_ >= 32 ? xxh_converge(lanes_) : seed_ + xxh_prime5};
+    return xxh_finish(h + total_, buffer_.data(),
+                      buffer_.data() + buffered_);
+}
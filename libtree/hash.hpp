@@ -0,0 +1,87 @@
+#pragma once
+
+#include <array>
+#include <cstddef>
+#include <cstdint>
+#include <filesystem>
+#include <span>
+#include <string>
+
+class ThreadPool;
+
+using Digest = std::array<unsigned char, 32>;
+
+// Files larger than this are hashed as independent chunks whose digests are
+// then hashed together, which lets the chunks be hashed in parallel. The
+// result doesn't depend on whether a pool was used.
+inline constexpr std::size_t content_chunk_size{8U << 20};
+
+// Reuses a per-thread digest context, so hashing many short inputs doesn't
+// pay OpenSSL's per-call context setup and algorithm lookup.
+Digest sha256(std::span<unsigned char const> data);
+
+// Hash policies choose the algorithm behind a tree's leaf and folder hashes
+// (the template argument of BasicMerkleTree). `id` is stored in snapshots
+// and hash caches, so hashes of different algorithms are never mixed up.
+// `hash_batch` hashes `inputs[i]` into `digests[i]` in one call.
+struct Sha256Policy {
+    static constexpr std::uint32_t id{0};
+
+    static Digest hash(std::span<unsigned char const> data)
+    {
+        return sha256(data);
+    }
+
+    static void hash_batch(std::span<std::string const> inputs,
+                           std::span<Digest> digests);
+};
+
+// Four XXH64 lanes with different seeds. Several times faster than SHA-256
+// on the short inputs of leaf hashes, but not collision resistant against
+// someone crafting files: only for trees whose contents are trusted.
+struct Xxh64x4Policy {
+    static constexpr std::uint32_t id{1};
+
+    static Digest hash(std::span<unsigned char const> data);
+
+    static void hash_batch(std::span<std::string const> inputs,
+                           std::span<Digest> digests);
+};
+
+// Digest of the file's bytes. Small files are streamed through a large
+// buffer, large ones are mapped and hashed chunk by chunk, on `pool` if given.
+// Anything that isn't a regular file hashes as empty content.
+Digest hash_file_content(std::filesystem::path const &path,
+                         ThreadPool *pool = nullptr);
+
+// Same, for a regular file the caller already knows to be `size` bytes.
+Digest hash_file_content(std::filesystem::path const &path, std::uint64_t size,
+                         ThreadPool *pool = nullptr);
+
+// What `hash_file_content` gives for a file holding `bytes`.
+Digest content_digest(std::span<unsigned char const> bytes,
+                      ThreadPool *pool = nullptr);
+
+std::string to_hex(Digest const &digest);
+
+// XXH64, a fast non-cryptographic checksum for detecting corrupt files.
+std::uint64_t xxh64(std::span<unsigned char const> data,
+                    std::uint64_t seed = 0);
+
+// XXH64 of data that comes in pieces: equals `xxh64` of everything passed
+// to `update`, in order.
+class Xxh64State {
+  public:
+    explicit Xxh64State(std::uint64_t seed = 0);
+
+    void update(std::span<unsigned char const> data);
+
+    [[nodiscard]] std::uint64_t digest() const;
+
+  private:
+    std::array<std::uint64_t, 4> lanes_;
+    std::array<unsigned char, 32> buffer_{}; // A partial stripe
+    std::size_t buffered_{0};
+    std::uint64_t total_{0};
+    std::uint64_t seed_;
+};
@@ -0,0 +1,218 @@
+#include <libtree/hash_cache.hpp>
+#include <libtree/metrics.hpp>
+#include <libtree/print.hpp>
+
+#include <algorithm>
+#include <array>
+#include <chrono>
+#include <fstream>
+#include <stdexcept>
+
+#if !defined(_WIN32)
+#include <sys/stat.h>
+#endif
+
+// File layout: Header, FileRecord[file_count], DirRecord[dir_count], names.
+struct HashCache::Header {
+    std::array<char, 8> magic;
+    std::uint32_t version;
+    std::uint32_t byte_order;
+    std::uint64_t file_count;
+    std::uint64_t dir_count;
+    std::uint64_t names_bytes;
+    std::uint64_t checksum; // XXH64 of everything following the header
+};
+
+namespace {
+
+constexpr std::array<char, 8> cache_magic{'M', 'T', 'R', 'E',
+                                          'E', 'C', 'C', 'H'};
+constexpr std::uint32_t cache_version{1};
+constexpr std::uint32_t cache_byte_order{0x01020304};
+
+// Coarsest timestamp granularity we expect from a file system (FAT has 2s).
+constexpr std::int64_t timestamp_slack{2'000'000'000};
+
+auto by_identity{[](auto const &record) -> FileIdentity const & {
+    return record.identity;
+}};
+
+} // namespace
+
+std::optional<FileIdentity> identify(std::filesystem::path const &path,
+                                     bool &is_directory)
+{
+#if !defined(_WIN32)
+    Metrics::add(Counter::stat_calls);
+    struct stat st{};
+    if (::lstat(path.c_str(), &st) != 0) {
+        return std::nullopt;
+    }
+    is_directory = S_ISDIR(st.st_mode);
+    return FileIdentity{
+        .device = static_cast<std::uint64_t>(st.st_dev),
+        .inode = static_cast<std::uint64_t>(st.st_ino),
+        .size = static_cast<std::uint64_t>(st.st_size),
+        .mtime = std::int64_t{st.st_mtim.tv_sec} * 1'000'000'000 +
+                 st.st_mtim.tv_nsec,
+        .ctime = std::int64_t{st.st_ctim.tv_sec} * 1'000'000'000 +
+                 st.st_ctim.tv_nsec,
+    };
+#else
+    return std::nullopt;
+#endif
+}
+
+HashCache::HashCache()
+    : opened_(std::chrono::duration_cast<std::chrono::nanoseconds>(
+                  std::chrono::system_clock::now().time_since_epoch())
+                  .count())
+{
+}
+
+HashCache::HashCache(std::filesystem::path const &path) : HashCache()
+{
+    if (!std::filesystem::exists(path)) {
+        return;
+    }
+
+    try {
+        MappedFile file{path};
+        auto const bytes{file.data()};
+        if (bytes.size() < sizeof(Header)) {
+            throw std::runtime_error{"truncated header"};
+        }
+        auto const &header{*reinterpret_cast<Header const *>(bytes.data())};
+        if (header.magic != cache_magic || header.version != cache_version ||
+            header.byte_order != cache_byte_order) {
+            throw std::runtime_error{"unknown format"};
+        }
+        auto const body{bytes.subspan(sizeof(Header))};
+        if (header.file_count * sizeof(FileRecord) +
+                    header.dir_count * sizeof(DirRecord) +
+                    header.names_bytes !=
+                body.size() ||
+            xxh64(body) != header.checksum) {
+            throw std::runtime_error{"corrupt"};
+        }
+
+        auto const *p{body.data()};
+        old_files_ = {reinterpret_cast<FileRecord const *>(p),
+                      header.file_count};
+        p += header.file_count * sizeof(FileRecord);
+        old_dirs_ = {reinterpret_cast<DirRecord const *>(p), header.dir_count};
+        p += header.dir_count * sizeof(DirRecord);
+        old_names_ = {reinterpret_cast<char const *>(p), header.names_bytes};
+        file_.emplace(std::move(file));
+    }
+    catch (std::exception const &e) {
+        errorln("Ignoring hash cache {}: {}", path.string(), e.what());
+        old_files_ = {};
+        old_dirs_ = {};
+        old_names_ = {};
+    }
+}
+
+HashCache::FileRecord const *
+HashCache::find_file(FileIdentity const &id) const
+{
+    auto const it{std::ranges::lower_bound(old_files_, id, {}, by_identity)};
+    return it != old_files_.end() && it->identity == id ? &*it : nullptr;
+}
+
+std::optional<std::vector<std::string>>
+HashCache::find_listing(FileIdentity const &id) const
+{
+    auto const it{std::ranges::lower_bound(old_dirs_, id, {}, by_identity)};
+    if (it == old_dirs_.end() || it->identity != id ||
+        it->names_offset + it->names_bytes > old_names_.size()) {
+        return std::nullopt;
+    }
+
+    std::vector<std::string> names;
+    auto blob{old_names_.substr(it->names_offset, it->names_bytes)};
+    while (!blob.empty()) {
+        auto const end{blob.find('\0')};
+        names.emplace_back(blob.substr(0, end));
+        blob.remove_prefix(end == std::string_view::npos ? blob.size()
+                                                         : end + 1);
+    }
+    return names;
+}
+
+bool HashCache::settled(FileIdentity const &id) const
+{
+    return std::max(id.mtime, id.ctime) < opened_ - timestamp_slack;
+}
+
+void HashCache::record_file(FileRecord const &record)
+{
+    if (!settled(record.identity)) {
+        return;
+    }
+    std::lock_guard lock{mutex_};
+    files_.push_back(record);
+}
+
+void HashCache::record_listing(FileIdentity const &id,
+                               std::span<std::string const> names)
+{
+    if (!settled(id)) {
+        return;
+    }
+    std::string blob;
+    for (auto const &name : names) {
+        blob += name;
+        blob += '\0';
+    }
+
+    std::lock_guard lock{mutex_};
+    dirs_.push_back({id, names_.size(), blob.size()});
+    names_ += blob;
+}
+
+void HashCache::save(std::filesystem::path const &path) const
+{
+    std::lock_guard lock{mutex_};
+
+    auto files{files_};
+    auto dirs{dirs_};
+    std::ranges::sort(files, {}, by_identity);
+    std::ranges::sort(dirs, {}, by_identity);
+    // The same entry may be scanned twice in one run (e.g. a tree rebuilt
+    // after syncing), keep one record.
+    files.erase(std::ranges::unique(files, {}, by_identity).begin(),
+                files.end());
+    dirs.erase(std::ranges::unique(dirs, {}, by_identity).begin(), dirs.end());
+
+    std::vector<unsigned char> body;
+    auto append{[&body](void const *data, std::size_t n) {
+        auto const *p{static_cast<unsigned char const *>(data)};
+        body.insert(body.end(), p, p + n);
+    }};
+    append(files.data(), files.size() * sizeof(FileRecord));
+    append(dirs.data(), dirs.size() * sizeof(DirRecord));
+    append(names_.data(), names_.size());
+
+    Header header{};
+    header.magic = cache_magic;
+    header.version = cache_version;
+    header.byte_order = cache_byte_order;
+    header.file_count = files.size();
+    header.dir_count = dirs.size();
+    header.names_bytes = names_.size();
+    header.checksum = xxh64(body);
+
+    auto tmp{path};
+    tmp += ".tmp";
+    {
+        std::ofstream ofile(tmp, std::ios::binary | std::ios::trunc);
+        ofile.write(reinterpret_cast<char const *>(&header), sizeof(header));
+        ofile.write(reinterpret_cast<char const *>(body.data()),
+                    static_cast<std::streamsize>(body.size()));
+        if (!ofile.flush()) {
+            throw std::runtime_error("can't write file " + tmp.string());
+        }
+    }
+    std::filesystem::rename(tmp, path);
+}
@@ -0,0 +1,106 @@
+#pragma once
+
+#include <libtree/file_reader.hpp>
+#include <libtree/hash.hpp>
+
+#include <compare>
+#include <cstdint>
+#include <filesystem>
+#include <mutex>
+#include <optional>
+#include <span>
+#include <string>
+#include <string_view>
+#include <vector>
+
+// What change detection knows about a file system entry. As long as none of
+// these changed, neither did a file's bytes nor a directory's list of names.
+struct FileIdentity {
+    std::uint64_t device;
+    std::uint64_t inode;
+    std::uint64_t size;
+    std::int64_t mtime; // Nanoseconds since the Unix epoch
+    std::int64_t ctime; // Nanoseconds since the Unix epoch
+
+    auto operator<=>(FileIdentity const &) const = default;
+};
+
+// lstat()s `path`. Returns nullopt if it can't be stat'ed, or on platforms
+// without device/inode numbers.
+std::optional<FileIdentity> identify(std::filesystem::path const &path,
+                                     bool &is_directory);
+
+// Persistent cache of per-file hashes and per-directory listings from earlier
+// scans, so a rescan only reads and hashes what changed since.
+//
+// The cache file is mapped and looked up in place (records are sorted by
+// identity). Lookups only see the loaded file, records made during this run
+// go to a separate set which `save` writes out, so entries for files that
+// no longer exist drop out on their own.
+class HashCache {
+  public:
+    enum RecordFlags : std::uint32_t {
+        has_content = 1U << 0,  // `content` is the digest of the file bytes
+        content_leaf = 1U << 1, // `leaf` was computed in HashMode::content
+    };
+
+    struct FileRecord {
+        FileIdentity identity;
+        std::uint64_t path_hash; // xxh64 of the path `leaf` was computed for
+        std::uint64_t size;
+        std::int64_t mtime; // File clock ticks, as stored in tree nodes
+        Digest content;
+        Digest leaf;
+        std::uint32_t flags;
+        std::uint32_t leaf_algorithm; // Hash policy id `leaf` was computed with
+    };
+
+    HashCache();
+
+    // Loads `path`. A missing file gives an empty cache, an invalid one is
+    // ignored with a warning.
+    explicit HashCache(std::filesystem::path const &path);
+
+    HashCache(HashCache const &) = delete;
+    HashCache &operator=(HashCache const &) = delete;
+
+    [[nodiscard]] FileRecord const *find_file(FileIdentity const &id) const;
+
+    // Sorted names of the directory's entries, if it is unchanged.
+    [[nodiscard]] std::optional<std::vector<std::string>>
+    find_listing(FileIdentity const &id) const;
+
+    // Thread-safe. Entries changed too shortly before the cache was opened
+    // aren't recorded: a later change within the same timestamp tick would
+    // go unnoticed.
+    void record_file(FileRecord const &record);
+
+    // Thread-safe. `names` must be sorted.
+    void record_listing(FileIdentity const &id,
+                        std::span<std::string const> names);
+
+    // Atomically replaces `path` with the records made since loading.
+    void save(std::filesystem::path const &path) const;
+
+  private:
+    struct DirRecord {
+        FileIdentity identity;
+        std::uint64_t names_offset; // '\0'-terminated names in the blob
+        std::uint64_t names_bytes;
+    };
+
+    struct Header;
+
+    [[nodiscard]] bool settled(FileIdentity const &id) const;
+
+    std::int64_t opened_; // Nanoseconds since the Unix epoch
+    std::optional<MappedFile> file_;
+    std::span<FileRecord const> old_files_;
+    std::span<DirRecord const> old_dirs_;
+    std::string_view old_names_;
+
+    mutable std::mutex mutex_;
+    std::vector<FileRecord> files_;
+    std::vector<DirRecord> dirs_;
+    std::string names_;
+};
@@ -0,0 +1,67 @@
+#include <libtree/metrics.hpp>
+
+#include <format>
+#include <string_view>
+
+namespace {
+
+constexpr std::array<std::string_view, Metrics::counter_count> counter_names{
+    "stat_calls",      "hash_calls",     "bytes_hashed",  "nodes_visited",
+    "subtrees_pruned", "nodes_loaded",   "files_copied",  "bytes_copied",
+    "entries_deleted", "files_moved",    "bytes_moved",   "requests",
+    "bytes_sent",      "bytes_received", "chunks_stored", "bytes_stored",
+    "chunks_reused",
+};
+
+constexpr std::array<std::string_view, Metrics::phase_count> phase_names{
+    "scan", "hash", "diff", "delete", "copy", "serialize", "load",
+};
+
+double milliseconds(Phase phase)
+{
+    return std::chrono::duration<double, std::milli>(Metrics::get(phase))
+        .count();
+}
+
+} // namespace
+
+void Metrics::reset()
+{
+    for (auto &c : counters_) {
+        c.store(0, std::memory_order_relaxed);
+    }
+    for (auto &p : phases_) {
+        p.store(0, std::memory_order_relaxed);
+    }
+}
+
+std::string Metrics::to_json()
+{
+    std::string json{R"({"phases_ms":{)"};
+    for (std::size_t i{}; i != phase_count; ++i) {
+        json += std::format(R"({}"{}":{:.3f})", i == 0 ? "" : ",",
+                            phase_names[i],
+                            milliseconds(static_cast<Phase>(i)));
+    }
+    json += R"(},"counters":{)";
+    for (std::size_t i{}; i != counter_count; ++i) {
+        json += std::format(R"({}"{}":{})", i == 0 ? "" : ",",
+                            counter_names[i], get(static_cast<Counter>(i)));
+    }
+    json += "}}";
+    return json;
+}
+
+std::string Metrics::to_text()
+{
+    std::string text;
+    for (std::size_t i{}; i != phase_count; ++i) {
+        text += std::format("{:<18}{:>12.3f} ms\n", phase_names[i],
+                            milliseconds(static_cast<Phase>(i)));
+    }
+    for (std::size_t i{}; i != counter_count; ++i) {
+        text += std::format("{:<18}{:>12}\n", counter_names[i],
+                            get(static_cast<Counter>(i)));
+    }
+    return text;
+}
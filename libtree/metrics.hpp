@@ -0,0 +1,108 @@
+#pragma once
+
+#include <array>
+#include <atomic>
+#include <chrono>
+#include <cstddef>
+#include <cstdint>
+#include <string>
+
+// What the process did, for `--stats` and the benchmarks. Counters are
+// bumped from any thread with relaxed atomic adds, cheap enough for the
+// per-entry paths of scanning and diffing.
+enum class Counter : std::size_t {
+    stat_calls,      // stat-like calls while scanning
+    hash_calls,      // Leaf, folder and content digests computed
+    bytes_hashed,    // File bytes read for content digests
+    nodes_visited,   // Child entries compared while diffing
+    subtrees_pruned, // Equal subfolders skipped while diffing
+    nodes_loaded,    // Snapshot nodes materialized
+    files_copied,
+    bytes_copied,
+    entries_deleted,
+    files_moved,    // Renamed or copied within the destination instead
+    bytes_moved,
+    requests,       // Batches of requests sent to a remote tree
+    bytes_sent,     // To a remote tree or receiver
+    bytes_received, // From a remote tree or receiver
+    chunks_stored,  // New chunks written to a chunk store
+    bytes_stored,
+    chunks_reused,  // Chunks a backup found already stored
+};
+
+// Where the time went. Times of concurrent work add up (a parallel scan may
+// report more than the wall time), and hashing is also part of scanning.
+enum class Phase : std::size_t {
+    scan,
+    hash,
+    diff,
+    remove,
+    copy,
+    serialize, // Writing snapshots
+    load,      // Reading snapshots
+};
+
+class Metrics {
+  public:
+    static constexpr std::size_t counter_count{17};
+    static constexpr std::size_t phase_count{7};
+
+    static void add(Counter counter, std::uint64_t n = 1)
+    {
+        counters_[static_cast<std::size_t>(counter)].fetch_add(
+            n, std::memory_order_relaxed);
+    }
+
+    static void add(Phase phase, std::chrono::nanoseconds time)
+    {
+        phases_[static_cast<std::size_t>(phase)].fetch_add(
+            time.count(), std::memory_order_relaxed);
+    }
+
+    static std::uint64_t get(Counter counter)
+    {
+        return counters_[static_cast<std::size_t>(counter)].load(
+            std::memory_order_relaxed);
+    }
+
+    static std::chrono::nanoseconds get(Phase phase)
+    {
+        return std::chrono::nanoseconds{
+            phases_[static_cast<std::size_t>(phase)].load(
+                std::memory_order_relaxed)};
+    }
+
+    static void reset();
+
+    // One line: {"phases_ms":{"scan":1.250,...},"counters":{...}}
+    static std::string to_json();
+
+    // One "name value" line per phase and counter.
+    static std::string to_text();
+
+  private:
+    static inline std::array<std::atomic<std::uint64_t>, counter_count>
+        counters_{};
+    static inline std::array<std::atomic<std::int64_t>, phase_count> phases_{};
+};
+
+// Adds the time between its construction and destruction to `phase`.
+class PhaseTimer {
+  public:
+    explicit PhaseTimer(Phase phase)
+        : phase_(phase), start_(std::chrono::steady_clock::now())
+    {
+    }
+
+    PhaseTimer(PhaseTimer const &) = delete;
+    PhaseTimer &operator=(PhaseTimer const &) = delete;
+
+    ~PhaseTimer()
+    {
+        Metrics::add(phase_, std::chrono::steady_clock::now() - start_);
+    }
+
+  private:
+    Phase phase_;
+    std::chrono::steady_clock::time_point start_;
+};
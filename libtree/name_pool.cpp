@@ -0,0 +1,61 @@
+#include <libtree/hash.hpp>
+#include <libtree/name_pool.hpp>
+
+#include <limits>
+#include <stdexcept>
+#include <utility>
+
+namespace {
+
+std::uint64_t name_hash(std::string_view name)
+{
+    return xxh64({reinterpret_cast<unsigned char const *>(name.data()),
+                  name.size()});
+}
+
+} // namespace
+
+NamePool::NamePool() : offsets_{0}, table_(64, no_name)
+{
+    intern({});
+}
+
+NamePool::Id NamePool::intern(std::string_view name)
+{
+    auto const mask{table_.size() - 1};
+    auto slot{static_cast<std::size_t>(name_hash(name)) & mask};
+    for (; table_[slot] != no_name; slot = (slot + 1) & mask) {
+        if (view(table_[slot]) == name) {
+            return table_[slot];
+        }
+    }
+
+    if (chars_.size() + name.size() >
+        std::numeric_limits<std::uint32_t>::max()) {
+        throw std::runtime_error{"too many names for the name pool"};
+    }
+    auto const id{static_cast<Id>(size())};
+    chars_.insert(chars_.end(), name.begin(), name.end());
+    offsets_.push_back(static_cast<std::uint32_t>(chars_.size()));
+    table_[slot] = id;
+
+    // At most half full, so probe runs stay short.
+    if (size() * 2 > table_.size()) {
+        grow();
+    }
+    return id;
+}
+
+void NamePool::grow()
+{
+    std::vector<Id> table(table_.size() * 2, no_name);
+    auto const mask{table.size() - 1};
+    for (Id id{}; id != size(); ++id) {
+        auto slot{static_cast<std::size_t>(name_hash(view(id))) & mask};
+        while (table[slot] != no_name) {
+            slot = (slot + 1) & mask;
+        }
+        table[slot] = id;
+    }
+    table_ = std::move(table);
+}
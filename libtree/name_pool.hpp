@@ -0,0 +1,42 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <string_view>
+#include <vector>
+
+// Interned file names. Every distinct name is stored once, back to back in
+// one buffer, and nodes refer to it by a 4 byte id instead of each keeping a
+// path of its own. Names are never removed: a tree that saw many renames
+// keeps the old names until it's rebuilt.
+class NamePool {
+  public:
+    using Id = std::uint32_t;
+
+    static constexpr Id empty{0}; // The empty name, always interned
+
+    NamePool();
+
+    // Id of `name`, adding it if it isn't interned yet.
+    Id intern(std::string_view name);
+
+    [[nodiscard]] std::string_view view(Id id) const
+    {
+        return {chars_.data() + offsets_[id], offsets_[id + 1] - offsets_[id]};
+    }
+
+    // Number of distinct names.
+    [[nodiscard]] std::size_t size() const
+    {
+        return offsets_.size() - 1;
+    }
+
+  private:
+    static constexpr Id no_name{~Id{0}};
+
+    void grow();
+
+    std::vector<char> chars_;
+    std::vector<std::uint32_t> offsets_; // Name `id` is [offsets_[id], +1)
+    std::vector<Id> table_; // Open addressing, linear probing, by xxh64
+};
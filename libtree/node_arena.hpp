@@ -0,0 +1,171 @@
+#pragma once
+
+#include <cassert>
+#include <cstdint>
+#include <limits>
+#include <map>
+#include <span>
+#include <utility>
+#include <vector>
+
+// Flat, index-addressed storage for tree nodes.
+//
+// Nodes are allocated in blocks of contiguous slots, so all children of a
+// directory sit next to each other. Hashes live in their own dense array,
+// which keeps hash-only passes (comparing, rehashing) from dragging the rest
+// of the node through the cache. A second array of hashes (file content
+// digests, for the tree) only exists once `keep_contents` was called, so
+// arenas that don't need it don't pay for it. Freed blocks are kept on a
+// best-fit free list and handed out again; everything is released at once
+// with the arena.
+template <typename Node, typename Hash>
+class NodeArena {
+  public:
+    using Id = std::uint32_t;
+
+    static constexpr Id nil{std::numeric_limits<Id>::max()};
+
+    Node &operator[](Id id)
+    {
+        assert(id < nodes_.size());
+        return nodes_[id];
+    }
+
+    Node const &operator[](Id id) const
+    {
+        assert(id < nodes_.size());
+        return nodes_[id];
+    }
+
+    Hash &hash(Id id)
+    {
+        return hashes_[id];
+    }
+
+    Hash const &hash(Id id) const
+    {
+        return hashes_[id];
+    }
+
+    Hash &content(Id id)
+    {
+        assert(id < contents_.size());
+        return contents_[id];
+    }
+
+    Hash const &content(Id id) const
+    {
+        assert(id < contents_.size());
+        return contents_[id];
+    }
+
+    void keep_contents()
+    {
+        keep_contents_ = true;
+        contents_.resize(nodes_.size());
+    }
+
+    [[nodiscard]] bool keeps_contents() const
+    {
+        return keep_contents_;
+    }
+
+    // Moves the node and hashes of slot `from` to slot `to`.
+    void move(Id from, Id to)
+    {
+        nodes_[to] = std::move(nodes_[from]);
+        hashes_[to] = hashes_[from];
+        if (keep_contents_) {
+            contents_[to] = contents_[from];
+        }
+    }
+
+    // Hashes of the `n` contiguous slots starting at `first`.
+    std::span<Hash const> hashes(Id first, std::uint32_t n) const
+    {
+        if (n == 0) {
+            return {};
+        }
+        return {&hashes_[first], n};
+    }
+
+    // Returns the first of `n` contiguous, default-initialized slots.
+    Id alloc(std::uint32_t n)
+    {
+        if (n == 0) {
+            return nil;
+        }
+        if (auto it{free_blocks_.lower_bound(n)}; it != free_blocks_.end()) {
+            auto const [size, first] = *it;
+            free_blocks_.erase(it);
+            if (size > n) {
+                free_blocks_.emplace(size - n, first + n);
+            }
+            free_slots_ -= n;
+            return first;
+        }
+        auto const first{static_cast<Id>(nodes_.size())};
+        nodes_.resize(nodes_.size() + n);
+        hashes_.resize(hashes_.size() + n);
+        if (keep_contents_) {
+            contents_.resize(contents_.size() + n);
+        }
+        return first;
+    }
+
+    // Returns `n` slots starting at `first` to the free list.
+    void free(Id first, std::uint32_t n)
+    {
+        if (n == 0) {
+            return;
+        }
+        for (Id i{first}; i != first + n; ++i) {
+            nodes_[i] = Node{};
+            hashes_[i] = Hash{};
+            if (keep_contents_) {
+                contents_[i] = Hash{};
+            }
+        }
+        free_blocks_.emplace(n, first);
+        free_slots_ += n;
+    }
+
+    void reserve(std::size_t n)
+    {
+        nodes_.reserve(n);
+        hashes_.reserve(n);
+        if (keep_contents_) {
+            contents_.reserve(n);
+        }
+    }
+
+    void clear()
+    {
+        nodes_.clear();
+        hashes_.clear();
+        contents_.clear();
+        free_blocks_.clear();
+        free_slots_ = 0;
+    }
+
+    // Number of slots in use.
+    [[nodiscard]] std::size_t size() const
+    {
+        return nodes_.size() - free_slots_;
+    }
+
+    // Number of slots, in use or free: the ids that can be indexed are
+    // those below it.
+    [[nodiscard]] std::size_t slots() const
+    {
+        return nodes_.size();
+    }
+
+  private:
+    std::vector<Node> nodes_;
+    std::vector<Hash> hashes_;
+    std::vector<Hash> contents_;
+    bool keep_contents_{false};
+    std::multimap<std::uint32_t, Id> free_blocks_; // Size -> first slot
+    std::size_t free_slots_{0};
+};
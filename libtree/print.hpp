@@ -1,10 +1,37 @@
 #pragma once
 
+#include <atomic>
 #include <iostream>
 #include <print>
 
+// How much goes to stderr: errors always, progress from `info` on, and
+// per-entry traces only at `debug`.
+enum class LogLevel {
+    error,
+    info,
+    debug,
+};
+
+inline std::atomic<LogLevel> log_level{LogLevel::info};
+
 template <typename... Args>
 void errorln(std::format_string<Args...> fmt, Args &&...args)
 {
     std::println(std::cerr, fmt, std::forward<Args>(args)...);
 }
+
+template <typename... Args>
+void infoln(std::format_string<Args...> fmt, Args &&...args)
+{
+    if (log_level.load(std::memory_order_relaxed) >= LogLevel::info) {
+        std::println(std::cerr, fmt, std::forward<Args>(args)...);
+    }
+}
+
+template <typename... Args>
+void debugln(std::format_string<Args...> fmt, Args &&...args)
+{
+    if (log_level.load(std::memory_order_relaxed) >= LogLevel::debug) {
+        std::println(std::cerr, fmt, std::forward<Args>(args)...);
+    }
+}
@@ -0,0 +1,358 @@
+#include <libtree/metrics.hpp>
+#include <libtree/remote.hpp>
+
+#include <algorithm>
+#include <array>
+#include <cerrno>
+#include <charconv>
+#include <cstring>
+#include <stdexcept>
+#include <string>
+#include <system_error>
+#include <utility>
+
+#if defined(_WIN32)
+#include <io.h>
+#else
+#include <sys/wait.h>
+#include <unistd.h>
+#endif
+
+namespace {
+
+// Frames larger than this are taken for a corrupt stream.
+constexpr std::uint32_t max_frame_size{1U << 30};
+
+constexpr std::size_t read_buffer_size{256U << 10};
+
+constexpr std::size_t flush_size{1U << 20};
+
+[[noreturn]] void throw_errno(char const *what)
+{
+    throw std::system_error{errno, std::system_category(), what};
+}
+
+long read_some(int fd, unsigned char *p, std::size_t n)
+{
+#if defined(_WIN32)
+    return ::_read(fd, p, static_cast<unsigned>(std::min<std::size_t>(
+                              n, read_buffer_size)));
+#else
+    return ::read(fd, p, n);
+#endif
+}
+
+long write_some(int fd, unsigned char const *p, std::size_t n)
+{
+#if defined(_WIN32)
+    return ::_write(fd, p, static_cast<unsigned>(std::min<std::size_t>(
+                               n, read_buffer_size)));
+#else
+    return ::write(fd, p, n);
+#endif
+}
+
+void close_fd(int fd)
+{
+#if defined(_WIN32)
+    ::_close(fd);
+#else
+    ::close(fd);
+#endif
+}
+
+} // namespace
+
+void WireWriter::u32(std::uint32_t v)
+{
+    for (int i{}; i != 4; ++i) {
+        bytes_.push_back(static_cast<unsigned char>(v >> (8 * i)));
+    }
+}
+
+void WireWriter::u64(std::uint64_t v)
+{
+    for (int i{}; i != 8; ++i) {
+        bytes_.push_back(static_cast<unsigned char>(v >> (8 * i)));
+    }
+}
+
+void WireWriter::string(std::string_view v)
+{
+    u32(static_cast<std::uint32_t>(v.size()));
+    bytes({reinterpret_cast<unsigned char const *>(v.data()), v.size()});
+}
+
+std::span<unsigned char const> WireReader::take(std::size_t n)
+{
+    if (data_.size() - pos_ < n) {
+        throw std::runtime_error{"truncated message"};
+    }
+    auto const bytes{data_.subspan(pos_, n)};
+    pos_ += n;
+    return bytes;
+}
+
+std::uint8_t WireReader::u8()
+{
+    return take(1)[0];
+}
+
+std::uint32_t WireReader::u32()
+{
+    auto const b{take(4)};
+    std::uint32_t v{};
+    for (int i{}; i != 4; ++i) {
+        v |= std::uint32_t{b[i]} << (8 * i);
+    }
+    return v;
+}
+
+std::uint64_t WireReader::u64()
+{
+    auto const b{take(8)};
+    std::uint64_t v{};
+    for (int i{}; i != 8; ++i) {
+        v |= std::uint64_t{b[i]} << (8 * i);
+    }
+    return v;
+}
+
+Digest WireReader::digest()
+{
+    Digest d;
+    std::ranges::copy(take(d.size()), d.begin());
+    return d;
+}
+
+std::string_view WireReader::string()
+{
+    auto const n{u32()};
+    auto const b{take(n)};
+    return {reinterpret_cast<char const *>(b.data()), b.size()};
+}
+
+Channel::Channel(int in, int out) : in_(in), out_(out)
+{
+    buffer_.resize(read_buffer_size);
+    buffered_ = buffer_.size();
+}
+
+Channel Channel::connect(std::string_view endpoint)
+{
+    if (endpoint.starts_with("fd:")) {
+        auto const value{endpoint.substr(3)};
+        int fd{-1};
+        auto const [ptr, ec] =
+            std::from_chars(value.data(), value.data() + value.size(), fd);
+        if (ec != std::errc{} || ptr != value.data() + value.size() ||
+            fd < 0) {
+            throw std::invalid_argument{"invalid endpoint " +
+                                        std::string{endpoint}};
+        }
+        return Channel{fd, fd};
+    }
+    if (!endpoint.starts_with("exec:")) {
+        throw std::invalid_argument{"invalid endpoint " +
+                                    std::string{endpoint}};
+    }
+#if defined(_WIN32)
+    throw std::runtime_error{"exec: endpoints need a POSIX system"};
+#else
+    std::string const command{endpoint.substr(5)};
+    int to_child[2];
+    int from_child[2];
+    if (::pipe(to_child) != 0) {
+        throw_errno("can't create pipe");
+    }
+    if (::pipe(from_child) != 0) {
+        close_fd(to_child[0]);
+        close_fd(to_child[1]);
+        throw_errno("can't create pipe");
+    }
+    auto const pid{::fork()};
+    if (pid < 0) {
+        for (int fd : {to_child[0], to_child[1], from_child[0],
+                       from_child[1]}) {
+            close_fd(fd);
+        }
+        throw_errno("can't start remote command");
+    }
+    if (pid == 0) {
+        ::dup2(to_child[0], STDIN_FILENO);
+        ::dup2(from_child[1], STDOUT_FILENO);
+        for (int fd : {to_child[0], to_child[1], from_child[0],
+                       from_child[1]}) {
+            ::close(fd);
+        }
+        ::execl("/bin/sh", "sh", "-c", command.c_str(),
+                static_cast<char *>(nullptr));
+        ::_exit(127);
+    }
+    close_fd(to_child[0]);
+    close_fd(from_child[1]);
+    Channel channel{from_child[0], to_child[1]};
+    channel.child_ = pid;
+    return channel;
+#endif
+}
+
+Channel::Channel(Channel &&other) noexcept
+    : in_(std::exchange(other.in_, -1)), out_(std::exchange(other.out_, -1)),
+      child_(std::exchange(other.child_, -1)),
+      pending_(std::move(other.pending_)), buffer_(std::move(other.buffer_)),
+      buffered_(other.buffered_)
+{
+}
+
+Channel::~Channel()
+{
+    if (out_ >= 0 && out_ != in_) {
+        close_fd(out_);
+    }
+    if (in_ >= 0) {
+        close_fd(in_);
+    }
+#if !defined(_WIN32)
+    if (child_ > 0) {
+        int status{};
+        while (::waitpid(child_, &status, 0) < 0 && errno == EINTR) {
+        }
+    }
+#endif
+}
+
+void Channel::send(Message type, std::span<unsigned char const> payload)
+{
+    if (payload.size() > max_frame_size) {
+        throw std::runtime_error{"message too large"};
+    }
+    WireWriter header;
+    header.u32(static_cast<std::uint32_t>(payload.size()));
+    header.u8(static_cast<std::uint8_t>(type));
+    pending_.insert(pending_.end(), header.data().begin(),
+                    header.data().end());
+    pending_.insert(pending_.end(), payload.begin(), payload.end());
+    if (pending_.size() >= flush_size) {
+        flush();
+    }
+}
+
+void Channel::flush()
+{
+    std::size_t written{};
+    while (written != pending_.size()) {
+        auto const n{write_some(out_, pending_.data() + written,
+                                pending_.size() - written)};
+        if (n < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            throw_errno("can't write to remote");
+        }
+        written += static_cast<std::size_t>(n);
+    }
+    Metrics::add(Counter::bytes_sent, written);
+    pending_.clear();
+}
+
+bool Channel::read(unsigned char *p, std::size_t n)
+{
+    std::size_t done{};
+    while (done != n) {
+        if (buffered_ == buffer_.size()) {
+            buffer_.resize(read_buffer_size);
+            buffered_ = buffer_.size();
+            auto const got{read_some(in_, buffer_.data(), buffer_.size())};
+            if (got < 0) {
+                if (errno == EINTR) {
+                    continue;
+                }
+                throw_errno("can't read from remote");
+            }
+            if (got == 0) {
+                if (done == 0) {
+                    return false;
+                }
+                throw std::runtime_error{"remote closed the stream"};
+            }
+            Metrics::add(Counter::bytes_received,
+                         static_cast<std::uint64_t>(got));
+            buffer_.resize(static_cast<std::size_t>(got));
+            buffered_ = 0;
+        }
+        auto const k{std::min(n - done, buffer_.size() - buffered_)};
+        std::memcpy(p + done, buffer_.data() + buffered_, k);
+        buffered_ += k;
+        done += k;
+    }
+    return true;
+}
+
+bool Channel::receive(Message &type, std::vector<unsigned char> &payload)
+{
+    // Whatever we queued may be what the other side waits for.
+    flush();
+
+    std::array<unsigned char, 5> header;
+    if (!read(header.data(), header.size())) {
+        return false;
+    }
+    WireReader reader{header};
+    auto const length{reader.u32()};
+    auto const t{reader.u8()};
+    if (length > max_frame_size ||
+        t > static_cast<std::uint8_t>(Message::done)) {
+        throw std::runtime_error{"corrupt message from remote"};
+    }
+    type = static_cast<Message>(t);
+    payload.resize(length);
+    if (length != 0 && !read(payload.data(), length)) {
+        throw std::runtime_error{"remote closed the stream"};
+    }
+    return true;
+}
+
+ServedTree open_session(Channel &channel, std::uint32_t hash_algorithm,
+                        std::uint8_t hash_mode)
+{
+    WireWriter out;
+    out.u32(protocol_version);
+    out.u32(hash_algorithm);
+    out.u8(hash_mode);
+    channel.send(Message::hello, out);
+
+    std::vector<unsigned char> payload;
+    channel.expect(Message::hello, payload);
+    WireReader hello{payload};
+    if (hello.u32() != protocol_version || hello.u32() != hash_algorithm ||
+        hello.u8() != hash_mode) {
+        throw std::runtime_error{"remote tree doesn't match ours"};
+    }
+    ServedTree tree;
+    tree.root = hello.u32();
+    tree.hash = hello.digest();
+    tree.base_dir = hello.string();
+    tree.filter = hello.string();
+    return tree;
+}
+
+Message Channel::next(std::vector<unsigned char> &payload)
+{
+    Message type{};
+    if (!receive(type, payload)) {
+        throw std::runtime_error{"remote closed the stream"};
+    }
+    if (type == Message::error) {
+        WireReader reader{payload};
+        throw std::runtime_error{"remote: " + std::string{reader.string()}};
+    }
+    return type;
+}
+
+void Channel::expect(Message expected, std::vector<unsigned char> &payload)
+{
+    if (next(payload) != expected) {
+        throw std::runtime_error{"unexpected message from remote"};
+    }
+}
@@ -0,0 +1,197 @@
+#pragma once
+
+#include <libtree/hash.hpp>
+
+#include <cstddef>
+#include <cstdint>
+#include <span>
+#include <string>
+#include <string_view>
+#include <vector>
+
+// Protocol for syncing from a tree on the other end of a byte stream (a
+// pipe, a socket, ssh). The receiver drives it; the sender (`serve`) only
+// answers. All integers are little endian. Every message is one frame:
+//
+//   u32 length   of what follows the type
+//   u8  type     Message
+//   ...          payload
+//
+//   hello     both ways: u32 version, u32 hash algorithm, u8 hash mode. The
+//             sender's adds its root: u32 id, hash, string base directory,
+//             and string filter rules (filter.hpp) it was scanned with.
+//   list      u32 count, u32 ids[count]: folders to list.
+//   listing   per listed folder: u32 first child id, u32 child count, then
+//             per child: string name, u8 FileType, u8 flags, u64 size,
+//             i64 mtime, u32 number of files below it, hash, and the
+//             content digest if flags has it. Children are sorted by name.
+//   fetch     u32 count, u32 ids[count]: files to send.
+//   file      per fetched file, in request order: u32 id, then any number
+//             of data frames and a file_end frame.
+//   error     string: the sender failed, the receiver gives up.
+//   done      the receiver has all it wanted.
+//
+// Strings are u32 length and bytes, hashes 32 bytes. Ids are the sender's
+// node ids, children of a folder are numbered contiguously from its first
+// child id.
+//
+// Hashes are compared top down: only folders whose hashes differ from the
+// receiver's are listed, and only files whose hashes differ are fetched,
+// so the requests and the metadata sent follow the size of the change, not
+// that of the tree. Requests are sent in batches, several in flight at once,
+// so a sync takes about one round trip per level of changed folders.
+
+inline constexpr std::uint32_t protocol_version{2};
+
+enum class Message : std::uint8_t {
+    hello,
+    list,
+    listing,
+    fetch,
+    file,
+    data,
+    file_end,
+    error,
+    done,
+};
+
+// Builds a message payload.
+class WireWriter {
+  public:
+    void u8(std::uint8_t v)
+    {
+        bytes_.push_back(v);
+    }
+
+    void u32(std::uint32_t v);
+    void u64(std::uint64_t v);
+
+    void i64(std::int64_t v)
+    {
+        u64(static_cast<std::uint64_t>(v));
+    }
+
+    void bytes(std::span<unsigned char const> v)
+    {
+        bytes_.insert(bytes_.end(), v.begin(), v.end());
+    }
+
+    void digest(Digest const &v)
+    {
+        bytes(v);
+    }
+
+    void string(std::string_view v);
+
+    [[nodiscard]] std::span<unsigned char const> data() const
+    {
+        return bytes_;
+    }
+
+    void clear()
+    {
+        bytes_.clear();
+    }
+
+  private:
+    std::vector<unsigned char> bytes_;
+};
+
+// Takes a message payload apart. Throws std::runtime_error when reading past
+// its end.
+class WireReader {
+  public:
+    explicit WireReader(std::span<unsigned char const> data) : data_(data) {}
+
+    std::uint8_t u8();
+    std::uint32_t u32();
+    std::uint64_t u64();
+
+    std::int64_t i64()
+    {
+        return static_cast<std::int64_t>(u64());
+    }
+
+    Digest digest();
+    std::string_view string();
+
+    [[nodiscard]] bool at_end() const
+    {
+        return pos_ == data_.size();
+    }
+
+  private:
+    std::span<unsigned char const> take(std::size_t n);
+
+    std::span<unsigned char const> data_;
+    std::size_t pos_{0};
+};
+
+// A framed, buffered byte stream to the other side. Messages are queued by
+// `send` and written out by `flush`, by `receive`, or once a megabyte has
+// queued up, so a batch of requests goes out in one write.
+class Channel {
+  public:
+    // Uses the file descriptors `in` and `out` (which may be the same
+    // socket). They are closed with the channel.
+    Channel(int in, int out);
+
+    // "fd:N": file descriptor N, e.g. one end of a socketpair.
+    // "exec:COMMAND": stdin and stdout of COMMAND run by /bin/sh, e.g.
+    // "exec:ssh host tree serve /data". The command is waited for when the
+    // channel is closed. Not available on Windows.
+    static Channel connect(std::string_view endpoint);
+
+    Channel(Channel &&other) noexcept;
+    Channel &operator=(Channel &&) = delete;
+    Channel(Channel const &) = delete;
+    Channel &operator=(Channel const &) = delete;
+
+    ~Channel();
+
+    void send(Message type, std::span<unsigned char const> payload = {});
+
+    void send(Message type, WireWriter const &payload)
+    {
+        send(type, payload.data());
+    }
+
+    void flush();
+
+    // Reads the next message into `payload`. Returns false if the stream
+    // ended cleanly before it; a stream that ends inside a message throws.
+    bool receive(Message &type, std::vector<unsigned char> &payload);
+
+    // Reads the next message. The end of the stream and error messages from
+    // the other side are thrown as std::runtime_error.
+    Message next(std::vector<unsigned char> &payload);
+
+    // Same, for a message that must be of type `expected`.
+    void expect(Message expected, std::vector<unsigned char> &payload);
+
+  private:
+    // Reads exactly `n` bytes. Returns false on end of stream before the
+    // first one.
+    bool read(unsigned char *p, std::size_t n);
+
+    int in_{-1};
+    int out_{-1};
+    int child_{-1}; // Process id of an exec: command
+    std::vector<unsigned char> pending_; // Sent, not yet written
+    std::vector<unsigned char> buffer_;  // Read, not yet received
+    std::size_t buffered_{0};            // Start of the unreceived bytes
+};
+
+// What the sender says about its tree in its hello.
+struct ServedTree {
+    std::uint32_t root;
+    Digest hash;
+    std::string base_dir;
+    std::string filter; // Rules, the receiver has to scan with the same
+};
+
+// Opens a session as the receiver: sends our hello and returns what the
+// sender answered. Throws if the sender refused, e.g. because it hashes
+// with another algorithm.
+ServedTree open_session(Channel &channel, std::uint32_t hash_algorithm,
+                        std::uint8_t hash_mode);
@@ -0,0 +1,272 @@
+#include <libtree/metrics.hpp>
+#include <libtree/snapshot.hpp>
+
+#include <algorithm>
+#include <format>
+#include <fstream>
+#include <limits>
+#include <stdexcept>
+#include <utility>
+#include <vector>
+
+namespace {
+
+std::fstream open_spill(std::filesystem::path const &path)
+{
+    std::fstream file{path, std::ios::in | std::ios::out | std::ios::binary |
+                                std::ios::trunc};
+    if (!file) {
+        throw std::runtime_error("can't open file " + path.string());
+    }
+    return file;
+}
+
+} // namespace
+
+SnapshotView::SnapshotView(std::filesystem::path const &path, Check check)
+    : file_(path, check == Check::full ? MappedFile::Access::sequential
+                                       : MappedFile::Access::random)
+{
+    auto const bytes{file_.data()};
+    auto fail{[&path](std::string_view why) {
+        return std::runtime_error{
+            std::format("{} isn't a valid snapshot: {}", path.string(), why)};
+    }};
+
+    if (bytes.size() < sizeof(SnapshotHeader)) {
+        throw fail("truncated header");
+    }
+    header_ = reinterpret_cast<SnapshotHeader const *>(bytes.data());
+    if (header_->magic != snapshot_magic) {
+        throw fail("bad magic");
+    }
+    if (header_->byte_order != snapshot_byte_order) {
+        throw fail("written on a machine with another byte order");
+    }
+    if (header_->version == 0 || header_->version > snapshot_version) {
+        throw fail(std::format("unsupported version {}", header_->version));
+    }
+
+    auto const n{header_->node_count};
+    auto const digests{(header_->flags & SnapshotHeader::content_hashes) != 0
+                           ? 2 * n
+                           : n};
+    auto const filter_bytes{header_->version >= 2 ? header_->filter_bytes
+                                                  : 0};
+    auto const body{n * sizeof(SnapshotNode) + digests * sizeof(Digest) +
+                    header_->string_bytes + filter_bytes};
+    if (n == 0 || n > snapshot_no_node || header_->root >= n ||
+        body != bytes.size() - sizeof(SnapshotHeader)) {
+        throw fail("inconsistent section sizes");
+    }
+    if (check == Check::full &&
+        xxh64(bytes.subspan(sizeof(SnapshotHeader))) != header_->checksum) {
+        throw fail("checksum mismatch");
+    }
+
+    auto const *p{bytes.data() + sizeof(SnapshotHeader)};
+    nodes_ = {reinterpret_cast<SnapshotNode const *>(p), n};
+    p += n * sizeof(SnapshotNode);
+    hashes_ = {reinterpret_cast<Digest const *>(p), n};
+    p += n * sizeof(Digest);
+    if ((header_->flags & SnapshotHeader::content_hashes) != 0) {
+        contents_ = {reinterpret_cast<Digest const *>(p), n};
+        p += n * sizeof(Digest);
+    }
+    strings_ = {reinterpret_cast<char const *>(p), header_->string_bytes};
+    p += header_->string_bytes;
+    filter_ = {reinterpret_cast<char const *>(p), filter_bytes};
+}
+
+bool SnapshotView::is_snapshot(std::filesystem::path const &path)
+{
+    std::ifstream ifs(path, std::ios::binary);
+    std::array<char, snapshot_magic.size()> magic{};
+    ifs.read(magic.data(), magic.size());
+    return ifs && magic == snapshot_magic;
+}
+
+std::string_view SnapshotView::name(SnapshotNode const &node) const
+{
+    if (std::uint64_t{node.name_offset} + node.name_length > strings_.size()) {
+        throw std::runtime_error{"snapshot name out of bounds"};
+    }
+    return strings_.substr(node.name_offset, node.name_length);
+}
+
+std::optional<std::uint32_t>
+SnapshotView::find(std::filesystem::path const &relative) const
+{
+    std::uint32_t index{header_->root};
+    for (auto const &part : relative.relative_path()) {
+        auto const component{part.string()};
+        if (component.empty() || component == ".") {
+            continue;
+        }
+        auto const &node{nodes_[index]};
+        if ((node.flags & SnapshotNode::folder) == 0 ||
+            node.child_count == 0) {
+            return std::nullopt;
+        }
+        if (node.first_child <= index ||
+            std::uint64_t{node.first_child} + node.child_count >
+                nodes_.size()) {
+            throw std::runtime_error{"corrupt snapshot node table"};
+        }
+        auto lo{node.first_child};
+        auto const end{node.first_child + node.child_count};
+        auto hi{end};
+        while (lo != hi) {
+            auto const mid{lo + (hi - lo) / 2};
+            if (name(nodes_[mid]) < component) {
+                lo = mid + 1;
+            }
+            else {
+                hi = mid;
+            }
+        }
+        if (lo == end || name(nodes_[lo]) != component) {
+            return std::nullopt;
+        }
+        index = lo;
+    }
+    return index;
+}
+
+SnapshotWriter::SnapshotWriter(std::filesystem::path path,
+                               bool content_hashes,
+                               std::uint32_t hash_algorithm,
+                               std::string_view filter)
+    : path_(std::move(path)), tmp_(path_.string() + ".tmp"),
+      content_hashes_(content_hashes), hash_algorithm_(hash_algorithm),
+      filter_(filter), nodes_(open_spill(tmp_)),
+      hashes_(open_spill(path_.string() + ".hashes.tmp")),
+      strings_(open_spill(path_.string() + ".strings.tmp"))
+{
+    if (content_hashes_) {
+        contents_ = open_spill(path_.string() + ".contents.tmp");
+    }
+}
+
+SnapshotWriter::~SnapshotWriter()
+{
+    nodes_.close();
+    hashes_.close();
+    contents_.close();
+    strings_.close();
+    std::error_code ec;
+    for (auto const *suffix :
+         {".hashes.tmp", ".contents.tmp", ".strings.tmp"}) {
+        std::filesystem::remove(path_.string() + suffix, ec);
+    }
+    if (!finished_) {
+        std::filesystem::remove(tmp_, ec);
+    }
+}
+
+std::uint32_t SnapshotWriter::reserve(std::uint32_t n)
+{
+    if (node_count_ + n >= snapshot_no_node) {
+        throw std::runtime_error{"tree too large for the snapshot format"};
+    }
+    auto const first{static_cast<std::uint32_t>(node_count_)};
+    node_count_ += n;
+    return first;
+}
+
+void SnapshotWriter::write(std::uint32_t first,
+                           std::span<SnapshotNode> records,
+                           std::span<std::string const> names,
+                           std::span<Digest const> hashes,
+                           std::span<Digest const> contents)
+{
+    PhaseTimer const timer{Phase::serialize};
+    for (std::size_t k{}; k != records.size(); ++k) {
+        if (string_bytes_ + names[k].size() >
+            std::numeric_limits<std::uint32_t>::max()) {
+            throw std::runtime_error{"tree too large for the snapshot format"};
+        }
+        records[k].name_offset = static_cast<std::uint32_t>(string_bytes_);
+        records[k].name_length = static_cast<std::uint32_t>(names[k].size());
+        strings_.write(names[k].data(),
+                       static_cast<std::streamsize>(names[k].size()));
+        string_bytes_ += names[k].size();
+    }
+
+    auto put{[first](std::fstream &file, std::uint64_t base, auto span) {
+        auto const size{sizeof(span[0])};
+        file.seekp(static_cast<std::streamoff>(base + first * size));
+        file.write(reinterpret_cast<char const *>(span.data()),
+                   static_cast<std::streamsize>(span.size() * size));
+    }};
+    put(nodes_, sizeof(SnapshotHeader), records);
+    put(hashes_, 0, hashes);
+    if (content_hashes_) {
+        put(contents_, 0, contents);
+    }
+    if (!nodes_ || !hashes_ || !contents_ || !strings_) {
+        throw std::runtime_error("can't write file " + tmp_.string());
+    }
+}
+
+void SnapshotWriter::finish()
+{
+    PhaseTimer const timer{Phase::serialize};
+
+    // The node table was written out of order, so it's read back for the
+    // checksum; the other sections are checksummed as they are copied
+    // after it.
+    Xxh64State checksum;
+    std::vector<char> buffer(1U << 20);
+    auto pump{[&](std::fstream &from, std::uint64_t bytes, bool copy) {
+        while (bytes != 0) {
+            auto const n{std::min<std::uint64_t>(bytes, buffer.size())};
+            if (!from.read(buffer.data(), static_cast<std::streamsize>(n))) {
+                throw std::runtime_error("can't read back " + tmp_.string());
+            }
+            checksum.update({reinterpret_cast<unsigned char const *>(
+                                 buffer.data()),
+                             n});
+            if (copy) {
+                nodes_.write(buffer.data(), static_cast<std::streamsize>(n));
+            }
+            bytes -= n;
+        }
+    }};
+    nodes_.seekg(sizeof(SnapshotHeader));
+    pump(nodes_, node_count_ * sizeof(SnapshotNode), false);
+    nodes_.seekp(static_cast<std::streamoff>(
+        sizeof(SnapshotHeader) + node_count_ * sizeof(SnapshotNode)));
+    auto const digests{node_count_ * sizeof(Digest)};
+    hashes_.seekg(0);
+    pump(hashes_, digests, true);
+    if (content_hashes_) {
+        contents_.seekg(0);
+        pump(contents_, digests, true);
+    }
+    strings_.seekg(0);
+    pump(strings_, string_bytes_, true);
+    checksum.update({reinterpret_cast<unsigned char const *>(filter_.data()),
+                     filter_.size()});
+    nodes_.write(filter_.data(), static_cast<std::streamsize>(filter_.size()));
+
+    SnapshotHeader header{};
+    header.magic = snapshot_magic;
+    header.version = snapshot_version;
+    header.byte_order = snapshot_byte_order;
+    header.flags = content_hashes_ ? SnapshotHeader::content_hashes : 0U;
+    header.root = 0;
+    header.node_count = node_count_;
+    header.string_bytes = string_bytes_;
+    header.checksum = checksum.digest();
+    header.hash_algorithm = hash_algorithm_;
+    header.filter_bytes = filter_.size();
+    nodes_.seekp(0);
+    nodes_.write(reinterpret_cast<char const *>(&header), sizeof(header));
+    nodes_.close();
+    if (!nodes_) {
+        throw std::runtime_error("can't write file " + tmp_.string());
+    }
+    std::filesystem::rename(tmp_, path_);
+    finished_ = true;
+}
\ No newline at end of file
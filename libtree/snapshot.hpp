@@ -0,0 +1,195 @@
+#pragma once
+
+#include <libtree/file_reader.hpp>
+#include <libtree/hash.hpp>
+
+#include <array>
+#include <cstdint>
+#include <filesystem>
+#include <fstream>
+#include <optional>
+#include <span>
+#include <string>
+#include <string_view>
+
+// On-disk layout of a tree snapshot, version 2. All integers are stored in
+// the writer's byte order, which is recorded in the header; readers reject
+// files of the other order. Every section is naturally aligned, so a mapped
+// file is used in place without any parsing:
+//
+//   SnapshotHeader                     64 bytes
+//   SnapshotNode    nodes[node_count]  root first, children contiguous
+//   Digest          hashes[node_count] Merkle hash of each node
+//   Digest          contents[node_count], only with content_hashes set
+//   char            strings[string_bytes]
+//   char            filter[filter_bytes] rules the tree was scanned with
+//
+// Every node's children come after it: `writeTree` lays the nodes out
+// breadth first, a streaming save in the order it lists directories.
+// Siblings are sorted by name, in byte order, so the node table doubles as
+// a path index: a lookup is a binary search per level (SnapshotView::find).
+// Node names are single path components, except for the root whose name
+// is the directory the snapshot was taken of. Version 1 had no filter section;
+// such snapshots are still read, as unfiltered.
+
+inline constexpr std::array<char, 8> snapshot_magic{'M', 'T', 'R', 'E',
+                                                    'E', 'S', 'N', 'P'};
+inline constexpr std::uint32_t snapshot_version{2};
+inline constexpr std::uint32_t snapshot_byte_order{0x01020304};
+inline constexpr std::uint32_t snapshot_no_node{0xFFFFFFFF};
+
+struct SnapshotHeader {
+    enum Flags : std::uint32_t {
+        content_hashes = 1U << 0, // Built in HashMode::content
+    };
+
+    std::array<char, 8> magic;
+    std::uint32_t version;
+    std::uint32_t byte_order;
+    std::uint32_t flags;
+    std::uint32_t root;
+    std::uint64_t node_count;
+    std::uint64_t string_bytes;
+    // XXH64 of everything following the header.
+    std::uint64_t checksum;
+    std::uint32_t hash_algorithm; // Hash policy id of the tree hashes
+    std::uint32_t reserved32;
+    std::uint64_t filter_bytes; // Reserved, and 0, in version 1
+};
+static_assert(sizeof(SnapshotHeader) == 64);
+
+struct SnapshotNode {
+    enum Flags : std::uint32_t {
+        folder = 1U << 0,
+        has_content = 1U << 1,
+    };
+    // Bits 8-15 of the flags hold the FileType (directory.hpp), 0 (unknown)
+    // in snapshots written before types were kept.
+    static constexpr unsigned type_shift{8};
+    static constexpr std::uint32_t type_mask{0xFFU << type_shift};
+
+    std::uint32_t parent;
+    std::uint32_t first_child; // snapshot_no_node if there are no children
+    std::uint32_t child_count;
+    std::uint32_t name_offset; // Into the string table
+    std::uint32_t name_length;
+    std::uint32_t flags;
+    std::uint64_t child_num;
+    std::uint64_t size;
+    std::int64_t mtime;
+};
+static_assert(sizeof(SnapshotNode) == 48);
+
+// Read-only view of a mapped snapshot file. Construction validates the header
+// and, unless asked not to, the checksum; the accessors are then plain
+// pointer arithmetic.
+class SnapshotView {
+  public:
+    // What construction validates.
+    enum class Check {
+        // Also the checksum, which reads the whole file.
+        full,
+        // Only the header and the section sizes, so that the pages of the
+        // file are read as they are used. For readers that check every
+        // record they use (links in range, names in bounds) instead.
+        layout,
+    };
+
+    explicit SnapshotView(std::filesystem::path const &path,
+                          Check check = Check::full);
+
+    // Whether the file at `path` starts with the snapshot magic.
+    static bool is_snapshot(std::filesystem::path const &path);
+
+    [[nodiscard]] SnapshotHeader const &header() const
+    {
+        return *header_;
+    }
+
+    [[nodiscard]] std::span<SnapshotNode const> nodes() const
+    {
+        return nodes_;
+    }
+
+    [[nodiscard]] std::span<Digest const> hashes() const
+    {
+        return hashes_;
+    }
+
+    // Empty unless the snapshot was built with content hashes.
+    [[nodiscard]] std::span<Digest const> contents() const
+    {
+        return contents_;
+    }
+
+    // Throws if the name lies outside the string table.
+    [[nodiscard]] std::string_view name(SnapshotNode const &node) const;
+
+    // Index of the node at `relative` ("" and "." are the root), if there is
+    // one. Reads a few records per level of the path, not whole sibling
+    // lists. Throws if a record on the way links out of the table.
+    [[nodiscard]] std::optional<std::uint32_t>
+    find(std::filesystem::path const &relative) const;
+
+    // PathFilter rules, one per line; empty if the tree wasn't filtered.
+    [[nodiscard]] std::string_view filter() const
+    {
+        return filter_;
+    }
+
+  private:
+    MappedFile file_;
+    SnapshotHeader const *header_{nullptr};
+    std::span<SnapshotNode const> nodes_;
+    std::span<Digest const> hashes_;
+    std::span<Digest const> contents_;
+    std::string_view strings_;
+    std::string_view filter_;
+};
+
+// Writes a snapshot without holding it in memory, for trees too large to.
+// Slots are reserved for blocks of siblings up front and filled in later,
+// in any order. Until `finish`, the sections that follow the node table
+// (whose size isn't known yet) are spilled to files next to the snapshot,
+// and the snapshot itself is written under a temporary name.
+class SnapshotWriter {
+  public:
+    SnapshotWriter(std::filesystem::path path, bool content_hashes,
+                   std::uint32_t hash_algorithm, std::string_view filter);
+
+    SnapshotWriter(SnapshotWriter const &) = delete;
+    SnapshotWriter &operator=(SnapshotWriter const &) = delete;
+
+    // Removes the temporary files, so an unfinished snapshot leaves nothing
+    // behind.
+    ~SnapshotWriter();
+
+    // Reserves `n` consecutive slots and returns the first.
+    std::uint32_t reserve(std::uint32_t n);
+
+    // Fills the slots from `first` on with `records`, named `names`. Sets
+    // the records' name offsets and lengths. `contents` is empty unless the
+    // snapshot has content hashes.
+    void write(std::uint32_t first, std::span<SnapshotNode> records,
+               std::span<std::string const> names,
+               std::span<Digest const> hashes,
+               std::span<Digest const> contents);
+
+    // Puts the sections together and moves the snapshot in place. Every
+    // reserved slot has to be written by then, and the root be slot 0.
+    void finish();
+
+  private:
+    std::filesystem::path path_;
+    std::filesystem::path tmp_;
+    bool content_hashes_;
+    std::uint32_t hash_algorithm_;
+    std::string filter_;
+    std::fstream nodes_; // The snapshot under its temporary name
+    std::fstream hashes_;
+    std::fstream contents_;
+    std::fstream strings_;
+    std::uint64_t node_count_{0};
+    std::uint64_t string_bytes_{0};
+    bool finished_{false};
+};
\ No newline at end of file
@@ -0,0 +1,210 @@
+#include <libtree/copy_engine.hpp>
+#include <libtree/metrics.hpp>
+#include <libtree/print.hpp>
+#include <libtree/sync_plan.hpp>
+#include <libtree/thread_pool.hpp>
+
+#include <map>
+#include <optional>
+
+namespace {
+
+// Runs `f(i)` for every i in [0, n), as tasks of `pool` if there is one.
+template <typename F> void for_each_index(ThreadPool *pool, std::size_t n, F f)
+{
+    if (pool == nullptr || n < 2) {
+        for (std::size_t i{}; i != n; ++i) {
+            f(i);
+        }
+        return;
+    }
+    TaskGroup group{*pool};
+    for (std::size_t i{}; i != n; ++i) {
+        group.run([&f, i] { f(i); });
+    }
+    group.wait();
+}
+
+std::uint64_t apply_local_on(SyncPlan const &plan, ThreadPool *pool)
+{
+    namespace fs = std::filesystem;
+
+    // Moved files wait here while deletions and creations go on around
+    // them: one may come out of a folder that is deleted, or go where a
+    // deleted file was.
+    auto const staging{plan.dest_root / ".tree-moves"};
+    auto staged{[&staging](std::size_t i) {
+        return staging / std::to_string(i);
+    }};
+    if (!plan.moves.empty()) {
+        fs::create_directories(staging);
+        for (std::size_t i{}; i != plan.moves.size(); ++i) {
+            if (!plan.moves[i].copy) {
+                fs::rename(plan.dest_root / plan.moves[i].from, staged(i));
+            }
+        }
+    }
+
+    // Deleted entries are disjoint subtrees, so they go all at once. All of
+    // them are gone before anything is created: an entry whose type changed
+    // makes way for its replacement.
+    {
+        PhaseTimer const timer{Phase::remove};
+        for_each_index(pool, plan.deletes.size(), [&plan](std::size_t i) {
+            auto const &e{plan.deletes[i]};
+            auto const target{plan.dest_root / e.path};
+            if (e.folder) {
+                Metrics::add(Counter::entries_deleted,
+                             fs::remove_all(target)); // 删除文件夹
+            }
+            else {
+                Metrics::add(Counter::entries_deleted,
+                             fs::remove(target) ? 1 : 0); // 删除文件
+            }
+        });
+    }
+
+    // Folders are created before anything is moved or copied into them,
+    // one depth at a time: a folder's parent either exists or is one level
+    // up in the plan.
+    PhaseTimer const timer{Phase::copy};
+    std::map<std::size_t, std::vector<fs::path const *>> levels;
+    for (auto const &e : plan.creates) {
+        if (e.folder) {
+            auto const depth{static_cast<std::size_t>(
+                std::distance(e.path.begin(), e.path.end()))};
+            levels[depth].push_back(&e.path);
+        }
+    }
+    for (auto const &[depth, folders] : levels) {
+        for_each_index(pool, folders.size(), [&](std::size_t i) {
+            auto const target{plan.dest_root / *folders[i]};
+            debugln("Creating folder \"{}\"...", target.string());
+            fs::create_directory(target);
+        });
+    }
+
+    std::uint64_t written{};
+    for (std::size_t i{}; i != plan.moves.size(); ++i) {
+        auto const &m{plan.moves[i]};
+        auto const target{plan.dest_root / m.to};
+        debugln("Moving \"{}\" to \"{}\"...", m.from.string(),
+                m.to.string());
+        if (m.copy) {
+            written += transfer_file(plan.dest_root / m.from, target);
+        }
+        else {
+            fs::rename(staged(i), target);
+        }
+        fs::last_write_time(
+            target, fs::file_time_type{fs::file_time_type::duration{m.mtime}});
+        Metrics::add(Counter::files_moved);
+        Metrics::add(Counter::bytes_moved, m.bytes);
+    }
+    if (!plan.moves.empty()) {
+        fs::remove_all(staging);
+    }
+    return written;
+}
+
+} // namespace
+
+void SyncPlan::print(std::ostream &os) const
+{
+    for (auto const &e : deletes) {
+        std::println(os, "- {}{}", e.path.string(), e.folder ? "/" : "");
+    }
+    for (auto const &e : creates) {
+        std::println(os, "+ {}{}", e.path.string(), e.folder ? "/" : "");
+    }
+    for (auto const &m : moves) {
+        std::println(os, "> {} -> {}{}", m.from.string(), m.to.string(),
+                     m.copy ? " (copy)" : "");
+    }
+    for (auto const &e : modifies) {
+        std::println(os, "~ {}", e.path.string());
+    }
+    std::println(os,
+                 "{} deletions ({} bytes), {} creations ({} bytes), "
+                 "{} moves ({} bytes), {} modifications ({} bytes)",
+                 deletes.size(), delete_bytes, creates.size(), create_bytes,
+                 moves.size(), move_bytes, modifies.size(), modify_bytes);
+}
+
+std::uint64_t apply_local(SyncPlan const &plan, SyncOptions const &options)
+{
+    std::optional<ThreadPool> pool;
+    if (options.io_jobs > 1) {
+        pool.emplace(options.io_jobs);
+    }
+    return apply_local_on(plan, pool ? &*pool : nullptr);
+}
+
+std::uint64_t execute(SyncPlan const &plan, SyncOptions const &options)
+{
+    return execute(std::span{&plan, 1}, options);
+}
+
+std::uint64_t execute(std::span<SyncPlan const> plans,
+                      SyncOptions const &options)
+{
+    namespace fs = std::filesystem;
+
+    // One pool for all of it, so that no more than `io_jobs` operations are
+    // in flight at any time.
+    std::optional<ThreadPool> pool;
+    if (options.io_jobs > 1) {
+        pool.emplace(options.io_jobs);
+    }
+    std::uint64_t moved{};
+    for (auto const &plan : plans) {
+        moved += apply_local_on(plan, pool ? &*pool : nullptr);
+    }
+
+    PhaseTimer const timer{Phase::copy};
+    CopyEngine engine{pool ? &*pool : nullptr};
+
+    // Each source file goes to every destination that needs it in one
+    // copy, in the order the plans first list it. Delta updates compare
+    // against their own target and go alone.
+    std::map<fs::path, std::size_t> copyIndex;
+    std::vector<std::pair<fs::path, std::vector<fs::path>>> copies;
+    auto copyTo{[&](SyncPlan const &plan, fs::path const &path) {
+        auto const [it, added] = copyIndex.emplace(path, copies.size());
+        if (added) {
+            copies.emplace_back(plan.source_root / path,
+                                std::vector<fs::path>{});
+        }
+        copies[it->second].second.push_back(plan.dest_root / path);
+    }};
+    for (auto const &plan : plans) {
+        for (auto const &e : plan.creates) {
+            if (!e.folder) {
+                debugln("Didn't find corresponding file in B, syncing to "
+                        "target \"{}\"...",
+                        (plan.dest_root / e.path).string());
+                copyTo(plan, e.path);
+            }
+        }
+        for (auto const &e : plan.modifies) {
+            // 覆盖更新
+            if (options.delta && e.bytes >= options.delta_min_size) {
+                engine.submit_delta(plan.source_root / e.path,
+                                    plan.dest_root / e.path);
+            }
+            else {
+                copyTo(plan, e.path);
+            }
+        }
+    }
+    for (auto &[source, targets] : copies) {
+        if (targets.size() == 1) {
+            engine.submit(std::move(source), std::move(targets.front()));
+        }
+        else {
+            engine.submit(std::move(source), std::move(targets));
+        }
+    }
+    engine.wait();
+    return moved + engine.bytes_written();
+}
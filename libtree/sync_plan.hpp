@@ -0,0 +1,93 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <filesystem>
+#include <ostream>
+#include <span>
+#include <vector>
+
+// Everything a sync has to do to the destination, worked out before any of
+// it is done. Paths are relative to the two roots.
+struct SyncPlan {
+    struct Entry {
+        std::filesystem::path path;
+        bool folder{false};
+        // Bytes to copy for creations and modifications (0 for folders,
+        // their files are entries of their own), bytes freed for deletions
+        // (whole subtree for folders).
+        std::uint64_t bytes{0};
+    };
+
+    // A file to create or modify whose content the destination already has,
+    // in a file that is deleted or modified: that file is renamed instead of
+    // the content being copied again. Later files with the same content are
+    // copied from the first one within the destination (cloned where the
+    // file system can).
+    struct Move {
+        std::filesystem::path from; // Relative to dest_root
+        std::filesystem::path to;
+        std::uint64_t bytes{0};
+        std::int64_t mtime{0}; // Of the source file, in file clock ticks
+        bool copy{false};      // `from` is the `to` of an earlier move
+    };
+
+    std::filesystem::path source_root;
+    std::filesystem::path dest_root;
+
+    // Applied in this order, except that moves take their files out of the
+    // way first. Deletions come first so that an entry whose type changed is
+    // gone before its replacement is created; creations list every folder
+    // before its contents. Files that are moved aren't created or modified.
+    std::vector<Entry> deletes;
+    std::vector<Entry> creates;
+    std::vector<Move> moves;
+    std::vector<Entry> modifies;
+
+    std::uint64_t delete_bytes{0};
+    std::uint64_t create_bytes{0};
+    std::uint64_t move_bytes{0};
+    std::uint64_t modify_bytes{0};
+
+    [[nodiscard]] bool empty() const
+    {
+        return deletes.empty() && creates.empty() && moves.empty() &&
+               modifies.empty();
+    }
+
+    // One line per entry ("- ", "+ ", "> ", "~ " prefixed), then totals.
+    void print(std::ostream &os) const;
+};
+
+// Knobs for applying a sync to the file system. CPU and I/O work are
+// capped separately: comparing trees is bound by the cores, deleting,
+// creating and copying by the latency of the disks.
+struct SyncOptions {
+    // Threads comparing the trees.
+    std::size_t jobs{1};
+
+    // Number of file system operations (deletions, folder creations, file
+    // copies) kept in flight.
+    std::size_t io_jobs{1};
+
+    // Modified files of at least `delta_min_size` bytes are updated in
+    // place, writing only the blocks that changed (delta_transfer_file).
+    bool delta{false};
+    std::uint64_t delta_min_size{16U << 20};
+};
+
+// The steps of `execute` that don't read the source: moves, deletions and
+// folder creations. For applying plans whose files come from elsewhere than
+// `source_root`. Returns the number of bytes written.
+std::uint64_t apply_local(SyncPlan const &plan,
+                          SyncOptions const &options = {});
+
+// Applies `plan` to the file system. Copied files keep their source mtime.
+// Returns the number of bytes written.
+std::uint64_t execute(SyncPlan const &plan, SyncOptions const &options = {});
+
+// Applies `plans` that share their source_root, e.g. one per replica of a
+// tree. Every source file is read once, for all the plans that copy it.
+// Returns the number of bytes written, to all destinations together.
+std::uint64_t execute(std::span<SyncPlan const> plans,
+                      SyncOptions const &options = {});
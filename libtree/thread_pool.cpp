@@ -0,0 +1,148 @@
+#include <libtree/thread_pool.hpp>
+
+#include <utility>
+
+namespace {
+
+// The pool and worker index owning this thread, if it is a pool worker.
+thread_local ThreadPool const *current_pool = nullptr;
+thread_local std::size_t current_index = 0;
+
+} // namespace
+
+ThreadPool::ThreadPool(std::size_t threads)
+{
+    if (threads == 0) {
+        threads = 1;
+    }
+    queues_.reserve(threads);
+    for (std::size_t i{}; i != threads; ++i) {
+        queues_.push_back(std::make_unique<Queue>());
+    }
+    workers_.reserve(threads);
+    for (std::size_t i{}; i != threads; ++i) {
+        workers_.emplace_back([this, i] { worker_loop(i); });
+    }
+}
+
+ThreadPool::~ThreadPool()
+{
+    {
+        std::lock_guard lock{sleep_mutex_};
+        stopping_ = true;
+    }
+    wakeup_.notify_all();
+    for (auto &t : workers_) {
+        t.join();
+    }
+}
+
+void ThreadPool::submit(Task task)
+{
+    std::size_t const target{current_pool == this
+                                 ? current_index
+                                 : next_queue_++ % queues_.size()};
+    {
+        std::lock_guard lock{queues_[target]->mutex};
+        queues_[target]->tasks.push_back(std::move(task));
+    }
+    {
+        // Taking the lock orders the increment against a worker that is
+        // about to go to sleep, so the wakeup can't be lost.
+        std::lock_guard lock{sleep_mutex_};
+        ++pending_;
+    }
+    wakeup_.notify_one();
+}
+
+bool ThreadPool::pop_or_steal(std::size_t self, Task &task)
+{
+    auto const n{queues_.size()};
+    if (self < n) {
+        auto &own{*queues_[self]};
+        std::lock_guard lock{own.mutex};
+        if (!own.tasks.empty()) {
+            task = std::move(own.tasks.back());
+            own.tasks.pop_back();
+            return true;
+        }
+    }
+    for (std::size_t k{1}; k <= n; ++k) {
+        auto &victim{*queues_[(self + k) % n]};
+        std::lock_guard lock{victim.mutex};
+        if (!victim.tasks.empty()) {
+            task = std::move(victim.tasks.front());
+            victim.tasks.pop_front();
+            return true;
+        }
+    }
+    return false;
+}
+
+bool ThreadPool::run_one()
+{
+    Task task;
+    auto const self{current_pool == this ? current_index : queues_.size()};
+    if (!pop_or_steal(self, task)) {
+        return false;
+    }
+    --pending_;
+    task();
+    return true;
+}
+
+void ThreadPool::worker_loop(std::size_t index)
+{
+    current_pool = this;
+    current_index = index;
+
+    while (true) {
+        if (run_one()) {
+            continue;
+        }
+        std::unique_lock lock{sleep_mutex_};
+        wakeup_.wait(lock, [this] { return stopping_ || pending_ != 0; });
+        if (stopping_ && pending_ == 0) {
+            return;
+        }
+    }
+}
+
+TaskGroup::~TaskGroup()
+{
+    // Never leave tasks running that reference this group.
+    while (pending_ != 0) {
+        if (!pool_.run_one()) {
+            std::this_thread::yield();
+        }
+    }
+}
+
+void TaskGroup::run(std::function<void()> f)
+{
+    ++pending_;
+    pool_.submit([this, f{std::move(f)}] {
+        try {
+            f();
+        }
+        catch (...) {
+            std::lock_guard lock{error_mutex_};
+            if (!error_) {
+                error_ = std::current_exception();
+            }
+        }
+        --pending_;
+    });
+}
+
+void TaskGroup::wait()
+{
+    while (pending_ != 0) {
+        if (!pool_.run_one()) {
+            std::this_thread::yield();
+        }
+    }
+    if (error_) {
+        std::rethrow_exception(std::exchange(error_, nullptr));
+    }
+}
@@ -0,0 +1,82 @@
+#pragma once
+
+#include <atomic>
+#include <condition_variable>
+#include <cstddef>
+#include <deque>
+#include <exception>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+// A small work-stealing thread pool.
+//
+// Every worker owns a deque. Tasks submitted from a worker go to the back of
+// its own deque and are popped LIFO (good locality for recursive scans), idle
+// workers steal from the front of other deques. Tasks submitted from outside
+// the pool are distributed round-robin.
+class ThreadPool {
+  public:
+    using Task = std::function<void()>;
+
+    explicit ThreadPool(std::size_t threads);
+
+    ThreadPool(ThreadPool const &) = delete;
+    ThreadPool &operator=(ThreadPool const &) = delete;
+
+    ~ThreadPool();
+
+    void submit(Task task);
+
+    // Runs at most one pending task on the calling thread. Returns false if
+    // there was nothing to run. Used by waiters to help instead of blocking,
+    // so nested fork-join never deadlocks.
+    bool run_one();
+
+    [[nodiscard]] std::size_t size() const
+    {
+        return workers_.size();
+    }
+
+  private:
+    struct Queue {
+        std::mutex mutex;
+        std::deque<Task> tasks;
+    };
+
+    bool pop_or_steal(std::size_t self, Task &task);
+
+    void worker_loop(std::size_t index);
+
+    std::vector<std::unique_ptr<Queue>> queues_;
+    std::vector<std::thread> workers_;
+    std::atomic<std::size_t> pending_{0};
+    std::atomic<std::size_t> next_queue_{0};
+    std::mutex sleep_mutex_;
+    std::condition_variable wakeup_;
+    bool stopping_{false};
+};
+
+// Fork-join helper: tracks tasks spawned by one scope and waits for all of
+// them. The first exception thrown by a task is rethrown from `wait`.
+class TaskGroup {
+  public:
+    explicit TaskGroup(ThreadPool &pool) : pool_(pool) {}
+
+    TaskGroup(TaskGroup const &) = delete;
+    TaskGroup &operator=(TaskGroup const &) = delete;
+
+    ~TaskGroup();
+
+    void run(std::function<void()> f);
+
+    void wait();
+
+  private:
+    ThreadPool &pool_;
+    std::atomic<std::size_t> pending_{0};
+    std::mutex error_mutex_;
+    std::exception_ptr error_;
+};
@@ -1,55 +1,871 @@
+#include <libtree/copy_engine.hpp>
+#include <libtree/file_reader.hpp>
 #include <libtree/tree.hpp>
 
-bool MerkleTree::FileNode::isFolder()
+#include <deque>
+#include <iterator>
+
+namespace {
+
+// Ids per list or fetch request, and requests in flight. Whatever is in
+// flight has to fit into the stream's buffers (a pipe holds 64 KiB), or both
+// sides could end up blocked writing to each other.
+constexpr std::size_t remote_batch_size{256};
+constexpr std::size_t remote_window{8};
+
+constexpr std::size_t remote_chunk_size{256U << 10};
+
+constexpr std::uint8_t listing_has_content{1U << 0};
+
+// Subfolders with at least this many files, on both sides together, are
+// planned as tasks of their own when syncing with several jobs. Smaller
+// ones aren't worth a task.
+constexpr std::uint32_t parallel_plan_files{4096};
+
+// Appends the entries of `part`, planned for a subfolder, to `plan`.
+void appendPlan(SyncPlan &plan, SyncPlan &&part)
+{
+    auto append{[](auto &to, auto &from) {
+        to.insert(to.end(), std::make_move_iterator(from.begin()),
+                  std::make_move_iterator(from.end()));
+    }};
+    append(plan.deletes, part.deletes);
+    append(plan.creates, part.creates);
+    append(plan.moves, part.moves);
+    append(plan.modifies, part.modifies);
+    plan.delete_bytes += part.delete_bytes;
+    plan.create_bytes += part.create_bytes;
+    plan.move_bytes += part.move_bytes;
+    plan.modify_bytes += part.modify_bytes;
+}
+
+// A single path component, which can't lead out of the destination.
+bool valid_remote_name(std::string_view name)
+{
+    return !name.empty() && name != "." && name != ".." &&
+           name.find_first_of(std::string_view{"/\0", 2}) ==
+               std::string_view::npos;
+}
+
+std::uint64_t path_hash(std::filesystem::path const &relative)
+{
+    return xxh64({reinterpret_cast<unsigned char const *>(
+                      relative.native().data()),
+                  relative.native().size() *
+                      sizeof(std::filesystem::path::value_type)});
+}
+
+} // namespace
+
+template <typename HashPolicy>
+std::vector<DirEntry> BasicMerkleTree<HashPolicy>::listDirectory(
+    DirectoryHandle &dir, std::filesystem::path const &relative,
+    std::optional<FileIdentity> const &id, ScanContext const &ctx) const
+{
+    bool const cached{ctx.cache != nullptr && id};
+    std::vector<DirEntry> entries;
+    std::optional<std::vector<std::string>> names;
+    if (cached) {
+        names = ctx.cache->find_listing(*id);
+    }
+    if (names) {
+        ctx.cache->record_listing(*id, *names);
+        // Sorted when recorded. The types weren't kept, so every entry is
+        // stat'ed.
+        entries.reserve(names->size());
+        for (auto &name : *names) {
+            entries.push_back({std::move(name), FileType::unknown});
+        }
+    }
+    else {
+        // 维护一个相对稳定的顺序（使用迭代器遍历文件的顺序可能不一致）
+        entries = dir.entries();
+
+        if (cached) {
+            names.emplace();
+            names->reserve(entries.size());
+            for (auto const &entry : entries) {
+                names->push_back(entry.name);
+            }
+            ctx.cache->record_listing(*id, *names);
+        }
+    }
+
+    // Excluded entries go before anything else is done with them. The
+    // cache still gets the whole listing: it's about the directory, not
+    // about what we make of it.
+    if (!filter_.empty()) {
+        std::erase_if(entries, [&](DirEntry const &entry) {
+            bool isDir{entry.type == FileType::directory};
+            if ((entry.type == FileType::unknown ||
+                 entry.type == FileType::symlink) &&
+                filter_.has_directory_rules()) {
+                isDir = dir.stat(entry.name).directory;
+            }
+            return filter_.excludes((relative / entry.name).generic_string(),
+                                    isDir);
+        });
+    }
+    return entries;
+}
+
+template <typename HashPolicy>
+typename BasicMerkleTree<HashPolicy>::ScannedNode
+BasicMerkleTree<HashPolicy>::makeLeaf(
+    std::filesystem::path const &relative, ScanContext const &ctx, NodeId ref,
+    FileStat const &st) const
+{
+    ScannedNode leaf;
+    leaf.path = relative;
+    leaf.node.type = st.type;
+    // A symlink's identity doesn't change with what it points to, so
+    // symlinks aren't cached.
+    if (ctx.cache != nullptr && st.type != FileType::symlink) {
+        leaf.identity = st.identity;
+    }
+    bool const contentMode{hash_mode_ == HashMode::content};
+
+    // Unchanged since the cached scan: no read, and if the path is the
+    // same, no hashing at all.
+    HashCache::FileRecord const *cached{
+        leaf.identity ? ctx.cache->find_file(*leaf.identity) : nullptr};
+    if (cached != nullptr &&
+        (!contentMode || (cached->flags & HashCache::has_content) != 0)) {
+        leaf.node.size = cached->size;
+        leaf.node.mtime = cached->mtime;
+        if ((cached->flags & HashCache::has_content) != 0) {
+            leaf.content = cached->content;
+            leaf.node.hasContent = true;
+        }
+        if (cached->path_hash == path_hash(relative) &&
+            ((cached->flags & HashCache::content_leaf) != 0) == contentMode &&
+            cached->leaf_algorithm == HashPolicy::id) {
+            leaf.hash = cached->leaf;
+            leaf.hashed = true;
+        }
+        return leaf;
+    }
+
+    leaf.node.size = st.size;
+    leaf.node.mtime = st.mtime; // 最近修改时间, or 0 for dangling symlinks
+
+    // Only files, and symlinks to them, have content. Anything else
+    // (devices, pipes, dangling or looping symlinks) has none to compare or
+    // to back up, and its leaf hash is that of the zero digest.
+    if (contentMode && st.regular) {
+        // (size, mtime) unchanged: trust the digest we already have.
+        FileNode const *r{ref != nil ? &ctx.reference->arena_[ref] : nullptr};
+        bool const reuse{r != nullptr && r->hasContent &&
+                         r->size == leaf.node.size &&
+                         r->mtime == leaf.node.mtime};
+        leaf.content =
+            reuse ? ctx.reference->arena_.content(ref)
+                  : hash_file_content(base_dir_ / relative, st.size, ctx.pool);
+        leaf.node.hasContent = true;
+    }
+    return leaf;
+}
+
+template <typename HashPolicy>
+void BasicMerkleTree<HashPolicy>::hashLeaves(std::span<ScannedNode> nodes,
+                                             ScanContext const &ctx) const
+{
+    PhaseTimer const timer{Phase::hash};
+    std::vector<ScannedNode *> pending;
+    std::vector<std::string> inputs;
+    for (auto &n : nodes) {
+        if (!n.node.isFolder() && !n.hashed) {
+            pending.push_back(&n);
+            inputs.push_back(leafInput(leafStamp(n), n.path));
+        }
+    }
+    std::vector<Digest> digests(inputs.size());
+    HashPolicy::hash_batch(inputs, digests);
+    Metrics::add(Counter::hash_calls, inputs.size());
+
+    for (std::size_t i{}; i != pending.size(); ++i) {
+        pending[i]->hash = digests[i];
+        pending[i]->hashed = true;
+    }
+
+    if (ctx.cache == nullptr) {
+        return;
+    }
+    for (auto const &leaf : nodes) {
+        if (leaf.node.isFolder() || !leaf.identity) {
+            continue;
+        }
+        HashCache::FileRecord record{};
+        record.identity = *leaf.identity;
+        record.path_hash = path_hash(leaf.path);
+        record.size = leaf.node.size;
+        record.mtime = leaf.node.mtime;
+        record.content = leaf.content;
+        record.leaf = leaf.hash;
+        record.flags = (leaf.node.hasContent ? HashCache::has_content : 0U) |
+                       (hash_mode_ == HashMode::content
+                            ? HashCache::content_leaf
+                            : 0U);
+        record.leaf_algorithm = HashPolicy::id;
+        ctx.cache->record_file(record);
+    }
+}
+
+template <typename HashPolicy>
+void BasicMerkleTree<HashPolicy>::refreshFolder(
+    NodeId folder, std::span<std::filesystem::path const> replaced)
 {
     namespace fs = std::filesystem;
-    return fs::is_directory(filepath);
+
+    // In content mode, files whose size and mtime didn't change keep their
+    // digest instead of being read again.
+    ScanContext ctx;
+    ctx.reference = this;
+
+    load(folder);
+    auto const prefix{relativePath(folder)};
+    DirectoryHandle dir{base_dir_ / prefix};
+    auto const listed{listDirectory(dir, prefix, std::nullopt, ctx)};
+
+    // Scans first, changes the arena afterwards: scanning reads our nodes.
+    // Each entry is a kept subfolder, or else indexes `fresh`.
+    struct Entry {
+        NodeId kept;
+        std::size_t fresh;
+    };
+    std::vector<Entry> entries;
+    std::vector<ScannedNode> fresh;
+    std::vector<NodeId> dropped;
+    entries.reserve(listed.size());
+
+    NodeId const oldFirst{arena_[folder].firstChild};
+    NodeId const oldCount{arena_[folder].childCount};
+    NodeId const oldEnd{oldFirst + oldCount};
+    NodeId j{oldFirst};
+    for (auto const &entry : listed) {
+        auto const p{prefix / entry.name};
+        while (j != oldEnd && name(j) < entry.name) {
+            dropped.push_back(j++); // 已被删除
+        }
+        NodeId const old{j != oldEnd && name(j) == entry.name ? j++ : nil};
+        auto const st{statEntry(dir, entry, ctx)};
+        bool const isDir{st.directory};
+        if (old != nil && isDir && arena_[old].isFolder() &&
+            !std::ranges::binary_search(replaced, p)) {
+            entries.push_back({old, 0});
+            continue;
+        }
+        if (old != nil) {
+            dropped.push_back(old);
+        }
+        entries.push_back({nil, fresh.size()});
+        fresh.push_back(
+            isDir ? buildTree(p,
+                              DirectoryHandle{dir, entry.name,
+                                              st.type == FileType::symlink},
+                              std::nullopt, ctx)
+                  : makeLeaf(p, ctx,
+                             old != nil && !arena_[old].isFolder() ? old : nil,
+                             st));
+    }
+    while (j != oldEnd) {
+        dropped.push_back(j++);
+    }
+    hashLeaves(fresh, ctx);
+
+    for (NodeId const d : dropped) {
+        freeSubtree(d);
+    }
+    auto const n{static_cast<uint32_t>(entries.size())};
+    NodeId const first{arena_.alloc(n)};
+    for (uint32_t k{}; k != n; ++k) {
+        if (entries[k].kept != nil) {
+            moveNode(entries[k].kept, first + k);
+        }
+        else {
+            layoutInto(first + k, std::move(fresh[entries[k].fresh]));
+        }
+        arena_[first + k].parent = folder;
+    }
+    arena_.free(oldFirst, oldCount);
+    arena_[folder].firstChild = first;
+    arena_[folder].childCount = n;
+
+    markDirty(folder);
 }
 
-bool MerkleTree::FileNode::isDiff(FileNode const *other)
+template <typename HashPolicy>
+void BasicMerkleTree<HashPolicy>::refresh(
+    std::span<std::filesystem::path const> dirs,
+    std::span<std::filesystem::path const> replaced)
 {
-    return this->hash != other->hash;
+    PhaseTimer const timer{Phase::scan};
+    for (auto const &dir : dirs) {
+        NodeId const node{findPath(dir)};
+        Metrics::add(Counter::stat_calls);
+        if (node != nil && arena_[node].isFolder() &&
+            std::filesystem::is_directory(base_dir_ / dir)) {
+            refreshFolder(node, replaced);
+        }
+    }
+    flushHashes();
 }
 
-MerkleTree::FileNode::FileNode(std::string const &time,
-                               std::filesystem::path const &path)
-    : filepath(path)
+template <typename HashPolicy>
+SyncPlan
+BasicMerkleTree<HashPolicy>::planFrom(BasicMerkleTree const &other,
+                                      ThreadPool *pool) const
 {
-    hashString = time + '|' + path.string();
-    SHA256(reinterpret_cast<unsigned char const *>(hashString.c_str()),
-           hashString.size(), hash.data());
+    if (hash_mode_ != other.hash_mode_) {
+        throw std::runtime_error{"can't sync trees built with different hash "
+                                 "modes"};
+    }
+    // Entries only one side excludes would look deleted or created.
+    if (filter_.rules() != other.filter_.rules()) {
+        throw std::runtime_error{"can't sync trees scanned with different "
+                                 "filters"};
+    }
+    PhaseTimer const timer{Phase::diff};
+    SyncPlan plan;
+    plan.source_root = other.base_dir_;
+    plan.dest_root = base_dir_;
+    planSync(other, other.root_, root_, {}, plan, pool);
+    planMoves(other, plan);
+    return plan;
 }
-MerkleTree::FileNode::FileNode(std::string s) : hashString(std::move(s))
+
+template <typename HashPolicy>
+SyncPlan
+BasicMerkleTree<HashPolicy>::plan_sync_from(BasicMerkleTree const &other,
+                                            std::size_t jobs) const
 {
-    SHA256(reinterpret_cast<unsigned char const *>(hashString.c_str()),
-           hashString.size(), hash.data());
+    std::optional<ThreadPool> pool;
+    if (jobs > 1 && unloaded_.empty() && other.unloaded_.empty() &&
+        isDiff(other, root_, other.root_)) {
+        pool.emplace(jobs);
+    }
+    return planFrom(other, pool ? &*pool : nullptr);
 }
 
-MerkleTree::FileNode::FileNode(unsigned char *h)
+template <typename HashPolicy>
+std::uint64_t
+BasicMerkleTree<HashPolicy>::sync_all(std::span<BasicMerkleTree> dests,
+                                      BasicMerkleTree const &src,
+                                      SyncOptions const &options)
 {
-    std::memcpy(hash.data(), h, 32);
+    // Planning and reconciling only read `src` and each touch one
+    // destination, so destinations go in parallel unless a tree still has
+    // folders to load.
+    std::optional<ThreadPool> pool;
+    if (options.jobs > 1 && src.unloaded_.empty() &&
+        std::ranges::all_of(dests, [](BasicMerkleTree const &dest) {
+            return dest.unloaded_.empty();
+        })) {
+        pool.emplace(options.jobs);
+    }
+    auto forEachDest{[&](auto f) {
+        if (!pool) {
+            for (std::size_t i{}; i != dests.size(); ++i) {
+                f(i);
+            }
+            return;
+        }
+        TaskGroup group{*pool};
+        for (std::size_t i{}; i != dests.size(); ++i) {
+            group.run([&f, i] { f(i); });
+        }
+        group.wait();
+    }};
+
+    std::vector<SyncPlan> plans(dests.size());
+    forEachDest([&](std::size_t i) {
+        plans[i] = dests[i].planFrom(src, pool ? &*pool : nullptr);
+    });
+    auto const written{execute(plans, options)};
+    forEachDest([&](std::size_t i) {
+        dests[i].syncTree(src, src.root_, dests[i].root_);
+    });
+    return written;
 }
 
-MerkleTree::FileNode::FileNode(FileNode *other)
-    : hashString(other->hashString), parent(other->parent),
-      firstChild(other->firstChild), next(other->next),
-      childNum(other->childNum), hash{other->hash}
+template <typename HashPolicy>
+std::uint64_t
+BasicMerkleTree<HashPolicy>::sync_from(BasicMerkleTree const &other,
+                                       SyncOptions const &options)
 {
+    auto const written{execute(plan_sync_from(other, options.jobs), options)};
+    syncTree(other, other.root_, root_);
+    return written;
 }
 
-MerkleTree::FileNode::FileNode()
+template <typename HashPolicy>
+std::uint64_t BasicMerkleTree<HashPolicy>::backup_to(ChunkStore &store) const
 {
-    hashString = "";
-    SHA256(reinterpret_cast<unsigned char const *>(hashString.c_str()),
-           hashString.size(), hash.data());
+    if (hash_mode_ != HashMode::content) {
+        throw std::runtime_error{"backups need a tree built in content mode"};
+    }
+
+    {
+        PhaseTimer const timer{Phase::copy};
+        std::vector<NodeId> pending{root_};
+        while (!pending.empty()) {
+            auto const folder{pending.back()};
+            pending.pop_back();
+            load(folder);
+            auto const first{arena_[folder].firstChild};
+            auto const n{arena_[folder].childCount};
+            for (NodeId c{first}; c != first + n; ++c) {
+                if (arena_[c].isFolder()) {
+                    pending.push_back(c);
+                }
+                else if (!arena_[c].hasContent) {
+                    // Restoring it would only make an empty file of it.
+                    errorln("Not backing up \"{}\": not a file or directory",
+                            relativePath(c).string());
+                }
+                else if (!store.has_file(arena_.content(c))) {
+                    debugln("Storing \"{}\"...", relativePath(c).string());
+                    store.put_file(base_dir_ / relativePath(c),
+                                   arena_.content(c));
+                    Metrics::add(Counter::files_copied);
+                }
+            }
+        }
+    }
+
+    // Last, so that a version only ever refers to stored content.
+    writeTree(store.staging_path().string());
+    return store.add_version();
 }
 
-void MerkleTree::sync_from(MerkleTree const &other)
+template <typename HashPolicy>
+std::uint64_t
+BasicMerkleTree<HashPolicy>::restore_from(ChunkStore const &store,
+                                          BasicMerkleTree const &version,
+                                          SyncOptions const &options)
 {
-    syncFile(other.root_, root_, other.root_->filepath, root_->filepath);
+    namespace fs = std::filesystem;
+
+    auto const plan{plan_sync_from(version, options.jobs)};
+    auto written{apply_local(plan, options)};
+
+    PhaseTimer const timer{Phase::copy};
+    auto restore{[&](fs::path const &path) {
+        NodeId const file{version.findPath(path)};
+        auto const target{base_dir_ / path};
+        // Nothing to put there. Older versions recorded devices and pipes
+        // with the empty content.
+        if (!version.arena_[file].hasContent ||
+            version.arena_[file].type == FileType::other) {
+            errorln("Not restoring \"{}\": not a file or directory",
+                    path.string());
+            return;
+        }
+        debugln("Restoring \"{}\"...", target.string());
+        written += store.get_file(version.arena_.content(file), target);
+        fs::last_write_time(target,
+                            fs::file_time_type{fs::file_time_type::duration{
+                                version.arena_[file].mtime}});
+        Metrics::add(Counter::files_copied);
+    }};
+    for (auto const &e : plan.creates) {
+        if (!e.folder) {
+            restore(e.path);
+        }
+    }
+    for (auto const &e : plan.modifies) {
+        restore(e.path);
+    }
+
+    syncTree(version, version.root_, root_);
+    return written;
+}
+
+template <typename HashPolicy>
+void BasicMerkleTree<HashPolicy>::writeListing(NodeId folder,
+                                               WireWriter &out) const
+{
+    load(folder);
+    auto const &dir{arena_[folder]};
+    out.u32(dir.firstChild);
+    out.u32(dir.childCount);
+    for (NodeId c{dir.firstChild}; c != dir.firstChild + dir.childCount; ++c) {
+        auto const &node{arena_[c]};
+        out.string(name(c));
+        out.u8(static_cast<std::uint8_t>(node.type));
+        out.u8(node.hasContent ? listing_has_content : 0);
+        out.u64(node.size);
+        out.i64(node.mtime);
+        out.u32(node.childNum);
+        out.digest(arena_.hash(c));
+        if (node.hasContent) {
+            out.digest(arena_.content(c));
+        }
+    }
+}
+
+template <typename HashPolicy>
+void BasicMerkleTree<HashPolicy>::sendFile(NodeId file, Channel &channel) const
+{
+    BufferedFileReader reader{base_dir_ / relativePath(file),
+                              remote_chunk_size};
+    for (auto block{reader.next()}; !block.empty(); block = reader.next()) {
+        channel.send(Message::data, block);
+    }
 }
 
-MerkleTree::MerkleTree(std::string dir_path)
+template <typename HashPolicy>
+void BasicMerkleTree<HashPolicy>::serve(Channel &channel) const
+{
+    // Tells the receiver why, then gives up.
+    auto fail{[&channel](std::string const &what) {
+        WireWriter out;
+        out.string(what);
+        channel.send(Message::error, out);
+        channel.flush();
+        throw std::runtime_error{what};
+    }};
+
+    std::vector<unsigned char> payload;
+    channel.expect(Message::hello, payload);
+    WireReader hello{payload};
+    if (hello.u32() != protocol_version) {
+        fail("unsupported protocol version");
+    }
+    if (hello.u32() != HashPolicy::id) {
+        fail("the trees use different hash algorithms");
+    }
+    if (hello.u8() != static_cast<std::uint8_t>(hash_mode_)) {
+        fail("the trees use different hash modes");
+    }
+
+    WireWriter out;
+    out.u32(protocol_version);
+    out.u32(HashPolicy::id);
+    out.u8(static_cast<std::uint8_t>(hash_mode_));
+    out.u32(root_);
+    out.digest(arena_.hash(root_));
+    out.string(base_dir_.string());
+    out.string(filter_.rules());
+    channel.send(Message::hello, out);
+
+    Message type{};
+    while (channel.receive(type, payload) && type != Message::done) {
+        WireReader in{payload};
+        out.clear();
+        if (type == Message::list) {
+            for (auto n{in.u32()}; n != 0; --n) {
+                auto const id{in.u32()};
+                if (!isNode(id) || !arena_[id].isFolder()) {
+                    fail("no such folder");
+                }
+                writeListing(id, out);
+            }
+            channel.send(Message::listing, out);
+        }
+        else if (type == Message::fetch) {
+            for (auto n{in.u32()}; n != 0; --n) {
+                auto const id{in.u32()};
+                if (!isNode(id) || arena_[id].isFolder()) {
+                    fail("no such file");
+                }
+                out.clear();
+                out.u32(id);
+                channel.send(Message::file, out);
+                try {
+                    sendFile(id, channel);
+                }
+                catch (std::exception const &e) {
+                    fail(e.what());
+                }
+                channel.send(Message::file_end);
+            }
+        }
+        else {
+            fail("unexpected message");
+        }
+    }
+    channel.flush();
+}
+
+template <typename HashPolicy>
+BasicMerkleTree<HashPolicy>
+BasicMerkleTree<HashPolicy>::fetchRemote(Channel &channel,
+                                         ServedTree const &served,
+                                         std::vector<NodeId> &remoteIds) const
+{
+    PhaseTimer const timer{Phase::diff};
+
+    if (served.filter != filter_.rules()) {
+        throw std::runtime_error{"can't sync trees scanned with different "
+                                 "filters"};
+    }
+
+    WireWriter out;
+    std::vector<unsigned char> payload;
+    BasicMerkleTree remote;
+    remote.hash_mode_ = hash_mode_;
+    if (hash_mode_ == HashMode::content) {
+        remote.arena_.keep_contents();
+    }
+    remote.root_ = remote.arena_.alloc(1);
+    remote.arena_[remote.root_].type = FileType::directory;
+    remoteIds.assign(1, served.root);
+    remote.arena_.hash(remote.root_) = served.hash;
+    remote.base_dir_ = served.base_dir;
+    remote.filter_ = filter_;
+
+    // Folders of `remote` to list, each with our folder at the same path,
+    // nil if we have none: then everything below it is listed.
+    std::deque<std::pair<NodeId, NodeId>> pending;
+    std::deque<std::vector<std::pair<NodeId, NodeId>>> inFlight;
+    if (remote.isDiff(*this, remote.root_, root_)) {
+        pending.emplace_back(remote.root_, root_);
+    }
+    else {
+        Metrics::add(Counter::subtrees_pruned);
+    }
+
+    while (!pending.empty() || !inFlight.empty()) {
+        while (inFlight.size() != remote_window && !pending.empty()) {
+            auto const n{std::min(pending.size(), remote_batch_size)};
+            std::vector<std::pair<NodeId, NodeId>> batch(
+                pending.begin(),
+                pending.begin() + static_cast<std::ptrdiff_t>(n));
+            pending.erase(pending.begin(),
+                          pending.begin() + static_cast<std::ptrdiff_t>(n));
+            out.clear();
+            out.u32(static_cast<std::uint32_t>(n));
+            for (auto const &entry : batch) {
+                out.u32(remoteIds[entry.first]);
+            }
+            channel.send(Message::list, out);
+            Metrics::add(Counter::requests);
+            inFlight.push_back(std::move(batch));
+        }
+
+        channel.expect(Message::listing, payload);
+        WireReader in{payload};
+        for (auto const &[folder, ours] : inFlight.front()) {
+            auto const firstId{in.u32()};
+            auto const n{in.u32()};
+            if (n == 0) {
+                continue;
+            }
+            if (uint64_t{firstId} + n > nil) {
+                throw std::runtime_error{"corrupt listing from remote"};
+            }
+            NodeId const first{remote.arena_.alloc(n)};
+            remote.arena_[folder].firstChild = first;
+            remote.arena_[folder].childCount = n;
+            remoteIds.resize(first + n);
+            Metrics::add(Counter::nodes_visited, n);
+
+            for (uint32_t k{}; k != n; ++k) {
+                NodeId const c{first + k};
+                auto const childName{in.string()};
+                if (!valid_remote_name(childName) ||
+                    (k != 0 && remote.name(c - 1) >= childName)) {
+                    throw std::runtime_error{"corrupt listing from remote"};
+                }
+                auto const type{in.u8()};
+                if (type > static_cast<std::uint8_t>(FileType::other)) {
+                    throw std::runtime_error{"corrupt listing from remote"};
+                }
+                auto const flags{in.u8()};
+
+                auto &node{remote.arena_[c]};
+                node.name = remote.names_.intern(childName);
+                node.parent = folder;
+                node.type = static_cast<FileType>(type);
+                node.size = in.u64();
+                node.mtime = in.i64();
+                node.childNum = in.u32();
+                remote.arena_.hash(c) = in.digest();
+                if ((flags & listing_has_content) != 0) {
+                    auto const content{in.digest()};
+                    node.hasContent = remote.arena_.keeps_contents();
+                    if (node.hasContent) {
+                        remote.arena_.content(c) = content;
+                    }
+                }
+                remoteIds[c] = firstId + k;
+
+                if (!node.isFolder()) {
+                    continue;
+                }
+                NodeId const match{findFile(ours, childName)};
+                bool const folderMatch{match != nil &&
+                                       arena_[match].isFolder()};
+                if (folderMatch && !isDiff(remote, match, c)) {
+                    Metrics::add(Counter::subtrees_pruned);
+                }
+                else {
+                    pending.emplace_back(c, folderMatch ? match : nil);
+                }
+            }
+        }
+        if (!in.at_end()) {
+            throw std::runtime_error{"corrupt listing from remote"};
+        }
+        inFlight.pop_front();
+    }
+    return remote;
+}
+
+template <typename HashPolicy>
+SyncPlan
+BasicMerkleTree<HashPolicy>::plan_sync_from(Channel &channel,
+                                            ServedTree const &served) const
+{
+    std::vector<NodeId> remoteIds;
+    auto const remote{fetchRemote(channel, served, remoteIds)};
+    channel.send(Message::done);
+    channel.flush();
+    return plan_sync_from(remote);
+}
+
+template <typename HashPolicy>
+std::uint64_t
+BasicMerkleTree<HashPolicy>::sync_from(Channel &channel,
+                                       ServedTree const &served)
+{
+    namespace fs = std::filesystem;
+
+    std::vector<NodeId> remoteIds;
+    auto const remote{fetchRemote(channel, served, remoteIds)};
+    auto const plan{plan_sync_from(remote)};
+    auto written{apply_local(plan)};
+
+    PhaseTimer const timer{Phase::copy};
+    std::vector<NodeId> files;
+    for (auto const &e : plan.creates) {
+        if (!e.folder) {
+            files.push_back(remote.findPath(e.path));
+        }
+    }
+    for (auto const &e : plan.modifies) {
+        files.push_back(remote.findPath(e.path));
+    }
+
+    // Requests go out a batch at a time, a few batches ahead of the files
+    // coming in.
+    WireWriter out;
+    std::vector<unsigned char> payload;
+    std::deque<std::size_t> batchEnds;
+    std::size_t requested{};
+    for (std::size_t received{}; received != files.size(); ++received) {
+        while (batchEnds.size() != remote_window &&
+               requested != files.size()) {
+            auto const n{
+                std::min(files.size() - requested, remote_batch_size)};
+            out.clear();
+            out.u32(static_cast<std::uint32_t>(n));
+            for (std::size_t k{}; k != n; ++k) {
+                out.u32(remoteIds[files[requested + k]]);
+            }
+            channel.send(Message::fetch, out);
+            Metrics::add(Counter::requests);
+            requested += n;
+            batchEnds.push_back(requested);
+        }
+
+        NodeId const file{files[received]};
+        channel.expect(Message::file, payload);
+        if (WireReader{payload}.u32() != remoteIds[file]) {
+            throw std::runtime_error{"unexpected file from remote"};
+        }
+        // Received next to it first, and only put in place once it is all
+        // there and is what was listed: a transfer cut short leaves the
+        // target as it was. A symlink there is replaced, not written
+        // through.
+        auto const target{base_dir_ / remote.relativePath(file)};
+        auto const tmp{temporary_path(target)};
+        std::uint64_t bytes{};
+        try {
+            {
+                std::ofstream ofile(tmp, std::ios::binary | std::ios::trunc);
+                if (!ofile) {
+                    throw std::runtime_error("can't open file " +
+                                             tmp.string());
+                }
+                for (;;) {
+                    auto const type{channel.next(payload)};
+                    if (type == Message::file_end) {
+                        break;
+                    }
+                    if (type != Message::data) {
+                        throw std::runtime_error{
+                            "unexpected message from remote"};
+                    }
+                    ofile.write(reinterpret_cast<char const *>(payload.data()),
+                                static_cast<std::streamsize>(payload.size()));
+                    bytes += payload.size();
+                }
+                if (!ofile.flush()) {
+                    throw std::runtime_error("can't write file " +
+                                             tmp.string());
+                }
+            }
+            if (bytes != remote.arena_[file].size ||
+                (remote.arena_[file].hasContent &&
+                 hash_file_content(tmp, bytes) !=
+                     remote.arena_.content(file))) {
+                throw std::runtime_error{std::format(
+                    "{} came from remote other than listed, it may have "
+                    "changed since",
+                    remote.relativePath(file).string())};
+            }
+            fs::last_write_time(tmp,
+                                fs::file_time_type{fs::file_time_type::duration{
+                                    remote.arena_[file].mtime}});
+            fs::rename(tmp, target);
+        }
+        catch (...) {
+            std::error_code ec;
+            fs::remove(tmp, ec);
+            throw;
+        }
+        written += bytes;
+        Metrics::add(Counter::bytes_copied, bytes);
+        Metrics::add(Counter::files_copied);
+
+        if (received + 1 == batchEnds.front()) {
+            batchEnds.pop_front();
+        }
+    }
+    channel.send(Message::done);
+    channel.flush();
+
+    syncTree(remote, remote.root_, root_);
+    return written;
+}
+
+template <typename HashPolicy>
+BasicMerkleTree<HashPolicy>
+BasicMerkleTree<HashPolicy>::empty(std::string const &dir_path,
+                                   BuildOptions const &options)
+{
+    BasicMerkleTree mt;
+    mt.base_dir_ = std::filesystem::absolute(dir_path);
+    mt.hash_mode_ = options.hash_mode;
+    if (options.filter != nullptr) {
+        mt.filter_ = *options.filter;
+    }
+    if (mt.hash_mode_ == HashMode::content) {
+        mt.arena_.keep_contents();
+    }
+    mt.root_ = mt.arena_.alloc(1);
+    mt.arena_[mt.root_].type = FileType::directory;
+    mt.rehashFolder(mt.root_);
+    return mt;
+}
+
+template <typename HashPolicy>
+BasicMerkleTree<HashPolicy>::BasicMerkleTree(std::string dir_path,
+                                             BuildOptions const &options)
+    : hash_mode_(options.hash_mode),
+      filter_(options.filter != nullptr ? *options.filter : PathFilter{})
 {
     namespace fs = std::filesystem;
 
@@ -57,96 +873,719 @@ MerkleTree::MerkleTree(std::string dir_path)
         throw std::runtime_error{
             std::format("path {} isn't a directory", dir_path)};
     }
-    base_dir_ = std::move(dir_path);
-    root_ = buildTree(base_dir_); // 递归建树
+    base_dir_ = fs::absolute(dir_path);
+    if (hash_mode_ == HashMode::content) {
+        arena_.keep_contents();
+    }
+
+    PhaseTimer const timer{Phase::scan};
+    ScanContext ctx;
+    // Only content digests are taken from the reference, and only from one
+    // of this very directory: another directory's file of the same size and
+    // mtime may well hold other bytes. It's walked along with the scan, from
+    // all scanning threads, so it's loaded up front.
+    std::error_code ec;
+    if (hash_mode_ == HashMode::content && options.reference != nullptr &&
+        fs::equivalent(options.reference->base_dir_, base_dir_, ec)) {
+        ctx.reference = options.reference;
+        ctx.reference->loadAll();
+    }
+    ctx.cache = options.cache;
+    NodeId const ref{ctx.reference ? ctx.reference->root_ : nil};
+    DirectoryHandle dir{base_dir_};
+    auto const id{ctx.cache != nullptr ? dir.identity() : std::nullopt};
+    if (options.jobs > 1) {
+        ThreadPool pool{options.jobs};
+        ctx.pool = &pool;
+        root_ = layout(buildTree(base_dir_, std::move(dir), id, ctx,
+                                 ref)); // 并行建树
+    }
+    else {
+        root_ = layout(buildTree(base_dir_, std::move(dir), id, ctx,
+                                 ref)); // 递归建树
+    }
 }
 
-void MerkleTree::syncFile(FileNode *A, FileNode *B,
-                          std::filesystem::path const &rootA,
-                          std::filesystem::path const &rootB)
+template <typename HashPolicy>
+bool BasicMerkleTree<HashPolicy>::mergeChildren(
+    BasicMerkleTree const &src, NodeId A, NodeId B, std::vector<Slot> &merged,
+    std::vector<NodeId> &removed) const
 {
-    namespace fs = std::filesystem;
+    src.load(A);
+    load(B);
+    auto const &a{src.arena_};
+    bool added{false};
 
-    // 要传递根目录的绝对路径，不然无法定位文件
-    // Should be fixed here: logic error
-    if (!A || !B || !A->isFolder() || !B->isFolder()) {
+    NodeId const aEnd{a[A].firstChild + a[A].childCount};
+    NodeId const bEnd{arena_[B].firstChild + arena_[B].childCount};
+    NodeId i{a[A].firstChild};
+    NodeId j{arena_[B].firstChild};
+    merged.reserve(a[A].childCount);
+    while (i != aEnd || j != bEnd) {
+        int const cmp{i == aEnd   ? 1
+                      : j == bEnd ? -1
+                                  : src.name(i).compare(name(j))};
+        if (cmp > 0) { // B有A没有
+            removed.push_back(j++);
+        }
+        else if (cmp < 0) { // A有B没有
+            merged.push_back({nil, i++});
+            added = true;
+        }
+        else {
+            // Same name, another file type: replace it.
+            if (a[i].isFolder() != arena_[j].isFolder()) {
+                removed.push_back(j);
+                merged.push_back({nil, i});
+                added = true;
+            }
+            else {
+                merged.push_back({j, i});
+            }
+            ++i;
+            ++j;
+        }
+    }
+    return added;
+}
+
+template <typename HashPolicy>
+uint64_t BasicMerkleTree<HashPolicy>::subtreeBytes(NodeId node) const
+{
+    load(node);
+    if (!arena_[node].isFolder()) {
+        return arena_[node].size;
+    }
+    // By value: loading the children below may move the arena.
+    auto const first{arena_[node].firstChild};
+    auto const n{arena_[node].childCount};
+    uint64_t bytes{};
+    for (NodeId c{first}; c != first + n; ++c) {
+        bytes += subtreeBytes(c);
+    }
+    return bytes;
+}
+
+template <typename HashPolicy>
+void BasicMerkleTree<HashPolicy>::planCreate(
+    NodeId a, std::filesystem::path const &path, SyncPlan &plan) const
+{
+    load(a);
+    if (!arena_[a].isFolder()) {
+        auto const size{arena_[a].size};
+        plan.creates.push_back({path, false, size});
+        plan.create_bytes += size;
+        return;
+    }
+    plan.creates.push_back({path, true, 0});
+    // By value: loading the children below may move the arena.
+    auto const first{arena_[a].firstChild};
+    auto const n{arena_[a].childCount};
+    for (NodeId c{first}; c != first + n; ++c) {
+        planCreate(c, path / name(c), plan);
+    }
+}
+
+template <typename HashPolicy>
+void BasicMerkleTree<HashPolicy>::planSync(BasicMerkleTree const &src,
+                                           NodeId A, NodeId B,
+                                           std::filesystem::path const &path,
+                                           SyncPlan &plan,
+                                           ThreadPool *pool) const
+{
+    auto const &a{src.arena_};
+
+    if (A == nil || B == nil || !a[A].isFolder() || !arena_[B].isFolder()) {
         throw std::runtime_error("node error(use error)");
     }
 
-    // B有A没有
-    FileNode *currentB = B->firstChild;
-    while (currentB) {
-        auto b_next{currentB->next};
-        FileNode *correspondingA = findFile(A, currentB->filepath);
-        if (!correspondingA) {
-            // A 中不存在，删除B中结点对应的文件或文件夹
-            fs::path targetPath = rootB / currentB->filepath;
-            if (currentB->isFolder()) {
-                fs::remove_all(targetPath); // 删除文件夹
+    // Equal hashes, equal subtrees.
+    if (!isDiff(src, B, A)) {
+        Metrics::add(Counter::subtrees_pruned);
+        return;
+    }
+
+    std::vector<Slot> merged;
+    std::vector<NodeId> removed;
+    mergeChildren(src, A, B, merged, removed);
+    Metrics::add(Counter::nodes_visited, merged.size() + removed.size());
+
+    for (NodeId const r : removed) {
+        // A 中不存在，删除B中结点对应的文件或文件夹
+        auto const bytes{subtreeBytes(r)};
+        plan.deletes.push_back({path / name(r), arena_[r].isFolder(), bytes});
+        plan.delete_bytes += bytes;
+    }
+
+    // Large subfolders that differ go to tasks first; their plans are
+    // appended when their turn comes below.
+    auto isLarge{[&](Slot const &slot) {
+        return pool != nullptr && slot.b != nil && a[slot.a].isFolder() &&
+               arena_[slot.b].isFolder() && isDiff(src, slot.b, slot.a) &&
+               a[slot.a].childNum + arena_[slot.b].childNum >=
+                   parallel_plan_files;
+    }};
+    std::vector<SyncPlan> parts;
+    std::optional<TaskGroup> group;
+    if (pool != nullptr) {
+        parts.resize(static_cast<std::size_t>(
+            std::ranges::count_if(merged, isLarge)));
+        auto next{parts.begin()};
+        for (auto const &slot : merged) {
+            if (isLarge(slot)) {
+                if (!group) {
+                    group.emplace(*pool);
+                }
+                group->run([this, &src, slot, &path, &out = *next++, pool] {
+                    planSync(src, slot.a, slot.b, path / src.name(slot.a),
+                             out, pool);
+                });
+            }
+        }
+        if (group) {
+            group->wait();
+        }
+    }
+
+    auto part{parts.begin()};
+    for (auto const &slot : merged) {
+        if (slot.b == nil) {
+            // B 中不存在，拷贝 A 的文件或文件夹到 B
+            src.planCreate(slot.a, path / src.name(slot.a), plan);
+        }
+        else if (isLarge(slot)) {
+            appendPlan(plan, std::move(*part++));
+        }
+        else if (isDiff(src, slot.b, slot.a)) {
+            if (a[slot.a].isFolder()) {
+                planSync(src, slot.a, slot.b, path / src.name(slot.a), plan,
+                         pool); // 递归处理子目录
             }
             else {
-                fs::remove(targetPath); // 删除文件
+                // 哈希值不同，覆盖更新 B 的文件
+                plan.modifies.push_back({path / src.name(slot.a), false,
+                                         a[slot.a].size});
+                plan.modify_bytes += a[slot.a].size;
             }
-            deleteNode(B, currentB->filepath); // 删除哈希树中对应节点
         }
-        currentB = b_next;
+        else if (a[slot.a].isFolder()) {
+            Metrics::add(Counter::subtrees_pruned);
+        }
     }
+}
 
-    // A有B没有
-    FileNode *currentA = A->firstChild;
-    while (currentA) {
-        FileNode *correspondingB = findFile(B, currentA->filepath);
-        if (!correspondingB) {
-            // B 中不存在，拷贝 A 的文件或文件夹到 B
-            auto sourcePath = rootA / currentA->filepath;
-            auto targetPath = rootB / currentA->filepath;
-            errorln("Didn't find corresponding file in B, syncing to target "
-                    "\"{}\"...",
-                    targetPath.string());
+template <typename HashPolicy>
+void BasicMerkleTree<HashPolicy>::planMoves(BasicMerkleTree const &src,
+                                            SyncPlan &plan) const
+{
+    namespace fs = std::filesystem;
 
-            if (currentA->isFolder()) {
-                fs::copy(sourcePath, targetPath,
-                         fs::copy_options::recursive |
-                             fs::copy_options::overwrite_existing);
+    if (hash_mode_ != HashMode::content) {
+        return;
+    }
+
+    // Files whose content goes away: deleted ones, including those in
+    // deleted folders, and the old versions of modified ones. Empty files
+    // aren't worth a move.
+    struct Source {
+        fs::path path;
+        uint64_t size;
+        bool taken;
+    };
+    std::map<Digest, std::vector<Source>> sources;
+    auto addSource{[&](NodeId b, fs::path const &path) {
+        if (b == nil) {
+            return;
+        }
+        auto const &n{arena_[b]};
+        if (n.type == FileType::regular && n.hasContent && n.size != 0) {
+            sources[arena_.content(b)].push_back({path, n.size, false});
+        }
+    }};
+    for (auto const &e : plan.deletes) {
+        std::vector<std::pair<NodeId, fs::path>> pending{
+            {findPath(e.path), e.path}};
+        while (!pending.empty()) {
+            auto [b, path] = std::move(pending.back());
+            pending.pop_back();
+            if (b == nil || !arena_[b].isFolder()) {
+                addSource(b, path);
+                continue;
             }
-            else {
-                fs::copy(sourcePath, targetPath,
-                         fs::copy_options::overwrite_existing); // 复制文件
+            load(b);
+            auto const &dir{arena_[b]};
+            for (NodeId c{dir.firstChild};
+                 c != dir.firstChild + dir.childCount; ++c) {
+                pending.emplace_back(c, path / name(c));
+            }
+        }
+    }
+    for (auto const &e : plan.modifies) {
+        addSource(findPath(e.path), e.path);
+    }
+    if (sources.empty()) {
+        return;
+    }
+
+    // Where each content was moved to first, later files copy it from
+    // there.
+    std::map<Digest, fs::path> placed;
+    auto tryMove{[&](SyncPlan::Entry const &e) {
+        NodeId const a{src.findPath(e.path)};
+        if (a == nil || !src.arena_[a].hasContent || src.arena_[a].size == 0) {
+            return false;
+        }
+        auto const &n{src.arena_[a]};
+        auto const &content{src.arena_.content(a)};
+        SyncPlan::Move move;
+        move.to = e.path;
+        move.bytes = n.size;
+        move.mtime = n.mtime;
+        if (auto it{sources.find(content)}; it != sources.end()) {
+            auto s{std::ranges::find_if(it->second, [&n](Source const &s) {
+                return !s.taken && s.size == n.size;
+            })};
+            if (s != it->second.end()) {
+                s->taken = true;
+                move.from = s->path;
+                placed.emplace(content, e.path);
+            }
+        }
+        if (move.from.empty()) {
+            auto const it{placed.find(content)};
+            if (it == placed.end()) {
+                return false;
+            }
+            move.from = it->second;
+            move.copy = true;
+        }
+        plan.moves.push_back(std::move(move));
+        plan.move_bytes += n.size;
+        return true;
+    }};
+
+    std::vector<SyncPlan::Entry> kept;
+    for (auto &e : plan.creates) {
+        if (!e.folder && tryMove(e)) {
+            plan.create_bytes -= e.bytes;
+        }
+        else {
+            kept.push_back(std::move(e));
+        }
+    }
+    plan.creates = std::move(kept);
+    kept.clear();
+    for (auto &e : plan.modifies) {
+        if (tryMove(e)) {
+            plan.modify_bytes -= e.bytes;
+        }
+        else {
+            kept.push_back(std::move(e));
+        }
+    }
+    plan.modifies = std::move(kept);
+}
+
+template <typename HashPolicy>
+void BasicMerkleTree<HashPolicy>::reconcile(BasicMerkleTree const &src,
+                                            NodeId A, NodeId B)
+{
+    auto const &a{src.arena_};
+
+    // 要传递根目录的绝对路径，不然无法定位文件
+    if (A == nil || B == nil || !a[A].isFolder() || !arena_[B].isFolder()) {
+        throw std::runtime_error("node error(use error)");
+    }
+
+    // Equal hashes, equal subtrees.
+    if (!isDiff(src, B, A)) {
+        return;
+    }
+
+    std::vector<Slot> merged;
+    std::vector<NodeId> removed;
+    bool const added{mergeChildren(src, A, B, merged, removed)};
+
+    // Lays out B's new child block in one go.
+    if (added || !removed.empty()) {
+        for (NodeId const r : removed) {
+            freeSubtree(r);
+        }
+        NodeId const bFirst{arena_[B].firstChild};
+        NodeId const bCount{arena_[B].childCount};
+        auto const n{static_cast<uint32_t>(merged.size())};
+        NodeId const first{arena_.alloc(n)};
+        for (uint32_t k{}; k != n; ++k) {
+            auto &slot{merged[k]};
+            if (slot.b != nil) {
+                moveNode(slot.b, first + k);
+                slot.b = first + k;
+                continue;
             }
-            FileNode *newNode = new FileNode(currentA->hashString);
-            newNode->filepath = currentA->filepath;
-            addNode(newNode, B);
+            copyNode(src, slot.a, first + k);
+            cloneChildren(src, slot.a, first + k); // Equal by construction
         }
-        currentA = currentA->next;
+        for (uint32_t k{}; k != n; ++k) {
+            arena_[first + k].parent = B;
+        }
+        arena_.free(bFirst, bCount);
+        arena_[B].firstChild = n != 0 ? first : nil;
+        arena_[B].childCount = n;
     }
 
     // 同时遍历 A 和 B，检查哈希值不同的节点并更新
-    currentA = A->firstChild;
-    currentB = B->firstChild;
-    while (currentA != nullptr) {
-        assert(currentB != nullptr);
-        errorln("a.path: {}, b.path: {}", currentA->filepath.string(),
-                currentB->filepath.string());
-        assert(currentA->filepath == currentB->filepath);
-        // TODO(shelpam): didn't consider file type diff: directory or regular
-        // file?
-        if (currentA->isDiff(currentB)) {
-            // 哈希值不同，覆盖更新 B 的文件
-            auto sourcePath = rootA / currentA->filepath;
-            auto targetPath = rootB / currentB->filepath;
-            fs::copy(sourcePath, targetPath,
-                     fs::copy_options::overwrite_existing); // 覆盖更新
-            std::string time = std::to_string(
-                fs::last_write_time(sourcePath).time_since_epoch().count());
-            changeHash(currentB, time,
-                       currentB->filepath); // 更新 B 的哈希值
-        }
-        // 递归处理子目录
-        assert(currentA->isFolder() == currentB->isFolder());
-        if (currentA->isFolder()) {
-            syncFile(currentA, currentB, rootA, rootB);
-        }
-        currentA = currentA->next;
-        currentB = currentB->next;
-    }
-}
\ No newline at end of file
+    for (auto const &slot : merged) {
+        if (slot.b == nil || !isDiff(src, slot.b, slot.a)) {
+            continue;
+        }
+        if (log_level.load(std::memory_order_relaxed) >= LogLevel::debug) {
+            debugln("a.path: {}, b.path: {}",
+                    src.relativePath(slot.a).string(),
+                    relativePath(slot.b).string());
+        }
+        assert(src.name(slot.a) == name(slot.b));
+        if (a[slot.a].isFolder()) {
+            // 递归处理子目录
+            reconcile(src, slot.a, slot.b);
+        }
+        else {
+            assignLeaf(slot.b, src, slot.a); // 更新 B 的哈希值
+        }
+    }
+
+    // Children are final, B gets rehashed once, after its subfolders.
+    markDirty(B);
+}
+
+template <typename HashPolicy>
+void BasicMerkleTree<HashPolicy>::writeTree(std::string const &filepath) const
+{
+    PhaseTimer const timer{Phase::serialize};
+
+    // Renumbers the nodes breadth first: children of the node at `order[i]`
+    // get the next free ids, which keeps every sibling block contiguous.
+    std::vector<NodeId> order{root_};
+    std::vector<uint32_t> parents{snapshot_no_node};
+    order.reserve(arena_.size());
+    parents.reserve(arena_.size());
+
+    std::vector<SnapshotNode> nodes;
+    std::vector<Digest> hashes;
+    std::vector<Digest> contents;
+    std::string strings;
+    std::string const rootName{base_dir_.string()};
+    nodes.reserve(arena_.size());
+    hashes.reserve(arena_.size());
+
+    for (std::size_t i{}; i != order.size(); ++i) {
+        load(order[i]);
+        auto const &node{arena_[order[i]]};
+        auto const nodeName{i == 0 ? std::string_view{rootName}
+                                   : name(order[i])};
+
+        auto record{snapshotRecord(node, parents[i])};
+        if (node.childCount != 0) {
+            record.first_child = static_cast<uint32_t>(order.size());
+        }
+        record.child_count = node.childCount;
+        record.name_offset = static_cast<uint32_t>(strings.size());
+        record.name_length = static_cast<uint32_t>(nodeName.size());
+        nodes.push_back(record);
+        hashes.push_back(arena_.hash(order[i]));
+        if (hash_mode_ == HashMode::content) {
+            contents.push_back(arena_.content(order[i]));
+        }
+        strings += nodeName;
+
+        for (NodeId c{node.firstChild}; c != node.firstChild + node.childCount;
+             ++c) {
+            order.push_back(c);
+            parents.push_back(static_cast<uint32_t>(i));
+        }
+    }
+    if (strings.size() > std::numeric_limits<uint32_t>::max()) {
+        throw std::runtime_error{"tree too large for the snapshot format"};
+    }
+
+    std::vector<unsigned char> body;
+    auto append{[&body](auto const &v) {
+        auto const *p{reinterpret_cast<unsigned char const *>(v.data())};
+        body.insert(body.end(), p, p + v.size() * sizeof(v[0]));
+    }};
+    append(nodes);
+    append(hashes);
+    append(contents);
+    append(strings);
+    append(filter_.rules());
+
+    SnapshotHeader header{};
+    header.magic = snapshot_magic;
+    header.version = snapshot_version;
+    header.byte_order = snapshot_byte_order;
+    header.flags =
+        hash_mode_ == HashMode::content ? SnapshotHeader::content_hashes : 0U;
+    header.root = 0;
+    header.node_count = nodes.size();
+    header.string_bytes = strings.size();
+    header.checksum = xxh64(body);
+    header.hash_algorithm = HashPolicy::id;
+    header.filter_bytes = filter_.rules().size();
+
+    std::ofstream ofile(filepath, std::ios::binary | std::ios::trunc);
+    if (!ofile) {
+        throw std::runtime_error("can't open file " + filepath);
+    }
+    ofile.write(reinterpret_cast<char const *>(&header), sizeof(header));
+    ofile.write(reinterpret_cast<char const *>(body.data()),
+                static_cast<std::streamsize>(body.size()));
+    if (!ofile.flush()) {
+        throw std::runtime_error("can't write file " + filepath);
+    }
+}
+
+template <typename HashPolicy>
+typename BasicMerkleTree<HashPolicy>::ScannedNode
+BasicMerkleTree<HashPolicy>::streamTree(std::filesystem::path const &p,
+                                        DirectoryHandle dir,
+                                        std::optional<FileIdentity> const &id,
+                                        ScanContext const &ctx, uint32_t slot,
+                                        SnapshotWriter &out) const
+{
+    namespace fs = std::filesystem;
+
+    auto const prefix{p == base_dir_ ? fs::path{} : p};
+    auto const entries{listDirectory(dir, prefix, id, ctx)};
+    auto const n{static_cast<uint32_t>(entries.size())};
+    // Reserved before the subdirectories are scanned, so that the block
+    // comes after this directory's slot and before theirs.
+    auto const first{out.reserve(n)};
+
+    std::vector<ScannedNode> sons(n);
+    {
+        std::optional<TaskGroup> group;
+        if (ctx.pool != nullptr && hash_mode_ == HashMode::content) {
+            group.emplace(*ctx.pool);
+        }
+        for (uint32_t k{}; k != n; ++k) {
+            auto path{prefix / entries[k].name};
+            auto const st{statEntry(dir, entries[k], ctx)};
+            if (st.directory) {
+                DirectoryHandle sub{dir, entries[k].name,
+                                    st.type == FileType::symlink};
+                sons[k] = streamTree(path, std::move(sub), st.identity, ctx,
+                                     first + k, out);
+            }
+            else if (group) {
+                group->run([this, &sons, path{std::move(path)}, &ctx, k, st] {
+                    sons[k] = makeLeaf(path, ctx, nil, st);
+                });
+            }
+            else {
+                sons[k] = makeLeaf(path, ctx, nil, st);
+            }
+        }
+        if (group) {
+            group->wait();
+        }
+    }
+    hashLeaves(sons, ctx);
+
+    std::vector<SnapshotNode> records;
+    std::vector<std::string> names;
+    std::vector<Digest> hashes;
+    std::vector<Digest> contents;
+    records.reserve(n);
+    names.reserve(n);
+    hashes.reserve(n);
+    for (auto const &son : sons) {
+        auto record{snapshotRecord(son.node, slot)};
+        if (son.node.childCount != 0) {
+            record.first_child = son.node.firstChild;
+            record.child_count = son.node.childCount;
+        }
+        records.push_back(record);
+        names.push_back(son.path.filename().string());
+        hashes.push_back(son.hash);
+        if (hash_mode_ == HashMode::content) {
+            contents.push_back(son.content);
+        }
+    }
+    out.write(first, records, names, hashes, contents);
+
+    ScannedNode current;
+    current.path = p;
+    current.node.type = FileType::directory;
+    for (auto const &son : sons) {
+        current.node.childNum += son.node.isFolder() ? son.node.childNum : 1;
+    }
+    current.hash =
+        folderHash(prefix, sons | std::views::transform(&ScannedNode::hash));
+    if (n != 0) {
+        current.node.firstChild = first;
+        current.node.childCount = n;
+    }
+    return current;
+}
+
+template <typename HashPolicy>
+void BasicMerkleTree<HashPolicy>::save_directory(std::string const &dir_path,
+                                                 std::string const &filepath,
+                                                 BuildOptions const &options)
+{
+    namespace fs = std::filesystem;
+
+    if (!fs::is_directory(dir_path)) {
+        throw std::runtime_error{
+            std::format("path {} isn't a directory", dir_path)};
+    }
+    // Holds what the scan needs to know, its arena stays empty.
+    auto const scanner{empty(dir_path, options)};
+    auto const &base{scanner.base_dir_};
+    bool const contentMode{scanner.hash_mode_ == HashMode::content};
+
+    PhaseTimer const timer{Phase::scan};
+    ScanContext ctx;
+    ctx.cache = options.cache;
+    std::optional<ThreadPool> pool;
+    if (options.jobs > 1) {
+        pool.emplace(options.jobs);
+        ctx.pool = &*pool;
+    }
+
+    SnapshotWriter out{filepath, contentMode, HashPolicy::id,
+                       scanner.filter_.rules()};
+    auto const slot{out.reserve(1)};
+    DirectoryHandle dir{base};
+    auto const id{ctx.cache != nullptr ? dir.identity() : std::nullopt};
+    auto root{scanner.streamTree(base, std::move(dir), id, ctx, slot, out)};
+
+    auto record{snapshotRecord(root.node, snapshot_no_node)};
+    if (root.node.childCount != 0) {
+        record.first_child = root.node.firstChild;
+        record.child_count = root.node.childCount;
+    }
+    std::string const rootName{base.string()};
+    out.write(slot, {&record, 1}, {&rootName, 1}, {&root.hash, 1},
+              contentMode ? std::span<Digest const>{&root.content, 1}
+                          : std::span<Digest const>{});
+    out.finish();
+}
+
+template <typename HashPolicy>
+void BasicMerkleTree<HashPolicy>::materialize(NodeId id, uint32_t index,
+                                              NodeId parent) const
+{
+    auto const records{snapshot_->nodes()};
+    auto const &record{records[index]};
+    // Children come after their parent, so following them can't loop.
+    if (record.child_count != 0 &&
+        (record.first_child <= index ||
+         uint64_t{record.first_child} + record.child_count > records.size())) {
+        throw std::runtime_error{"corrupt snapshot node table"};
+    }
+
+    auto &node{arena_[id]};
+    node.parent = parent;
+    node.firstChild = nil;
+    node.childCount = 0;
+    node.childNum = static_cast<uint32_t>(record.child_num);
+    node.size = record.size;
+    node.mtime = record.mtime;
+    auto const type{(record.flags & SnapshotNode::type_mask) >>
+                    SnapshotNode::type_shift};
+    node.type = (record.flags & SnapshotNode::folder) != 0
+                    ? FileType::directory
+                : type <= static_cast<uint32_t>(FileType::other)
+                    ? static_cast<FileType>(type)
+                    : FileType::unknown;
+    node.hasContent = (record.flags & SnapshotNode::has_content) != 0;
+    node.name = parent == nil ? NamePool::empty
+                              : names_.intern(snapshot_->name(record));
+    node.unloaded = node.isFolder() && record.child_count != 0;
+    if (node.unloaded) {
+        unloaded_.emplace(id, index);
+    }
+    arena_.hash(id) = snapshot_->hashes()[index];
+    if (!snapshot_->contents().empty()) {
+        arena_.content(id) = snapshot_->contents()[index];
+    }
+}
+
+template <typename HashPolicy>
+void BasicMerkleTree<HashPolicy>::loadChildren(NodeId folder) const
+{
+    PhaseTimer const timer{Phase::load};
+
+    auto const it{unloaded_.find(folder)};
+    assert(it != unloaded_.end());
+    auto const index{it->second};
+    unloaded_.erase(it);
+    arena_[folder].unloaded = false;
+
+    auto const &record{snapshot_->nodes()[index]};
+    auto const n{record.child_count};
+    NodeId const first{arena_.alloc(n)};
+    for (uint32_t k{}; k != n; ++k) {
+        if (snapshot_->nodes()[record.first_child + k].parent != index) {
+            throw std::runtime_error{"corrupt snapshot node table"};
+        }
+        materialize(first + k, record.first_child + k, folder);
+    }
+    arena_[folder].firstChild = first;
+    arena_[folder].childCount = n;
+    Metrics::add(Counter::nodes_loaded, n);
+}
+
+template <typename HashPolicy>
+void BasicMerkleTree<HashPolicy>::loadAll() const
+{
+    if (unloaded_.empty()) {
+        return;
+    }
+    std::vector<NodeId> pending{root_};
+    while (!pending.empty()) {
+        auto const folder{pending.back()};
+        pending.pop_back();
+        load(folder);
+        auto const &dir{arena_[folder]};
+        for (NodeId c{dir.firstChild}; c != dir.firstChild + dir.childCount;
+             ++c) {
+            if (arena_[c].isFolder()) {
+                pending.push_back(c);
+            }
+        }
+    }
+}
+
+template <typename HashPolicy>
+void BasicMerkleTree<HashPolicy>::rebuildTree(
+    std::shared_ptr<SnapshotView const> snapshot)
+{
+    assert(root_ == nil);
+
+    auto const &header{snapshot->header()};
+    if (header.root != 0) {
+        throw std::runtime_error{"snapshot root must be the first node"};
+    }
+    if (header.hash_algorithm != HashPolicy::id) {
+        throw std::runtime_error{
+            "snapshot was written with another hash algorithm"};
+    }
+    hash_mode_ = (header.flags & SnapshotHeader::content_hashes) != 0
+                     ? HashMode::content
+                     : HashMode::mtime;
+    if (!snapshot->contents().empty()) {
+        arena_.keep_contents();
+    }
+    base_dir_ = snapshot->name(snapshot->nodes()[0]);
+    filter_ = PathFilter{snapshot->filter()};
+    snapshot_ = std::move(snapshot);
+
+    root_ = arena_.alloc(1);
+    materialize(root_, 0, nil);
+    Metrics::add(Counter::nodes_loaded);
+    load(root_);
+}
+
+template class BasicMerkleTree<Sha256Policy>;
+template class BasicMerkleTree<Xxh64x4Policy>;
@@ -1,409 +1,911 @@
 #pragma once
 
+#include <libtree/chunk_store.hpp>
+#include <libtree/directory.hpp>
+#include <libtree/filter.hpp>
+#include <libtree/hash.hpp>
+#include <libtree/hash_cache.hpp>
+#include <libtree/metrics.hpp>
+#include <libtree/name_pool.hpp>
+#include <libtree/node_arena.hpp>
 #include <libtree/print.hpp>
-
-#include <boost/archive/text_iarchive.hpp>
-#include <boost/archive/text_oarchive.hpp>
-#include <openssl/sha.h>
+#include <libtree/remote.hpp>
+#include <libtree/snapshot.hpp>
+#include <libtree/sync_plan.hpp>
+#include <libtree/thread_pool.hpp>
 
 #include <algorithm>
 #include <array>
 #include <cassert>
+#include <cstdint>
 #include <cstring>
 #include <filesystem>
 #include <fstream>
 #include <iostream>
+#include <limits>
+#include <map>
+#include <memory>
+#include <optional>
 #include <print>
 #include <queue>
-#include <sstream>
+#include <ranges>
+#include <span>
+#include <stdexcept>
 #include <string>
+#include <type_traits>
 #include <unordered_map>
 #include <utility>
 #include <vector>
 
-namespace boost::serialization {
-
-// Specialization for std::filesystem::path
-template <typename Archive>
-void serialize(Archive &ar, std::filesystem::path &p,
-               unsigned int const version)
-{
-    if constexpr (Archive::is_saving::value) {
-        ar & p.string();
-    }
-    else {
-        std::string buf;
-        ar & buf;
-        p = buf;
-    }
-}
-
-} // namespace boost::serialization
-
-class MerkleTree {
-  private:
-    struct FileNode {
+// What a file's leaf hash is derived from.
+enum class HashMode {
+    mtime,   // Last write time and path: cheap, but blind to same-mtime edits
+    content, // File bytes and path: only re-read when (size, mtime) changed
+};
 
-        std::string hashString;
-        std::filesystem::path filepath; // Relative path
-        std::array<unsigned char, 32> hash;
-        FileNode *parent = nullptr;
-        FileNode *firstChild = nullptr;
-        FileNode *next = nullptr;
-        uint64_t childNum = 0;
+template <typename HashPolicy> class BasicMerkleTree;
 
-        bool isFolder();
+// Knobs for building a tree from a directory.
+template <typename HashPolicy> struct BasicBuildOptions {
+    // Number of scanning threads. 1 scans serially on the calling thread,
+    // anything greater scans subdirectories as work-stealing tasks.
+    std::size_t jobs{1};
 
-        bool isDiff(FileNode const *other);
+    HashMode hash_mode{HashMode::mtime};
 
-        FileNode(std::string const &time, std::filesystem::path const &path);
+    // An earlier scan or snapshot of the same directory (e.g. its last
+    // backup). In content mode, a file whose size and mtime equal those of
+    // the node at the same relative path reuses that node's content digest
+    // instead of being read again. A tree of any other directory is
+    // ignored: equal sizes and mtimes say nothing about the bytes of two
+    // different files.
+    BasicMerkleTree<HashPolicy> const *reference{nullptr};
 
-        FileNode(std::string s);
+    // Hashes and directory listings from earlier scans. Unchanged files
+    // aren't stat'ed again or rehashed, unchanged directories aren't listed
+    // again. What this scan saw is recorded into it.
+    HashCache *cache{nullptr};
 
-        FileNode(unsigned char *h);
+    // Entries it excludes aren't part of the tree: excluded directories are
+    // never opened. The tree keeps a copy, for refreshes and snapshots.
+    PathFilter const *filter{nullptr};
+};
 
-        FileNode(FileNode *other);
+// A Merkle tree over a directory. `HashPolicy` (hash.hpp) is the algorithm
+// of the leaf and folder hashes; content digests are always SHA-256.
+template <typename HashPolicy> class BasicMerkleTree {
+  private:
+    using BuildOptions = BasicBuildOptions<HashPolicy>;
+    using NodeId = std::uint32_t;
 
-        FileNode();
+    static constexpr NodeId nil{std::numeric_limits<NodeId>::max()};
 
-        // 序列化方法
-        template <class Archive>
-        void serialize(Archive &ar, unsigned int const version)
+    // Paths aren't stored: a node keeps its name, and its relative path is
+    // put together from the names up to the root when it's needed. The
+    // leaf or folder hash is in the arena, and so is the content digest, in
+    // content mode.
+    struct FileNode {
+        NamePool::Id name = NamePool::empty; // The root's is empty
+        NodeId parent = nil;
+        NodeId firstChild = nil; // 子结点连续存放于 [firstChild, +childCount)
+        uint32_t childCount = 0;
+        uint32_t childNum = 0; // Number of files in the subtree
+        bool hasContent = false; // The arena has its content digest
+        FileType type = FileType::unknown; // Symlinks aren't followed
+        bool dirty = false; // Folder hash and childNum are stale
+        // A folder whose children are still only in the snapshot: it has
+        // none in the arena until `load` brings them in.
+        bool unloaded = false;
+        uint64_t size = 0;
+        int64_t mtime = 0; // Last write time in file clock ticks
+
+        [[nodiscard]] bool isFolder() const
         {
-            // ar & hashString;
-            // ar & filepath;
-            // ar & childNum;
-            // ar &boost::serialization::make_array(hash.data(), hash.size());
-            // assert(firstChild);
-            // assert(next);
-            ar & firstChild;
-            ar & next;
+            return type == FileType::directory;
         }
     };
+    static_assert(sizeof(FileNode) == 40);
+
+    using Arena = NodeArena<FileNode, Digest>;
+    static_assert(std::is_same_v<typename Arena::Id, NodeId> &&
+                  Arena::nil == nil);
+
+    // A scanned subtree that hasn't been laid out in the arena yet. Scanning
+    // produces these so that parallel tasks never touch the shared arena or
+    // name pool.
+    struct ScannedNode {
+        FileNode node;
+        std::filesystem::path path; // Relative, the root's is base_dir_
+        Digest hash{};
+        Digest content{}; // If node.hasContent
+        std::vector<ScannedNode> children;
+        bool hashed = false; // Leaves are hashed per directory, in a batch
+        std::optional<FileIdentity> identity; // To record the leaf in a cache
+    };
+
+    struct ScanContext {
+        ThreadPool *pool = nullptr;
+        BasicMerkleTree const *reference = nullptr;
+        HashCache *cache = nullptr;
+    };
 
     std::filesystem::path base_dir_;
-    FileNode *root_ = nullptr;
+    // Mutable for `load`: bringing in nodes from the snapshot doesn't change
+    // what the tree is, so it happens behind const member functions too.
+    mutable Arena arena_;
+    mutable NamePool names_;
+    NodeId root_ = nil;
+    HashMode hash_mode_{HashMode::mtime};
+    PathFilter filter_; // What the tree was scanned with
 
-    MerkleTree() = default;
+    // The snapshot a tree read by `from_file` came from, and the record of
+    // each unloaded folder in it.
+    std::shared_ptr<SnapshotView const> snapshot_;
+    mutable std::unordered_map<NodeId, uint32_t> unloaded_;
 
-    MerkleTree(std::string dir_path);
+    BasicMerkleTree() = default;
 
-    FileNode *buildTree(std::filesystem::path const &p)
+    BasicMerkleTree(std::string dir_path, BuildOptions const &options);
+
+    static std::string leafInput(std::string const &stamp,
+                                 std::filesystem::path const &path)
     {
-        namespace fs = std::filesystem;
+        return stamp + '|' + path.string();
+    }
 
-        assert(fs::is_directory(p) || fs::is_directory(base_dir_ / p));
-        std::queue<FileNode *> total; // 按顺序构建
+    static Digest leafHash(std::string const &stamp,
+                           std::filesystem::path const &path)
+    {
+        std::string const hashString{leafInput(stamp, path)};
+        return HashPolicy::hash({reinterpret_cast<unsigned char const *>(
+                                     hashString.data()),
+                                 hashString.size()});
+    }
 
-        std::vector<fs::path> paths{};
-        for (auto const &i : fs::directory_iterator(base_dir_ / p)) {
-            paths.push_back(fs::relative(i, base_dir_)); // 相对路径
-        }
+    // What a file's leaf hash is derived from besides its path.
+    std::string leafStamp(ScannedNode const &leaf) const
+    {
+        return hash_mode_ == HashMode::content
+                   ? to_hex(leaf.content)
+                   : std::to_string(leaf.node.mtime);
+    }
 
-        // 维护一个相对稳定的顺序（使用迭代器遍历文件的顺序可能不一致）
-        std::ranges::sort(paths);
+    std::string_view name(NodeId id) const
+    {
+        return names_.view(arena_[id].name);
+    }
 
-        uint64_t cnt = 0;
-        for (auto const &i : paths) {
-            FileNode *son;
-            if (fs::is_directory(base_dir_ / i)) {
-                son = buildTree(i);
-                cnt += son->childNum;
-                son->filepath = i; // 相对路径
-            }
-            else {
-                // 最近修改时间
-                son = new FileNode(
-                    std::to_string(fs::last_write_time(base_dir_ / i)
-                                       .time_since_epoch()
-                                       .count()),
-                    i);
-                cnt++;
-            }
-            total.push(son);
+    // Path of `id` relative to the base directory, the root's is empty.
+    std::filesystem::path relativePath(NodeId id) const
+    {
+        std::vector<NodeId> chain;
+        for (; id != nil && arena_[id].parent != nil; id = arena_[id].parent) {
+            chain.push_back(id);
         }
+        std::filesystem::path path;
+        for (auto it{chain.rbegin()}; it != chain.rend(); ++it) {
+            path /= name(*it);
+        }
+        return path;
+    }
 
-        FileNode *firstChild = nullptr;
+    // 文件夹的哈希由其路径和所有子结点的哈希拼接而成. The root hashes as the
+    // empty path, so equal trees under different base directories have equal
+    // root hashes.
+    template <typename Hashes>
+    static Digest folderHash(std::filesystem::path const &p,
+                             Hashes const &hashes)
+    {
+        PhaseTimer const timer{Phase::hash};
+        Metrics::add(Counter::hash_calls);
         std::string node_str{p.string()};
+        for (Digest const &h : hashes) {
+            node_str += std::string_view(
+                reinterpret_cast<char const *>(h.data()), h.size());
+        }
+        return HashPolicy::hash({reinterpret_cast<unsigned char const *>(
+                                     node_str.data()),
+                                 node_str.size()});
+    }
 
-        while (!total.empty()) {
-            FileNode *curr = total.front();
-            total.pop();
-            if (firstChild == nullptr)
-                firstChild = curr;
+    bool isDiff(BasicMerkleTree const &other, NodeId mine, NodeId theirs) const
+    {
+        return arena_.hash(mine) != other.arena_.hash(theirs);
+    }
 
-            curr->next = (total.empty()) ? nullptr : total.front();
-            node_str += std::string_view(
-                reinterpret_cast<char *>(curr->hash.data()), curr->hash.size());
+    // Creates the leaf for the file at `relative`, without its hash unless
+    // the cache had it. `ref` is the node at the same path in the reference
+    // tree, if any, `st` what the scan stat'ed of the file.
+    ScannedNode makeLeaf(std::filesystem::path const &relative,
+                         ScanContext const &ctx, NodeId ref,
+                         FileStat const &st) const;
+
+    // Stats `entry` of `dir`, unless the listing already said it's a
+    // directory and the scan needs nothing else of it.
+    static FileStat statEntry(DirectoryHandle const &dir, DirEntry const &entry,
+                              ScanContext const &ctx)
+    {
+        if (entry.type == FileType::directory && ctx.cache == nullptr) {
+            FileStat st;
+            st.type = FileType::directory;
+            st.directory = true;
+            return st;
         }
+        return dir.stat(entry.name);
+    }
 
-        FileNode *current = new FileNode(node_str);
-        current->filepath = p;
-        current->firstChild = firstChild;
-        current->childNum = cnt;
+    // Hashes the leaves among `nodes` that aren't yet, in one batch, and
+    // records them into the cache.
+    void hashLeaves(std::span<ScannedNode> nodes, ScanContext const &ctx) const;
+
+    // Entries of directory `dir`, at `relative`, that the filter doesn't
+    // exclude, sorted by name. `id` is the directory's identity if the scan
+    // uses a cache.
+    std::vector<DirEntry> listDirectory(DirectoryHandle &dir,
+                                        std::filesystem::path const &relative,
+                                        std::optional<FileIdentity> const &id,
+                                        ScanContext const &ctx) const;
+
+    // Scans the subtree rooted at `p`, open as `dir`. When the context has
+    // a pool, child directories are scanned as tasks on it; children are
+    // still kept in sorted order, so the resulting hashes equal those of a
+    // serial build. `id` is the directory's identity if the scan uses a
+    // cache, `ref` the directory at the same path in the reference tree.
+    ScannedNode buildTree(std::filesystem::path const &p, DirectoryHandle dir,
+                          std::optional<FileIdentity> const &id,
+                          ScanContext const &ctx, NodeId ref = nil) const
+    {
+        namespace fs = std::filesystem;
 
-        while (firstChild != nullptr) {
-            firstChild->parent = current;
-            firstChild = firstChild->next;
+        // Children of the root are relative to it, not below it.
+        auto const prefix{p == base_dir_ ? fs::path{} : p};
+        auto const entries{listDirectory(dir, prefix, id, ctx)};
+        std::vector<fs::path> paths;
+        paths.reserve(entries.size());
+        for (auto const &entry : entries) {
+            paths.push_back(prefix / entry.name);
         }
 
+        std::vector<ScannedNode> sons(paths.size());
+        {
+            std::optional<TaskGroup> group;
+            if (ctx.pool != nullptr) {
+                group.emplace(*ctx.pool);
+            }
+
+            // Both child lists are sorted, so the reference children are
+            // matched up with a single forward walk.
+            NodeId refChild{nil};
+            NodeId refEnd{nil};
+            if (ref != nil) {
+                auto const &r{ctx.reference->arena_[ref]};
+                refChild = r.firstChild;
+                refEnd = r.firstChild + r.childCount;
+            }
+            for (std::size_t k{}; k != paths.size(); ++k) {
+                auto const &i{paths[k]};
+                auto const &name{entries[k].name};
+                while (refChild != refEnd &&
+                       ctx.reference->name(refChild) < name) {
+                    ++refChild;
+                }
+                NodeId const match{
+                    refChild != refEnd && ctx.reference->name(refChild) == name
+                        ? refChild
+                        : nil};
+
+                // Symlinks to directories are scanned as directories,
+                // unless they loop.
+                auto const st{statEntry(dir, entries[k], ctx)};
+                bool const link{st.type == FileType::symlink};
+
+                if (st.directory) {
+                    if (group) {
+                        group->run([this, &sons, &i, &dir, &name, &ctx, k,
+                                    match, link, id{st.identity}] {
+                            sons[k] =
+                                buildTree(i, DirectoryHandle{dir, name, link},
+                                          id, ctx, match);
+                        });
+                    }
+                    else {
+                        sons[k] = buildTree(i, DirectoryHandle{dir, name, link},
+                                            st.identity, ctx, match);
+                    }
+                }
+                else if (group && hash_mode_ == HashMode::content) {
+                    group->run([this, &sons, &i, &ctx, k, match, st] {
+                        sons[k] = makeLeaf(i, ctx, match, st);
+                    });
+                }
+                else {
+                    sons[k] = makeLeaf(i, ctx, match, st);
+                }
+            }
+            if (group) {
+                group->wait();
+            }
+        }
+        hashLeaves(sons, ctx);
+
+        ScannedNode current;
+        current.path = p;
+        current.node.type = FileType::directory;
+        for (auto const &son : sons) {
+            current.node.childNum +=
+                son.node.isFolder() ? son.node.childNum : 1;
+        }
+        current.hash =
+            folderHash(p == base_dir_ ? fs::path{} : p,
+                       sons | std::views::transform(&ScannedNode::hash));
+        current.children = std::move(sons);
         return current;
     }
 
-    FileNode *findFile(FileNode *folder, std::filesystem::path const &relative)
-    { // 从一个父结点开始寻找当前文件夹下路径为relative的结点
-        if (folder == nullptr)
-            return nullptr;
-        FileNode *root = folder->firstChild;
-        while (root != nullptr && root->filepath != relative)
-            root = root->next;
-        return root;
+    // Scans the subtree rooted at `p` like `buildTree`, but into `out`
+    // instead of memory: the directory, open as `dir`, is snapshot slot
+    // `slot`, and the records of its children are written as soon as their
+    // hashes are known. Returns the directory without its children, its
+    // firstChild and childCount those of their block in the snapshot.
+    // Subdirectories are scanned one at a time, so only the directories on
+    // the way down from the root are held at any moment.
+    ScannedNode streamTree(std::filesystem::path const &p, DirectoryHandle dir,
+                           std::optional<FileIdentity> const &id,
+                           ScanContext const &ctx, uint32_t slot,
+                           SnapshotWriter &out) const;
+
+    // Snapshot record of `node`, but for its name and its children.
+    static SnapshotNode snapshotRecord(FileNode const &node, uint32_t parent)
+    {
+        SnapshotNode record{};
+        record.parent = parent;
+        record.first_child = snapshot_no_node;
+        record.flags =
+            (node.isFolder() ? SnapshotNode::folder : 0U) |
+            (node.hasContent ? SnapshotNode::has_content : 0U) |
+            (static_cast<uint32_t>(node.type) << SnapshotNode::type_shift);
+        record.child_num = node.childNum;
+        record.size = node.size;
+        record.mtime = node.mtime;
+        return record;
     }
 
-    FileNode *findPre(FileNode *folder, std::filesystem::path const &relative)
+    // Moves a scanned tree into slot `id`, laying out its subtree breadth
+    // first, so that siblings get contiguous slots.
+    void layoutInto(NodeId id, ScannedNode &&root)
     {
-        if (folder == nullptr)
-            return nullptr;
-        FileNode *root = folder->firstChild;
-
-        while (root != nullptr && root->next->filepath != relative)
-            root = root->next;
-        return root;
+        place(id, std::move(root));
+
+        std::queue<std::pair<NodeId, std::vector<ScannedNode>>> pending;
+        pending.emplace(id, std::move(root.children));
+        while (!pending.empty()) {
+            auto [dir, children] = std::move(pending.front());
+            pending.pop();
+
+            auto const n{static_cast<uint32_t>(children.size())};
+            NodeId const first{arena_.alloc(n)};
+            arena_[dir].firstChild = first;
+            arena_[dir].childCount = n;
+            for (uint32_t k{}; k != n; ++k) {
+                place(first + k, std::move(children[k]));
+                arena_[first + k].parent = dir;
+                if (!children[k].children.empty()) {
+                    pending.emplace(first + k, std::move(children[k].children));
+                }
+            }
+        }
     }
 
-    void recomputeHash(FileNode *root)
-    { // root是经过修改的文件结点
-        if (root == nullptr)
-            return;
-        FileNode *iter = root->parent->firstChild;
-        std::stringstream rehash;
-        while (iter != nullptr) {
-            std::string h(reinterpret_cast<char *>(iter->hash.data()), 32);
-            rehash << h;
+    // Moves a scanned tree into the arena. Returns the root's id.
+    NodeId layout(ScannedNode &&root)
+    {
+        NodeId const id{arena_.alloc(1)};
+        layoutInto(id, std::move(root));
+        arena_[id].name = NamePool::empty;
+        return id;
+    }
 
-            iter = iter->next;
+    // Moves a scanned node, but not its children, into slot `id`.
+    void place(NodeId id, ScannedNode &&scanned)
+    {
+        arena_[id] = scanned.node;
+        arena_[id].name = names_.intern(scanned.path.filename().string());
+        arena_.hash(id) = scanned.hash;
+        if (scanned.node.hasContent) {
+            arena_.content(id) = scanned.content;
         }
-        std::string f = rehash.str();
-        SHA256(reinterpret_cast<unsigned char const *>(f.c_str()), f.size(),
-               root->parent->hash.data());
     }
 
-    // 新增文件节点, insert it to keep ascending property.
-    void addNode(FileNode *newNode, FileNode *folder)
+    // Brings the children of `folder` into the arena if they are still only
+    // in the snapshot. Whatever walks children calls this first. Like any
+    // other change to the tree, not safe to run concurrently.
+    void load(NodeId folder) const
     {
-        // Initializes newNode's parent.
-        newNode->parent = folder;
+        if (arena_[folder].unloaded) {
+            loadChildren(folder);
+        }
+    }
 
-        // Inserts newNode to ascending linked list.
-        auto head = std::make_unique<FileNode>(); // Virtual node
-        head->next = folder->firstChild;
+    void loadChildren(NodeId folder) const;
+
+    // Loads the whole tree, e.g. before threads share it.
+    void loadAll() const;
+
+    // Fills slot `id` from snapshot record `index`, a child of `parent`.
+    // Its children stay in the snapshot.
+    void materialize(NodeId id, uint32_t index, NodeId parent) const;
+
+    NodeId findFile(NodeId folder, std::string_view fileName) const
+    { // 从一个父结点开始寻找当前文件夹下名为fileName的结点
+        if (folder == nil)
+            return nil;
+        load(folder);
+        // Children are sorted, binary search the block.
+        auto const &dir{arena_[folder]};
+        NodeId lo{dir.firstChild};
+        NodeId hi{dir.firstChild + dir.childCount};
+        while (lo != hi) {
+            NodeId const mid{lo + (hi - lo) / 2};
+            if (name(mid) < fileName)
+                lo = mid + 1;
+            else
+                hi = mid;
+        }
+        return lo != dir.firstChild + dir.childCount && name(lo) == fileName
+                   ? lo
+                   : nil;
+    }
 
-        auto *p{head.get()};
-        while (p->next != nullptr && newNode->filepath >= p->next->filepath) {
-            p = p->next;
+    // The node at `relative` (the empty path: the root), or nil.
+    NodeId findPath(std::filesystem::path const &relative) const
+    {
+        NodeId node{root_};
+        for (auto const &part : relative) {
+            node = findFile(node, part.string());
+            if (node == nil || !arena_[node].isFolder()) {
+                return node;
+            }
         }
-        newNode->next = p->next;
-        p->next = newNode;
+        return node;
+    }
 
-        folder->firstChild = head->next;
+    // Rescans the entries of directory `folder`, one level deep: files are
+    // stat'ed (and in content mode, read if their size or mtime changed)
+    // again, new subdirectories are scanned whole, subdirectories that are
+    // still there are kept as they are, unless their relative paths are in
+    // `replaced` (sorted). Marks `folder` dirty.
+    void refreshFolder(NodeId folder,
+                       std::span<std::filesystem::path const> replaced);
 
-        recomputeHash(newNode);
+    void rehashFolder(NodeId folder)
+    {
+        auto const &dir{arena_[folder]};
+        arena_.hash(folder) = folderHash(
+            relativePath(folder),
+            arena_.hashes(dir.firstChild, dir.childCount));
     }
 
-    bool deleteNode(FileNode *folder, std::filesystem::path const &file)
-    { // 删除文件结点
-        FileNode *f = findFile(folder, file);
-        FileNode *pre = findPre(folder, file);
-        if (f == nullptr)
-            return false;
-
-        if (pre == nullptr) { // folder的firstChild结点
-            folder->firstChild = f->next;
-            // delete f;
-            recomputeHash(folder->firstChild);
-        }
-        else {
-            pre->next = f->next;
-            // delete f;
-            recomputeHash(folder->firstChild);
+    // Flags `folder` and its ancestors for rehashing. Ancestors of a dirty
+    // folder are always dirty, so marking stops at the first one that is.
+    // Mutations only mark; `flushHashes` brings the hashes up to date once
+    // per batch of changes.
+    void markDirty(NodeId folder)
+    {
+        for (; folder != nil && !arena_[folder].dirty;
+             folder = arena_[folder].parent) {
+            arena_[folder].dirty = true;
         }
-        return true;
     }
 
-    void changeHash(FileNode *root, std::string const &time,
-                    std::filesystem::path const &path)
-    { // 覆盖文件后更新哈希值
-        std::string hashString = time + '|' + path.string();
-        SHA256(reinterpret_cast<unsigned char const *>(hashString.c_str()),
-               hashString.size(), root->hash.data());
-        recomputeHash(root);
+    // Recomputes childNum and the hash of `folder` and of every dirty folder
+    // below it, children before parents, each exactly once.
+    void rehashDirty(NodeId folder)
+    {
+        auto const first{arena_[folder].firstChild};
+        auto const n{arena_[folder].childCount};
+        uint32_t childNum{};
+        for (NodeId c{first}; c != first + n; ++c) {
+            if (arena_[c].dirty) {
+                rehashDirty(c);
+            }
+            childNum += arena_[c].isFolder() ? arena_[c].childNum : 1;
+        }
+        arena_[folder].childNum = childNum;
+        arena_[folder].dirty = false;
+        rehashFolder(folder);
     }
 
-    // 设A是主导文件夹，B是被同步文件夹
-    // 更新准则：因为没有利用事件监听机制，只能先找到所有相对路径在A中但不在B中的文件路径，和相对路径在B中不在A中的文件路径，然后进行B的新增和删除
-    // 之后A和B就能完全对应上了，让A和B一一对应地遍历，比对哈希值，如果哈希值不一致，那么覆盖更新当前指向结点所存储的相对路径的文件即可
+    void flushHashes()
+    {
+        if (root_ != nil && arena_[root_].dirty) {
+            rehashDirty(root_);
+        }
+    }
 
-    void syncTree(FileNode *A, FileNode *B)
-    { // 哈希树的更新（不是文件的更新），用于维护当前文件夹哈希树的最新性
+    // Whether `id`, e.g. from the other end of a channel, is one of our
+    // nodes: in range, and not a free slot. Free slots have no parent, and
+    // the root is the only node without one.
+    bool isNode(NodeId id) const
+    {
+        return id < arena_.slots() &&
+               (id == root_ || arena_[id].parent != nil);
+    }
 
-        if (!A || !B || !A->isFolder() || !B->isFolder()) {
-            throw std::runtime_error("node error(use error)");
-            return;
+    // Moves node `from` to slot `to`, re-pointing its children at the new
+    // slot.
+    void moveNode(NodeId from, NodeId to)
+    {
+        arena_.move(from, to);
+        if (arena_[to].unloaded) {
+            auto record{unloaded_.extract(from)};
+            record.key() = to;
+            unloaded_.insert(std::move(record));
         }
-
-        // 找到 A 中存在但 B 中不存在的文件或文件夹
-        std::unordered_map<std::string, FileNode *> B_map;
-        FileNode *currentB = B->firstChild;
-        while (currentB != nullptr) {
-            B_map[currentB->filepath.string()] = currentB;
-            currentB = currentB->next;
+        auto const &node{arena_[to]};
+        for (NodeId c{node.firstChild}; c != node.firstChild + node.childCount;
+             ++c) {
+            arena_[c].parent = to;
         }
+    }
 
-        FileNode *currentA = A->firstChild;
-        while (currentA) {
-            if (B_map.find(currentA->filepath.string()) == B_map.end()) {
-                // B中不存在A的文件结点，添加到 B
-                FileNode *newNode = new FileNode(currentA->hashString);
-                addNode(newNode, B);
-            }
-            else
-                B_map.erase(
-                    currentA->filepath
-                        .string()); // 删除所有A中的结点，这样剩下的就是B中有A中无的所有结点了
-            currentA = currentA->next;
+    // Releases everything below `node`, but not `node` itself, which lives in
+    // its parent's block.
+    void freeSubtree(NodeId node)
+    {
+        if (arena_[node].unloaded) {
+            unloaded_.erase(node);
+            arena_[node].unloaded = false;
+            return;
+        }
+        auto const first{arena_[node].firstChild};
+        auto const n{arena_[node].childCount};
+        for (NodeId c{first}; c != first + n; ++c) {
+            freeSubtree(c);
         }
+        arena_.free(first, n);
+        arena_[node].firstChild = nil;
+        arena_[node].childCount = 0;
+    }
 
-        // 找到 B 中存在但 A 中不存在的文件或文件夹
-        for (auto const &[filepath, node] : B_map) {
-            deleteNode(B, filepath); // 删除 B 中多余的文件或文件夹
+    // 新增文件节点, insert it to keep ascending property. The children block
+    // of `folder` is moved to a slot range one larger.
+    NodeId addNode(FileNode newNode, Digest const &hash, NodeId folder)
+    {
+        load(folder);
+        auto const oldFirst{arena_[folder].firstChild};
+        auto const n{arena_[folder].childCount};
+
+        uint32_t pos{0};
+        while (pos != n &&
+               names_.view(newNode.name) >= name(oldFirst + pos)) {
+            ++pos;
         }
 
-        // 遍历两棵树并比对哈希值，如果不一致则更新
-        currentA = A->firstChild;
-        currentB = B->firstChild;
-        while (currentA && currentB) {
-            if (currentA->filepath == currentB->filepath) {
-                if (currentA->isDiff(currentB)) {
-                    // Hash 不一致，更新 B 中的文件
-                    std::string time = std::to_string(
-                        std::filesystem::last_write_time(currentA->filepath)
-                            .time_since_epoch()
-                            .count());
-                    changeHash(currentB, time, currentA->filepath);
-                }
-                // 递归调用处理子文件夹
-                if (currentA->isFolder() && currentB->isFolder()) {
-                    syncTree(currentA, currentB);
-                }
-                currentA = currentA->next;
-                currentB = currentB->next;
+        NodeId const first{arena_.alloc(n + 1)};
+        for (uint32_t k{}; k != n + 1; ++k) {
+            if (k == pos) {
+                arena_[first + k] = std::move(newNode);
+                arena_.hash(first + k) = hash;
             }
             else {
-                // 如果出现了路径不匹配的情况（不应当发生）
-                throw std::runtime_error("match error(code error)");
-                break;
+                moveNode(oldFirst + (k < pos ? k : k - 1), first + k);
             }
+            arena_[first + k].parent = folder;
         }
+        arena_.free(oldFirst, n);
+        arena_[folder].firstChild = first;
+        arena_[folder].childCount = n + 1;
+
+        markDirty(folder);
+        return first + pos;
     }
 
-    // A依然为主导文件夹
-    void syncFile(FileNode *A, FileNode *B, std::filesystem::path const &rootA,
-                  std::filesystem::path const &rootB);
+    // Copies node `a` of `src`, including its subtree, under `folder`.
+    NodeId addNode(BasicMerkleTree const &src, NodeId a, NodeId folder)
+    {
+        FileNode node{};
+        node.name = names_.intern(src.name(a));
+        NodeId const id{addNode(node, src.arena_.hash(a), folder)};
+        copyNode(src, a, id);
+        arena_[id].parent = folder;
+        cloneChildren(src, a, id);
+        return id;
+    }
 
-    void deleteTree(FileNode *node)
+    // Copies node `a` of `src`, but not its children, into slot `b`. Its
+    // name is interned into our pool, its parent is left to the caller.
+    void copyNode(BasicMerkleTree const &src, NodeId a, NodeId b)
     {
-        if (node == nullptr)
-            return;
-        deleteTree(node->firstChild);
-        deleteTree(node->next);
-        delete node;
+        arena_[b] = src.arena_[a];
+        arena_[b].name = names_.intern(src.name(a));
+        if (arena_[b].type == FileType::symlink) {
+            arena_[b].type = FileType::regular; // Copies follow symlinks
+        }
+        arena_[b].firstChild = nil;
+        arena_[b].childCount = 0;
+        arena_[b].unloaded = false; // `cloneChildren` loads them from `src`
+        assignLeaf(b, src, a);
     }
 
-    // boost库不支持双向指针，因此只保存单向，另外一个方向的指针重新构建
-    void ptrHelper(FileNode *root)
+    void cloneChildren(BasicMerkleTree const &src, NodeId a, NodeId b)
     {
-        if (root == nullptr || root->firstChild == nullptr)
-            return;
-        FileNode *iter = root->firstChild;
-        while (iter != nullptr) {
-            iter->parent = root;
-            ptrHelper(iter); // 修正为传递iter
-            iter = iter->next;
+        src.load(a);
+        auto const srcFirst{src.arena_[a].firstChild};
+        auto const n{src.arena_[a].childCount};
+        NodeId const first{arena_.alloc(n)};
+        arena_[b].firstChild = first;
+        arena_[b].childCount = n;
+        for (uint32_t k{}; k != n; ++k) {
+            copyNode(src, srcFirst + k, first + k);
+            arena_[first + k].parent = b;
+            cloneChildren(src, srcFirst + k, first + k);
+        }
+    }
+
+    bool deleteNode(NodeId folder, std::filesystem::path const &file)
+    { // 删除文件结点
+        NodeId const f{findFile(folder, file.filename().string())};
+        if (f == nil)
+            return false;
+
+        freeSubtree(f);
+        auto const first{arena_[folder].firstChild};
+        auto const n{arena_[folder].childCount};
+        for (NodeId i{f + 1}; i != first + n; ++i) {
+            moveNode(i, i - 1);
         }
+        arena_.free(first + n - 1, 1);
+        arena_[folder].childCount = n - 1;
+        if (n == 1) {
+            arena_[folder].firstChild = nil;
+        }
+        markDirty(folder);
+        return true;
     }
 
-    void rebuildTree(std::ifstream &ifile)
+    // Leaf `root` now holds the same bytes as `source`; doesn't rehash the
+    // parent.
+    void assignLeaf(NodeId root, BasicMerkleTree const &src, NodeId source)
     {
-        assert(root_ == nullptr);
-        if (!ifile) {
-            throw std::runtime_error("istream error");
-            return;
+        auto &node{arena_[root]};
+        auto const &from{src.arena_[source]};
+        node.size = from.size;
+        node.mtime = from.mtime;
+        // Trees built in another hash mode don't keep content digests.
+        node.hasContent = from.hasContent && arena_.keeps_contents();
+        if (node.hasContent) {
+            arena_.content(root) = src.arena_.content(source);
         }
-        boost::archive::text_iarchive ia(ifile);
-        ia & root_;
-        ptrHelper(root_);
+        arena_.hash(root) = src.arena_.hash(source);
     }
 
+    // 覆盖文件后更新哈希值: `root` now holds the same bytes as `source`.
+    void changeHash(NodeId root, BasicMerkleTree const &src, NodeId source)
+    {
+        assignLeaf(root, src, source);
+        markDirty(arena_[root].parent);
+    }
+
+    void changeHash(NodeId root, std::string const &time,
+                    std::filesystem::path const &path)
+    { // 覆盖文件后更新哈希值
+        arena_.hash(root) = leafHash(time, path);
+        markDirty(arena_[root].parent);
+    }
+
+    // 设A是主导文件夹，B是被同步文件夹
+    // 更新准则：因为没有利用事件监听机制，只能先找到所有相对路径在A中但不在B中的文件路径，和相对路径在B中不在A中的文件路径，然后进行B的新增和删除
+    // 之后A和B就能完全对应上了，让A和B一一对应地遍历，比对哈希值，如果哈希值不一致，那么覆盖更新当前指向结点所存储的相对路径的文件即可
+    //
+    // Both child blocks are sorted, so all of the above is one merge-join
+    // pass per directory, and subtrees with equal hashes are never entered.
+    //
+    // Syncing is split in stages: planSync works out the file operations
+    // without doing them, `execute` (sync_plan.hpp) does them, and reconcile
+    // brings the hash tree up to date.
+
+    // One slot of a directory's child list after syncing: a B child that
+    // stays, or an A child that has to be copied over (b == nil).
+    struct Slot {
+        NodeId b;
+        NodeId a;
+    };
+
+    // Merge-joins the sorted child blocks of A (in `src`) and B (ours) into
+    // `merged`, B's new child list, and `removed`, B's children that go.
+    // Returns whether any A child has to be copied over.
+    bool mergeChildren(BasicMerkleTree const &src, NodeId A, NodeId B,
+                       std::vector<Slot> &merged,
+                       std::vector<NodeId> &removed) const;
+
+    // Total size of the files in the subtree of `node`.
+    uint64_t subtreeBytes(NodeId node) const;
+
+    // Adds creations for node `a` at relative `path` and everything below
+    // it, folders first.
+    void planCreate(NodeId a, std::filesystem::path const &path,
+                    SyncPlan &plan) const;
+
+    // Adds to `plan` what turns the directory under B (ours) into the one
+    // under A of `src`, without touching either. Both are at relative
+    // `path`. With a `pool`, large subfolders are planned as tasks, into
+    // plans of their own that are appended in order: the plan comes out the
+    // same. Neither tree may have unloaded folders then.
+    void planSync(BasicMerkleTree const &src, NodeId A, NodeId B,
+                  std::filesystem::path const &path, SyncPlan &plan,
+                  ThreadPool *pool = nullptr) const;
+
+    // `plan_sync_from`, comparing on `pool` if there is one.
+    SyncPlan planFrom(BasicMerkleTree const &other, ThreadPool *pool) const;
+
+    // Turns the creations and modifications of `plan` whose content we
+    // already have, in a file the plan deletes or modifies, into moves of
+    // that file. Content is matched by size and content digest, so this
+    // does nothing in mtime mode.
+    void planMoves(BasicMerkleTree const &src, SyncPlan &plan) const;
+
+    // Makes the subtree B (ours) equal to the subtree A of `src`. Changed
+    // folders are left dirty.
+    void reconcile(BasicMerkleTree const &src, NodeId A, NodeId B);
+
+    void syncTree(BasicMerkleTree const &src, NodeId A, NodeId B)
+    { // 哈希树的更新（不是文件的更新），用于维护当前文件夹哈希树的最新性
+        reconcile(src, A, B);
+        flushHashes();
+    }
+
+    // The tree served on the other end of `channel`, as far as we need it:
+    // folders whose hash differs from that of our folder at the same path
+    // are listed, recursively, the others are left as a hash without
+    // children. `served` is the sender's hello, `remoteIds` gets the
+    // sender's id of every node.
+    BasicMerkleTree fetchRemote(Channel &channel, ServedTree const &served,
+                                std::vector<NodeId> &remoteIds) const;
+
+    // Appends the children of `folder` to a listing message.
+    void writeListing(NodeId folder, WireWriter &out) const;
+
+    // Sends the bytes of file `file` as data messages.
+    void sendFile(NodeId file, Channel &channel) const;
+
+    // Makes the (empty) tree that of `snapshot`, which it keeps: only the
+    // root and its children are decoded, deeper folders when first walked.
+    void rebuildTree(std::shared_ptr<SnapshotView const> snapshot);
+
   public:
-    static MerkleTree from_file(std::string const &filepath)
+    using Policy = HashPolicy;
+
+    static BasicMerkleTree from_file(std::string const &filepath)
     {
-        std::ifstream ifile(filepath);
-        if (!ifile) {
+        if (!std::filesystem::is_regular_file(filepath)) {
             throw std::runtime_error("can't read " + filepath);
         }
 
-        MerkleTree mt;
-        mt.rebuildTree(ifile);
+        // Records are checked as they are loaded, so that a sync that only
+        // walks a few paths only reads a few pages.
+        BasicMerkleTree mt;
+        mt.rebuildTree(std::make_shared<SnapshotView const>(
+            filepath, SnapshotView::Check::layout));
         return mt;
     }
 
-    static MerkleTree from_directory(std::string const &dir_path)
+    static BasicMerkleTree from_directory(std::string const &dir_path,
+                                     BuildOptions const &options = {})
     {
-        return MerkleTree(dir_path);
+        return BasicMerkleTree(dir_path, options);
     }
 
+    // A tree for the directory `dir_path` as if it were empty, e.g. a sync
+    // destination that doesn't exist yet. Doesn't touch the file system;
+    // only the hash mode and the filter of `options` are used.
+    static BasicMerkleTree empty(std::string const &dir_path,
+                            BuildOptions const &options = {});
+
     // If path is a file, delegates to `from_file`, otherwise delegates to
     // `from_directory`.
-    static MerkleTree from_path(std::string const &path)
+    static BasicMerkleTree from_path(std::string const &path,
+                                BuildOptions const &options = {})
     {
 
         return std::filesystem::is_directory(path)
-                   ? MerkleTree::from_directory(path)
-                   : MerkleTree::from_file(path);
+                   ? from_directory(path, options)
+                   : from_file(path);
     }
 
-    bool isSame(MerkleTree *other)
+    // The rules the tree was scanned with. A tree to be compared with this
+    // one has to be scanned with the same, or what they exclude differs.
+    [[nodiscard]] PathFilter const &filter() const
     {
-        return root_->hash == other->root_->hash;
+        return filter_;
     }
 
-    void updateTree(MerkleTree *old)
-    {
-        syncTree(root_, old->root_);
-    }
+    // What snapshots and the remote protocol record as the hash algorithm.
+    static constexpr std::uint32_t hash_algorithm{HashPolicy::id};
 
-    // 序列化哈希树至文件中
-    void writeTree(std::string const &filepath) const
+    bool isSame(BasicMerkleTree *other)
     {
-        std::ofstream ofile(filepath);
-        if (!ofile) {
-            throw std::runtime_error("can't open file " + filepath);
-        }
-        boost::archive::text_oarchive oa(ofile);
-        oa & root_;
+        return arena_.hash(root_) == other->arena_.hash(other->root_);
     }
 
-    ~MerkleTree()
+    void updateTree(BasicMerkleTree *old)
     {
-        deleteTree(root_);
+        old->syncTree(*this, root_, old->root_);
     }
 
-    void sync_from(MerkleTree const &other);
-
-    template <class Archive>
-    void serialize(Archive &ar, unsigned int const version)
-    {
-        ar & base_dir_;
-        ar & root_;
-    }
+    // 序列化哈希树至文件中, in the binary snapshot format (snapshot.hpp)
+    void writeTree(std::string const &filepath) const;
+
+    // Scans `dir_path` like `from_directory` and writes its snapshot to
+    // `filepath` like `writeTree`, without ever holding the tree: the
+    // entries of a directory go to the file as soon as their hashes are
+    // known, and are dropped. Memory grows with the depth of the tree and
+    // the size of its directories, not with the number of files. The nodes
+    // are laid out in another order than `writeTree`'s, the tree read back
+    // is the same. With several jobs, only files are hashed in parallel;
+    // `options.reference` isn't used.
+    static void save_directory(std::string const &dir_path,
+                               std::string const &filepath,
+                               BuildOptions const &options = {});
+
+    // Brings the directories at the relative paths `dirs` (e.g. from a
+    // DirectoryWatcher; the empty path is the root) up to date with the file
+    // system. Directories that no longer exist are skipped, their parents
+    // are expected among `dirs` too. Subdirectories in `replaced` (sorted)
+    // were created or moved in since: they are scanned anew rather than
+    // kept, their parents are expected among `dirs`.
+    void refresh(std::span<std::filesystem::path const> dirs,
+                 std::span<std::filesystem::path const> replaced = {});
+
+    // What `sync_from(other)` would do to our directory. Compares with
+    // `jobs` threads, unless a tree still has folders to load from its
+    // snapshot: loading them is for one thread at a time.
+    SyncPlan plan_sync_from(BasicMerkleTree const &other,
+                            std::size_t jobs = 1) const;
+
+    // Returns the number of bytes written.
+    std::uint64_t sync_from(BasicMerkleTree const &other,
+                            SyncOptions const &options = {});
+
+    // Syncs every tree of `dests` from `src`, which is scanned once for all
+    // of them. Every file copied is read once, for all the destinations
+    // that need it. Returns the number of bytes written, all together.
+    static std::uint64_t sync_all(std::span<BasicMerkleTree> dests,
+                                  BasicMerkleTree const &src,
+                                  SyncOptions const &options = {});
+
+    // Stores the content of every file that `store` doesn't have yet, then
+    // our snapshot as the store's newest version. Only for trees built in
+    // content mode. Entries with no content to store (devices, pipes,
+    // symlinks that lead nowhere) are reported and left out. Returns the
+    // number of the version.
+    std::uint64_t backup_to(ChunkStore &store) const;
+
+    // Makes our directory that of `version`, a tree read from a snapshot of
+    // `store`, the way `sync_from` would from the directory it was taken
+    // of; files are put together from the store instead of being copied,
+    // entries without content are reported and skipped. We have to be
+    // scanned in content mode, with the version's filter, and from our own
+    // bytes: not with `version` as the reference, whose sizes and mtimes an
+    // edit since may have kept. Returns the number of bytes written.
+    std::uint64_t restore_from(ChunkStore const &store,
+                               BasicMerkleTree const &version,
+                               SyncOptions const &options = {});
+
+    // Answers `plan_sync_from(channel)` or `sync_from(channel)` of a tree
+    // on the other end of `channel` (remote.hpp), until it's done.
+    void serve(Channel &channel) const;
+
+    // Same as the overloads taking a tree, for the tree served on the other
+    // end of `channel`, which answered `open_session` with `served`. We have
+    // to be scanned with its filter. Only folders that differ are listed
+    // over the channel and only files that differ are sent, one after the
+    // other. Ends the session.
+    SyncPlan plan_sync_from(Channel &channel, ServedTree const &served) const;
+    std::uint64_t sync_from(Channel &channel, ServedTree const &served);
 };
+
+using MerkleTree = BasicMerkleTree<Sha256Policy>;
+using BuildOptions = BasicBuildOptions<Sha256Policy>;
+
+extern template class BasicMerkleTree<Sha256Policy>;
+extern template class BasicMerkleTree<Xxh64x4Policy>;
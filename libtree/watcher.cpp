@@ -0,0 +1,198 @@
+#include <libtree/watcher.hpp>
+
+#include <algorithm>
+#include <array>
+#include <cerrno>
+#include <cstdint>
+#include <stdexcept>
+#include <system_error>
+#include <utility>
+
+#if defined(__linux__)
+#include <poll.h>
+#include <sys/inotify.h>
+#include <unistd.h>
+#endif
+
+#if defined(__linux__)
+
+namespace {
+
+constexpr std::uint32_t watch_mask{
+    IN_CREATE | IN_DELETE | IN_MODIFY | IN_ATTRIB | IN_CLOSE_WRITE |
+    IN_MOVED_FROM | IN_MOVED_TO | IN_DELETE_SELF | IN_MOVE_SELF | IN_ONLYDIR |
+    IN_DONT_FOLLOW};
+
+} // namespace
+
+DirectoryWatcher::DirectoryWatcher(std::filesystem::path root)
+    : fd_(::inotify_init1(IN_NONBLOCK | IN_CLOEXEC)), root_(std::move(root))
+{
+    if (fd_ < 0) {
+        throw std::system_error{errno, std::system_category(),
+                                "can't initialize inotify"};
+    }
+    try {
+        watchTree({});
+    }
+    catch (...) {
+        ::close(fd_);
+        throw;
+    }
+}
+
+DirectoryWatcher::~DirectoryWatcher()
+{
+    ::close(fd_);
+}
+
+void DirectoryWatcher::watchTree(std::filesystem::path const &relative)
+{
+    namespace fs = std::filesystem;
+
+    auto watch{[this](fs::path const &dir) {
+        int const wd{::inotify_add_watch(fd_, (root_ / dir).c_str(),
+                                         watch_mask)};
+        if (wd >= 0) {
+            dirs_[wd] = dir;
+        }
+        else if (errno == ENOSPC) {
+            throw std::runtime_error{
+                "out of inotify watches, raise "
+                "/proc/sys/fs/inotify/max_user_watches"};
+        }
+        // Otherwise it's gone again or unreadable, nothing to watch.
+    }};
+
+    watch(relative);
+    std::error_code ec;
+    for (fs::recursive_directory_iterator
+             it{root_ / relative,
+                fs::directory_options::skip_permission_denied, ec},
+         end;
+         !ec && it != end; it.increment(ec)) {
+        if (it->is_directory(ec) && !it->is_symlink(ec)) {
+            watch(it->path().lexically_relative(root_));
+        }
+    }
+}
+
+void DirectoryWatcher::unwatchTree(std::filesystem::path const &relative)
+{
+    for (auto it{dirs_.begin()}; it != dirs_.end();) {
+        // `dir` is `relative` or below it
+        if (std::ranges::mismatch(relative, it->second).in1 ==
+            relative.end()) {
+            ::inotify_rm_watch(fd_, it->first);
+            it = dirs_.erase(it);
+        }
+        else {
+            ++it;
+        }
+    }
+}
+
+void DirectoryWatcher::drain(Changes &changes)
+{
+    alignas(inotify_event) std::array<char, 64U << 10> buffer;
+    for (;;) {
+        auto const n{::read(fd_, buffer.data(), buffer.size())};
+        if (n < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            if (errno == EAGAIN) {
+                return;
+            }
+            throw std::system_error{errno, std::system_category(),
+                                    "can't read inotify events"};
+        }
+
+        for (auto const *p{buffer.data()}; p < buffer.data() + n;) {
+            auto const &event{*reinterpret_cast<inotify_event const *>(p)};
+            p += sizeof(inotify_event) + event.len;
+
+            if ((event.mask & IN_Q_OVERFLOW) != 0) {
+                changes.overflow = true;
+                continue;
+            }
+            auto const it{dirs_.find(event.wd)};
+            if (it == dirs_.end()) {
+                continue;
+            }
+            if ((event.mask & IN_IGNORED) != 0) { // Directory is gone
+                dirs_.erase(it);
+                continue;
+            }
+            if (event.len == 0) { // About the directory itself
+                // Below the root, the parent reports it as well.
+                if ((event.mask & (IN_DELETE_SELF | IN_MOVE_SELF)) != 0 &&
+                    it->second.empty()) {
+                    changes.root_gone = true;
+                }
+                continue;
+            }
+
+            auto const dir{it->second};
+            changes.dirs.push_back(dir);
+            if ((event.mask & IN_ISDIR) != 0) {
+                auto const child{dir / event.name};
+                if ((event.mask & IN_MOVED_FROM) != 0) {
+                    unwatchTree(child);
+                }
+                if ((event.mask & (IN_CREATE | IN_MOVED_TO)) != 0) {
+                    changes.replaced.push_back(child);
+                    watchTree(child);
+                }
+            }
+        }
+    }
+}
+
+DirectoryWatcher::Changes
+DirectoryWatcher::wait(std::chrono::milliseconds window)
+{
+    Changes changes;
+    pollfd pfd{.fd = fd_, .events = POLLIN, .revents = 0};
+
+    // Sleeps until the first event, then gathers until the window closes.
+    while (changes.dirs.empty() && !changes.overflow && !changes.root_gone) {
+        if (::poll(&pfd, 1, -1) < 0 && errno != EINTR) {
+            throw std::system_error{errno, std::system_category(),
+                                    "can't wait for inotify events"};
+        }
+        drain(changes);
+    }
+    auto const deadline{std::chrono::steady_clock::now() + window};
+    for (auto now{std::chrono::steady_clock::now()}; now < deadline;
+         now = std::chrono::steady_clock::now()) {
+        auto const left{std::chrono::ceil<std::chrono::milliseconds>(
+            deadline - now)};
+        if (::poll(&pfd, 1, static_cast<int>(left.count())) > 0) {
+            drain(changes);
+        }
+    }
+
+    for (auto *paths : {&changes.dirs, &changes.replaced}) {
+        std::ranges::sort(*paths);
+        paths->erase(std::ranges::unique(*paths).begin(), paths->end());
+    }
+    return changes;
+}
+
+#else
+
+DirectoryWatcher::DirectoryWatcher(std::filesystem::path root)
+    : root_(std::move(root))
+{
+    throw std::runtime_error{"watching isn't supported on this platform"};
+}
+
+DirectoryWatcher::~DirectoryWatcher() = default;
+
+DirectoryWatcher::Changes DirectoryWatcher::wait(std::chrono::milliseconds)
+{
+    return {};
+}
+
+#endif
@@ -0,0 +1,55 @@
+#pragma once
+
+#include <chrono>
+#include <filesystem>
+#include <unordered_map>
+#include <vector>
+
+// Reports which directories below a root changed, so that only those need to
+// be rescanned. Uses inotify with one watch per directory; only available on
+// Linux, the constructor throws elsewhere.
+class DirectoryWatcher {
+  public:
+    struct Changes {
+        // Relative paths of directories whose entries changed (were created,
+        // deleted, moved, written or touched). The root is the empty path.
+        // Sorted, so a directory comes before its subdirectories.
+        std::vector<std::filesystem::path> dirs;
+
+        // Relative paths of directories that were created or moved in, sorted
+        // too: what was known under their names before is another directory.
+        std::vector<std::filesystem::path> replaced;
+
+        // The kernel dropped events: everything has to be rescanned.
+        bool overflow{false};
+
+        // The root itself was deleted or moved away: nothing more will be
+        // reported.
+        bool root_gone{false};
+    };
+
+    explicit DirectoryWatcher(std::filesystem::path root);
+
+    DirectoryWatcher(DirectoryWatcher const &) = delete;
+    DirectoryWatcher &operator=(DirectoryWatcher const &) = delete;
+
+    ~DirectoryWatcher();
+
+    // Blocks until something changes, then keeps collecting events for
+    // `window`, so that a burst of writes turns into one batch.
+    Changes wait(std::chrono::milliseconds window);
+
+  private:
+    // Adds watches for `relative` and every directory below it.
+    void watchTree(std::filesystem::path const &relative);
+
+    // Drops the watches of `relative` and every directory below it.
+    void unwatchTree(std::filesystem::path const &relative);
+
+    // Handles the events that can be read without blocking.
+    void drain(Changes &changes);
+
+    int fd_{-1};
+    std::filesystem::path root_;
+    std::unordered_map<int, std::filesystem::path> dirs_; // Watch -> dir
+};
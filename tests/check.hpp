@@ -0,0 +1,95 @@
+// What the tests share: a check that reports where it failed, and scratch
+// directories to build trees in.
+#pragma once
+
+#include <chrono>
+#include <cstdlib>
+#include <filesystem>
+#include <format>
+#include <fstream>
+#include <iterator>
+#include <print>
+#include <source_location>
+#include <string>
+#include <string_view>
+
+// Fails the test, and carries on with the next check, if `cond` is false.
+#define CHECK(...) check((__VA_ARGS__), #__VA_ARGS__)
+
+inline int &check_failures()
+{
+    static int failures{0};
+    return failures;
+}
+
+inline void check(bool ok, std::string_view what,
+                  std::source_location where = std::source_location::current())
+{
+    if (!ok) {
+        std::println(stderr, "{}:{}: CHECK({}) failed", where.file_name(),
+                     where.line(), what);
+        ++check_failures();
+    }
+}
+
+// What `main` of a test returns.
+inline int check_result()
+{
+    return check_failures() == 0 ? EXIT_SUCCESS : EXIT_FAILURE;
+}
+
+// A fresh directory under the system's temporary directory, removed with
+// everything in it when it goes out of scope.
+class ScratchDir {
+  public:
+    explicit ScratchDir(std::string_view name)
+        : path_(std::filesystem::temp_directory_path() /
+                std::format("tree_test_{}", name))
+    {
+        std::filesystem::remove_all(path_);
+        std::filesystem::create_directories(path_);
+    }
+
+    ScratchDir(ScratchDir const &) = delete;
+    ScratchDir &operator=(ScratchDir const &) = delete;
+
+    ~ScratchDir()
+    {
+        std::error_code ec;
+        std::filesystem::remove_all(path_, ec);
+    }
+
+    [[nodiscard]] std::filesystem::path const &path() const
+    {
+        return path_;
+    }
+
+    std::filesystem::path operator/(std::filesystem::path const &p) const
+    {
+        return path_ / p;
+    }
+
+  private:
+    std::filesystem::path path_;
+};
+
+// Writes `text` to `path`, creating the directories on the way.
+inline void write_text(std::filesystem::path const &path,
+                       std::string_view text)
+{
+    std::filesystem::create_directories(path.parent_path());
+    std::ofstream ofile(path, std::ios::binary | std::ios::trunc);
+    ofile << text;
+}
+
+inline std::string read_text(std::filesystem::path const &path)
+{
+    std::ifstream ifile(path, std::ios::binary);
+    return {std::istreambuf_iterator<char>{ifile},
+            std::istreambuf_iterator<char>{}};
+}
+
+// A fixed mtime for test files, far enough in the past that a scan never
+// takes it for a file still being written.
+inline std::filesystem::file_time_type const test_mtime{
+    std::filesystem::file_time_type::clock::now() - std::chrono::hours{24}};
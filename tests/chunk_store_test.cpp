@@ -0,0 +1,265 @@
+// Content-defined chunking, and backups to a chunk store restored and
+// pruned.
+#include "tests/check.hpp"
+
+#include <libtree/chunk_store.hpp>
+#include <libtree/tree.hpp>
+
+#include <algorithm>
+#include <cstddef>
+#include <cstdint>
+#include <filesystem>
+#include <iterator>
+#include <random>
+#include <ranges>
+#include <span>
+#include <stdexcept>
+#include <string>
+#include <vector>
+
+namespace {
+
+namespace fs = std::filesystem;
+
+// The same bytes on every platform: mt19937_64 is fully specified.
+std::vector<unsigned char> random_bytes(std::size_t n, std::uint64_t seed)
+{
+    std::mt19937_64 random{seed};
+    std::vector<unsigned char> bytes(n);
+    for (std::size_t i{}; i != n; i += 8) {
+        auto v{random()};
+        for (std::size_t k{i}; k != std::min(n, i + 8); ++k, v >>= 8) {
+            bytes[k] = static_cast<unsigned char>(v);
+        }
+    }
+    return bytes;
+}
+
+// Offsets of the cut points of `data`, the end included.
+std::vector<std::size_t> cut_points(std::span<unsigned char const> data)
+{
+    std::vector<std::size_t> cuts;
+    for (std::size_t offset{}; offset != data.size();) {
+        offset += next_chunk(data.subspan(offset));
+        cuts.push_back(offset);
+    }
+    return cuts;
+}
+
+void chunk_sizes()
+{
+    auto const data{random_bytes(4U << 20, 1)};
+    auto const cuts{cut_points(data)};
+    std::size_t previous{};
+    for (std::size_t i{}; i != cuts.size(); ++i) {
+        auto const size{cuts[i] - previous};
+        CHECK(size <= chunk_max_size);
+        CHECK(size >= chunk_min_size || i + 1 == cuts.size());
+        previous = cuts[i];
+    }
+    // Around the average, give or take.
+    CHECK(cuts.size() >= data.size() / (2 * chunk_avg_size));
+    CHECK(cuts.size() <= data.size() / (chunk_avg_size / 2));
+
+    auto const small{random_bytes(chunk_min_size, 2)};
+    CHECK(next_chunk(small) == small.size());
+    CHECK(next_chunk({}) == 0);
+}
+
+// Cut points are what a store is deduplicated on: the gear table and the
+// masks must never change, or a new backup stores everything again.
+void cut_points_are_pinned()
+{
+    auto const data{random_bytes(1U << 20, 42)};
+    std::vector<std::size_t> const expected{
+        78258,  146212, 218882, 269311, 339817, 417447, 496353,  554884,
+        625182, 692934, 775928, 865773, 961483, 1028223, 1048576};
+    CHECK(cut_points(data) == expected);
+}
+
+// An insertion only changes the chunks around it.
+void insertion_moves_nearby_cuts()
+{
+    auto const data{random_bytes(4U << 20, 3)};
+    auto edited{data};
+    auto const at{edited.begin() + (2U << 20) + 123};
+    std::vector<unsigned char> const inserted(100, 0xAB);
+    edited.insert(at, inserted.begin(), inserted.end());
+
+    auto const before{cut_points(data)};
+    auto after{cut_points(edited)};
+    std::size_t const from{(2U << 20) + 123};
+    for (auto &cut : after) {
+        if (cut > from) {
+            cut -= inserted.size();
+        }
+    }
+    std::vector<std::size_t> common;
+    std::ranges::set_intersection(before, after, std::back_inserter(common));
+    CHECK(common.size() + 2 >= before.size());
+    // Those before the insertion, every one of them.
+    CHECK(std::ranges::equal(
+        before | std::views::filter([&](auto c) { return c < from; }),
+        after | std::views::filter([&](auto c) { return c < from; })));
+}
+
+void write_bytes(fs::path const &path, std::span<unsigned char const> bytes)
+{
+    write_text(path, {reinterpret_cast<char const *>(bytes.data()),
+                      bytes.size()});
+}
+
+BuildOptions content_options(PathFilter const *filter = nullptr)
+{
+    BuildOptions options;
+    options.hash_mode = HashMode::content;
+    options.filter = filter;
+    return options;
+}
+
+// Restores `version` of `store` into `to`, scanning `to` from its own
+// bytes, the way `tree restore` does.
+void restore(ChunkStore const &store, std::uint64_t version,
+             fs::path const &to)
+{
+    auto const snapshot{
+        MerkleTree::from_file(store.version_path(version).string())};
+    auto const options{content_options(&snapshot.filter())};
+    fs::create_directories(to);
+    auto dest{MerkleTree::from_directory(to.string(), options)};
+    dest.restore_from(store, snapshot);
+}
+
+bool same(fs::path const &a, fs::path const &b)
+{
+    auto ta{MerkleTree::from_directory(a.string(), content_options())};
+    auto tb{MerkleTree::from_directory(b.string(), content_options())};
+    return ta.isSame(&tb);
+}
+
+std::uint64_t backup(ChunkStore &store, fs::path const &source)
+{
+    return MerkleTree::from_directory(source.string(), content_options())
+        .backup_to(store);
+}
+
+void backup_restore_prune()
+{
+    ScratchDir const dir{"chunk_store"};
+    auto const src{dir / "src"};
+    auto const big{random_bytes(1U << 20, 7)};
+    write_bytes(src / "big", big);
+    write_bytes(src / "sub" / "copy", big);
+    write_text(src / "sub" / "small", "small");
+    write_text(src / "empty", "");
+
+    ChunkStore store{dir / "store"};
+    Metrics::reset();
+    CHECK(backup(store, src) == 1);
+    // The copy is the same content, stored once.
+    CHECK(Metrics::get(Counter::bytes_stored) < big.size() + 4096);
+    fs::copy(src, dir / "v1", fs::copy_options::recursive);
+
+    // A few bytes changed in the middle of the big file: only the chunks
+    // around them are new.
+    auto changed{big};
+    std::ranges::fill(std::span{changed}.subspan(500000, 10), 0);
+    write_bytes(src / "big", changed);
+    fs::remove(src / "sub" / "copy");
+    write_text(src / "new", "new");
+    Metrics::reset();
+    CHECK(backup(store, src) == 2);
+    CHECK(Metrics::get(Counter::chunks_reused) != 0);
+    CHECK(Metrics::get(Counter::bytes_stored) < big.size() / 2);
+    CHECK(store.versions() == std::vector<std::uint64_t>{1, 2});
+
+    restore(store, 1, dir / "out");
+    CHECK(same(dir / "v1", dir / "out"));
+
+    // Edited in place since, to the same size and back to the same mtime:
+    // restoring again still puts the version's bytes back.
+    auto const copy{dir / "out" / "sub" / "copy"};
+    auto const mtime{fs::last_write_time(copy)};
+    write_bytes(copy, changed);
+    fs::last_write_time(copy, mtime);
+    restore(store, 1, dir / "out");
+    CHECK(read_text(copy) == read_text(dir / "v1" / "sub" / "copy"));
+    CHECK(same(dir / "v1", dir / "out"));
+
+    // Restoring the newest version over an older one.
+    restore(store, 2, dir / "out");
+    CHECK(same(src, dir / "out"));
+
+    auto const pruned{store.prune(1)};
+    // The old content of the big file goes, and its chunks that the new
+    // one doesn't share.
+    CHECK(pruned.versions == 1);
+    CHECK(pruned.files == 1);
+    CHECK(pruned.chunks != 0);
+    CHECK(store.versions() == std::vector<std::uint64_t>{2});
+    restore(store, 2, dir / "out2");
+    CHECK(same(src, dir / "out2"));
+}
+
+// Only what the store can hold is backed up: a symlink to a directory is
+// that directory, entries without content are left out, never restored as
+// empty files.
+void links_and_entries_without_content()
+{
+    ScratchDir const dir{"chunk_store_links"};
+    auto const src{dir / "src"};
+    write_text(src / "d" / "f", "f");
+    fs::create_directory_symlink("d", src / "dlink");
+    fs::create_symlink("nowhere", src / "dangling");
+    fs::create_directory_symlink(".", src / "self");
+
+    ChunkStore store{dir / "store"};
+    CHECK(backup(store, src) == 1);
+    restore(store, 1, dir / "out");
+    CHECK(fs::is_directory(dir / "out" / "dlink"));
+    CHECK(read_text(dir / "out" / "dlink" / "f") == "f");
+    CHECK(!fs::exists(fs::symlink_status(dir / "out" / "dangling")));
+    CHECK(!fs::exists(fs::symlink_status(dir / "out" / "self")));
+}
+
+// A corrupt chunk fails the restore of its file, which is left as it was.
+void corrupt_chunk()
+{
+    ScratchDir const dir{"chunk_store_corrupt"};
+    auto const big{random_bytes(1U << 20, 9)};
+    write_bytes(dir / "src" / "big", big);
+    ChunkStore store{dir / "store"};
+    backup(store, dir / "src");
+
+    write_text(dir / "out" / "big", "old");
+    for (auto const &entry :
+         fs::recursive_directory_iterator{dir / "store" / "chunks"}) {
+        if (entry.is_regular_file()) {
+            write_text(entry.path(), "corrupt");
+            break;
+        }
+    }
+    bool threw{false};
+    try {
+        restore(store, 1, dir / "out");
+    }
+    catch (std::exception const &) {
+        threw = true;
+    }
+    CHECK(threw);
+    CHECK(read_text(dir / "out" / "big") == "old");
+    CHECK(std::ranges::distance(fs::directory_iterator{dir / "out"}) == 1);
+}
+
+} // namespace
+
+int main()
+{
+    chunk_sizes();
+    cut_points_are_pinned();
+    insertion_moves_nearby_cuts();
+    backup_restore_prune();
+    links_and_entries_without_content();
+    corrupt_chunk();
+    return check_result();
+}
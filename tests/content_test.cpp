@@ -0,0 +1,84 @@
+// Content mode: files are compared by their bytes, even where a file kept
+// its size and mtime.
+#include "tests/check.hpp"
+
+#include <libtree/tree.hpp>
+
+#include <filesystem>
+
+namespace {
+
+namespace fs = std::filesystem;
+
+BuildOptions content_options()
+{
+    BuildOptions options;
+    options.hash_mode = HashMode::content;
+    return options;
+}
+
+// Two files of the same size and mtime, with other bytes.
+void write_twins(ScratchDir const &dir)
+{
+    write_text(dir / "src" / "sub" / "f", "aaaa");
+    write_text(dir / "dst" / "sub" / "f", "bbbb");
+    write_text(dir / "src" / "g", "same");
+    write_text(dir / "dst" / "g", "same");
+    for (auto const *file : {"src/sub/f", "dst/sub/f", "src/g", "dst/g"}) {
+        fs::last_write_time(dir / file, test_mtime);
+    }
+}
+
+void same_size_and_mtime()
+{
+    ScratchDir const dir{"content_twins"};
+    write_twins(dir);
+
+    auto const options{content_options()};
+    auto const src{MerkleTree::from_directory((dir / "src").string(), options)};
+    auto dst{MerkleTree::from_directory((dir / "dst").string(), options)};
+    auto const plan{dst.plan_sync_from(src)};
+    CHECK(plan.modifies.size() == 1);
+    CHECK(!plan.modifies.empty() &&
+          plan.modifies.front().path == fs::path{"sub"} / "f");
+
+    dst.sync_from(src);
+    CHECK(read_text(dir / "dst" / "sub" / "f") == "aaaa");
+    auto again{MerkleTree::from_directory((dir / "dst").string(), options)};
+    CHECK(again.plan_sync_from(src).empty());
+}
+
+// A tree of another directory says nothing about our files: its digests
+// aren't taken for ours, however alike sizes and mtimes are.
+void foreign_reference()
+{
+    ScratchDir const dir{"content_reference"};
+    write_twins(dir);
+
+    auto const options{content_options()};
+    auto const src{MerkleTree::from_directory((dir / "src").string(), options)};
+    auto dest_options{options};
+    dest_options.reference = &src;
+    auto const dst{
+        MerkleTree::from_directory((dir / "dst").string(), dest_options)};
+    CHECK(dst.plan_sync_from(src).modifies.size() == 1);
+
+    // While an earlier scan of the same directory is taken at its word.
+    auto same_options{options};
+    same_options.reference = &dst;
+    Metrics::reset();
+    auto rescanned{
+        MerkleTree::from_directory((dir / "dst").string(), same_options)};
+    CHECK(Metrics::get(Counter::bytes_hashed) == 0);
+    auto fresh{MerkleTree::from_directory((dir / "dst").string(), options)};
+    CHECK(rescanned.isSame(&fresh));
+}
+
+} // namespace
+
+int main()
+{
+    same_size_and_mtime();
+    foreign_reference();
+    return check_result();
+}
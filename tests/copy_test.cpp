@@ -0,0 +1,173 @@
+// Copying files: whole, to several targets at once, many at a time, and in
+// place block by block.
+#include "tests/check.hpp"
+
+#include <libtree/copy_engine.hpp>
+
+#include <array>
+#include <cstddef>
+#include <cstdint>
+#include <exception>
+#include <filesystem>
+#include <format>
+#include <random>
+#include <string>
+#include <vector>
+
+namespace {
+
+namespace fs = std::filesystem;
+
+// The same bytes on every platform: mt19937_64 is fully specified.
+std::string random_text(std::size_t n, std::uint64_t seed)
+{
+    std::mt19937_64 random{seed};
+    std::string text(n, '\0');
+    for (auto &c : text) {
+        c = static_cast<char>(random());
+    }
+    return text;
+}
+
+void whole_file()
+{
+    ScratchDir const dir{"copy_whole"};
+    auto const text{random_text(3U << 20, 1)};
+    write_text(dir / "src", text);
+    fs::last_write_time(dir / "src", test_mtime);
+    // Over a longer file.
+    write_text(dir / "dst", random_text(4U << 20, 2));
+
+    CHECK(transfer_file(dir / "src", dir / "dst") == text.size());
+    CHECK(read_text(dir / "dst") == text);
+    CHECK(fs::last_write_time(dir / "dst") == test_mtime);
+
+    write_text(dir / "empty", "");
+    CHECK(transfer_file(dir / "empty", dir / "dst") == 0);
+    CHECK(fs::file_size(dir / "dst") == 0);
+}
+
+// The source is read once for all of them.
+void several_targets()
+{
+    ScratchDir const dir{"copy_targets"};
+    auto const text{random_text(1U << 20, 3)};
+    write_text(dir / "src", text);
+    fs::last_write_time(dir / "src", test_mtime);
+    write_text(dir / "b", "old");
+
+    std::array<fs::path, 3> const targets{dir / "a", dir / "b", dir / "c"};
+    CHECK(transfer_file(dir / "src", targets) == 3 * text.size());
+    for (auto const &target : targets) {
+        CHECK(read_text(target) == text);
+        CHECK(fs::last_write_time(target) == test_mtime);
+    }
+}
+
+void many_in_flight()
+{
+    ScratchDir const dir{"copy_engine"};
+    std::uint64_t total{};
+    for (int i{}; i != 50; ++i) {
+        auto const text{random_text(static_cast<std::size_t>(i) * 997, i)};
+        write_text(dir / "src" / std::format("f{}", i), text);
+        total += text.size();
+    }
+    fs::create_directory(dir / "dst");
+
+    CopyEngine engine{4};
+    for (int i{}; i != 50; ++i) {
+        auto const name{std::format("f{}", i)};
+        engine.submit(dir / "src" / name, dir / "dst" / name);
+    }
+    // Into several targets, counted for each of them.
+    std::vector<fs::path> targets{dir / "x", dir / "y"};
+    engine.submit(dir / "src" / "f10", targets);
+    engine.wait();
+    CHECK(engine.bytes_written() == total + 2 * 9970);
+    for (int i{}; i != 50; ++i) {
+        auto const name{std::format("f{}", i)};
+        CHECK(read_text(dir / "dst" / name) == read_text(dir / "src" / name));
+    }
+    CHECK(read_text(dir / "y") == read_text(dir / "src" / "f10"));
+
+    // A failed copy is rethrown by `wait`.
+    engine.submit(dir / "src" / "missing", dir / "dst" / "missing");
+    bool threw{false};
+    try {
+        engine.wait();
+    }
+    catch (std::exception const &) {
+        threw = true;
+    }
+    CHECK(threw);
+}
+
+// Only the blocks that differ are written, adjacent ones in one go.
+void delta_blocks()
+{
+    ScratchDir const dir{"copy_delta"};
+    constexpr std::size_t block{4096};
+    auto const old{random_text(64 * block, 4)};
+    auto text{old};
+    text[5 * block + 10] ^= 1;
+    text[6 * block] ^= 1;
+    text[40 * block + block - 1] ^= 1;
+    write_text(dir / "src", text);
+    fs::last_write_time(dir / "src", test_mtime);
+    write_text(dir / "dst", old);
+
+    CHECK(delta_transfer_file(dir / "src", dir / "dst", block) == 3 * block);
+    CHECK(read_text(dir / "dst") == text);
+    CHECK(fs::last_write_time(dir / "dst") == test_mtime);
+
+    // Nothing left to write.
+    CHECK(delta_transfer_file(dir / "src", dir / "dst", block) == 0);
+}
+
+// A longer source writes its tail, a shorter one truncates the target;
+// a last block shorter than the others is compared all the same.
+void delta_sizes()
+{
+    ScratchDir const dir{"copy_delta_sizes"};
+    constexpr std::size_t block{4096};
+    auto const text{random_text(10 * block + 100, 5)};
+
+    write_text(dir / "src", text);
+    write_text(dir / "dst", text.substr(0, 4 * block));
+    CHECK(delta_transfer_file(dir / "src", dir / "dst", block) ==
+          6 * block + 100);
+    CHECK(read_text(dir / "dst") == text);
+
+    write_text(dir / "dst", text + random_text(3 * block, 6));
+    CHECK(delta_transfer_file(dir / "src", dir / "dst", block) == 0);
+    CHECK(read_text(dir / "dst") == text);
+
+    // Cut inside the last block.
+    write_text(dir / "dst", text.substr(0, 10 * block + 50));
+    CHECK(delta_transfer_file(dir / "src", dir / "dst", block) == 100);
+    CHECK(read_text(dir / "dst") == text);
+
+    write_text(dir / "src", "");
+    CHECK(delta_transfer_file(dir / "src", dir / "dst", block) == 0);
+    CHECK(fs::file_size(dir / "dst") == 0);
+
+    // Nothing to update in place: copied whole.
+    write_text(dir / "src", text);
+    fs::remove(dir / "dst");
+    CHECK(delta_transfer_file(dir / "src", dir / "dst", block) ==
+          text.size());
+    CHECK(read_text(dir / "dst") == text);
+}
+
+} // namespace
+
+int main()
+{
+    whole_file();
+    several_targets();
+    many_in_flight();
+    delta_blocks();
+    delta_sizes();
+    return check_result();
+}
@@ -0,0 +1,91 @@
+// Listing and stat'ing entries relative to an open directory.
+#include "tests/check.hpp"
+
+#include <libtree/directory.hpp>
+
+#include <algorithm>
+#include <cstddef>
+#include <filesystem>
+#include <format>
+#include <string>
+#include <vector>
+
+namespace {
+
+namespace fs = std::filesystem;
+
+// More entries than one read of the directory returns, with names that
+// need no quoting and some that do.
+void many_entries()
+{
+    ScratchDir const dir{"directory_many"};
+    std::vector<std::string> names;
+    for (int i{}; i != 3000; ++i) {
+        names.push_back(std::format("file_with_a_rather_long_name_{:04}", i));
+    }
+    for (auto const *name :
+         {"with space", "new\nline", "ünïcödé", "-", ".a"}) {
+        names.emplace_back(name);
+    }
+    for (auto const &name : names) {
+        write_text(dir / name, name);
+    }
+    std::ranges::sort(names);
+
+    DirectoryHandle handle{dir.path()};
+    auto const entries{handle.entries()};
+    CHECK(std::ranges::equal(entries, names, {}, &DirEntry::name));
+    CHECK(std::ranges::all_of(entries, [](DirEntry const &e) {
+        return e.type == FileType::regular || e.type == FileType::unknown;
+    }));
+}
+
+void stat_entries()
+{
+    ScratchDir const dir{"directory_stat"};
+    write_text(dir / "f", "12345");
+    fs::last_write_time(dir / "f", test_mtime);
+    write_text(dir / "sub" / "g", "g");
+    fs::create_symlink("f", dir / "link");
+    fs::create_symlink("missing", dir / "dangling");
+
+    DirectoryHandle handle{dir.path()};
+    auto const f{handle.stat("f")};
+    CHECK(f.type == FileType::regular && f.regular && !f.directory);
+    CHECK(f.size == 5);
+    CHECK(f.mtime == test_mtime.time_since_epoch().count());
+
+    // Through the link, as the file it links to.
+    auto const link{handle.stat("link")};
+    CHECK(link.type == FileType::symlink && link.regular);
+    CHECK(link.size == 5 && link.mtime == f.mtime);
+
+    auto const dangling{handle.stat("dangling")};
+    CHECK(dangling.type == FileType::symlink && !dangling.regular);
+    CHECK(dangling.size == 0 && dangling.mtime == 0);
+
+    auto const sub{handle.stat("sub")};
+    CHECK(sub.type == FileType::directory && sub.directory);
+    CHECK(sub.size == 0);
+
+    auto const gone{handle.stat("gone")};
+    CHECK(gone.type == FileType::unknown && gone.size == 0);
+
+    // Relative to the parent, and below it.
+    DirectoryHandle child{handle, "sub"};
+    auto const entries{child.entries()};
+    CHECK(entries.size() == 1 && entries.front().name == "g");
+    CHECK(child.stat("g").size == 1);
+    if (auto const id{child.identity()}; id && sub.identity) {
+        CHECK(id->inode == sub.identity->inode);
+    }
+}
+
+} // namespace
+
+int main()
+{
+    many_entries();
+    stat_entries();
+    return check_result();
+}
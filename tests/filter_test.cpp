@@ -0,0 +1,150 @@
+// gitignore-style filter rules, matched on their own and applied while
+// scanning.
+#include "tests/check.hpp"
+
+#include <libtree/filter.hpp>
+#include <libtree/tree.hpp>
+
+#include <filesystem>
+#include <stdexcept>
+
+namespace {
+
+namespace fs = std::filesystem;
+
+bool excludes_file(PathFilter const &filter, std::string_view relative)
+{
+    return filter.excludes(relative, false);
+}
+
+void names_at_any_depth()
+{
+    PathFilter const filter{"*.o\n"
+                            "core\n"
+                            "build/\n"
+                            "# a comment\n"
+                            "\n"};
+    CHECK(excludes_file(filter, "a.o"));
+    CHECK(excludes_file(filter, "src/deep/b.o"));
+    CHECK(!excludes_file(filter, "a.oo"));
+    CHECK(excludes_file(filter, "core"));
+    CHECK(excludes_file(filter, "x/core"));
+    CHECK(!excludes_file(filter, "x/core.c"));
+    // Only directories.
+    CHECK(filter.excludes("x/build", true));
+    CHECK(!filter.excludes("x/build", false));
+    CHECK(filter.has_directory_rules());
+    CHECK(filter.rules() == "*.o\ncore\nbuild/\n");
+}
+
+// A leading or inner slash anchors a rule to the root.
+void anchored()
+{
+    PathFilter const filter{"/out\n"
+                            "doc/gen\n"};
+    CHECK(excludes_file(filter, "out"));
+    CHECK(!excludes_file(filter, "x/out"));
+    CHECK(excludes_file(filter, "doc/gen"));
+    CHECK(!excludes_file(filter, "gen"));
+    CHECK(!excludes_file(filter, "x/doc/gen"));
+}
+
+void any_number_of_directories()
+{
+    PathFilter const filter{"src/**/gen\n"
+                            "**/tmp\n"
+                            "logs/**\n"};
+    CHECK(excludes_file(filter, "src/gen"));
+    CHECK(excludes_file(filter, "src/a/gen"));
+    CHECK(excludes_file(filter, "src/a/b/c/gen"));
+    CHECK(!excludes_file(filter, "other/a/gen"));
+    CHECK(!excludes_file(filter, "src/a/gen2"));
+    // "**/name" is "name".
+    CHECK(excludes_file(filter, "tmp"));
+    CHECK(excludes_file(filter, "a/b/tmp"));
+    CHECK(excludes_file(filter, "logs/x"));
+    CHECK(excludes_file(filter, "logs/x/y"));
+}
+
+void wildcards_and_sets()
+{
+    PathFilter const filter{"file[0-9].txt\n"
+                            "[!a-z]*.log\n"
+                            "?.c\n"
+                            "\\#literal\n"};
+    CHECK(excludes_file(filter, "file3.txt"));
+    CHECK(!excludes_file(filter, "filex.txt"));
+    CHECK(!excludes_file(filter, "file10.txt"));
+    CHECK(excludes_file(filter, "Z.log"));
+    CHECK(excludes_file(filter, "9err.log"));
+    CHECK(!excludes_file(filter, "err.log"));
+    CHECK(excludes_file(filter, "a.c"));
+    CHECK(!excludes_file(filter, "ab.c"));
+    CHECK(excludes_file(filter, "#literal"));
+
+    bool threw{false};
+    try {
+        PathFilter{"file[0-9"};
+    }
+    catch (std::invalid_argument const &) {
+        threw = true;
+    }
+    CHECK(threw);
+}
+
+// The last rule that matches decides, whichever of the name, glob and
+// anchored kinds each one is.
+void last_rule_wins()
+{
+    PathFilter const filter{"*.log\n"
+                            "!keep.log\n"
+                            "/keep.log\n"
+                            "!a/*.log\n"};
+    CHECK(excludes_file(filter, "x.log"));
+    CHECK(excludes_file(filter, "keep.log"));
+    CHECK(!excludes_file(filter, "b/keep.log"));
+    CHECK(!excludes_file(filter, "a/x.log"));
+    CHECK(excludes_file(filter, "a/b/x.log"));
+
+    PathFilter const again{"!x\n"
+                           "x\n"};
+    CHECK(excludes_file(again, "x"));
+}
+
+// A scan never enters an excluded directory: nothing below it is included
+// again.
+void scan_prunes()
+{
+    ScratchDir const dir{"filter_scan"};
+    write_text(dir / "src" / "build" / "keep.o", "o");
+    write_text(dir / "src" / "a.o", "o");
+    write_text(dir / "src" / "keep.o", "o");
+    write_text(dir / "src" / "a.c", "c");
+    PathFilter const filter{"build/\n"
+                            "*.o\n"
+                            "!keep.o\n"};
+    BuildOptions options;
+    options.filter = &filter;
+    auto const src{MerkleTree::from_directory((dir / "src").string(), options)};
+
+    fs::create_directory(dir / "dst");
+    auto dst{MerkleTree::empty((dir / "dst").string(), options)};
+    dst.sync_from(src);
+    CHECK(fs::exists(dir / "dst" / "a.c"));
+    CHECK(fs::exists(dir / "dst" / "keep.o"));
+    CHECK(!fs::exists(dir / "dst" / "a.o"));
+    CHECK(!fs::exists(dir / "dst" / "build"));
+}
+
+} // namespace
+
+int main()
+{
+    names_at_any_depth();
+    anchored();
+    any_number_of_directories();
+    wildcards_and_sets();
+    last_rule_wins();
+    scan_prunes();
+    return check_result();
+}
@@ -0,0 +1,126 @@
+// The hash cache: what it keeps across runs, and what it doesn't trust yet.
+#include "tests/check.hpp"
+
+#include <libtree/hash_cache.hpp>
+#include <libtree/tree.hpp>
+
+#include <chrono>
+#include <cstdint>
+#include <filesystem>
+#include <string>
+#include <thread>
+#include <vector>
+
+namespace {
+
+namespace fs = std::filesystem;
+using namespace std::chrono_literals;
+
+std::int64_t nanoseconds_ago(std::chrono::nanoseconds ago)
+{
+    return std::chrono::duration_cast<std::chrono::nanoseconds>(
+               (std::chrono::system_clock::now() - ago).time_since_epoch())
+        .count();
+}
+
+HashCache::FileRecord record_for(FileIdentity const &identity)
+{
+    HashCache::FileRecord record{};
+    record.identity = identity;
+    record.size = identity.size;
+    record.leaf[0] = 1;
+    return record;
+}
+
+// Entries changed less than two seconds before the cache was opened could
+// still change within the same timestamp tick: they aren't recorded. Their
+// ctime counts as much as their mtime.
+void settle_rule()
+{
+    ScratchDir const dir{"hash_cache_settle"};
+    auto const path{dir / "cache"};
+    FileIdentity const settled{1, 1, 10, nanoseconds_ago(3s),
+                               nanoseconds_ago(3s)};
+    FileIdentity const fresh{1, 2, 10, nanoseconds_ago(1s),
+                             nanoseconds_ago(1s)};
+    FileIdentity const touched{1, 3, 10, nanoseconds_ago(3s),
+                               nanoseconds_ago(1s)};
+    std::vector<std::string> const names{"a", "b"};
+    {
+        HashCache cache{path};
+        for (auto const &id : {settled, fresh, touched}) {
+            cache.record_file(record_for(id));
+            cache.record_listing(id, names);
+        }
+        // Records made in this run are for the next one.
+        CHECK(cache.find_file(settled) == nullptr);
+        cache.save(path);
+    }
+
+    HashCache const cache{path};
+    auto const *found{cache.find_file(settled)};
+    CHECK(found != nullptr && found->leaf[0] == 1 && found->size == 10);
+    CHECK(cache.find_listing(settled) == names);
+    for (auto const &id : {fresh, touched}) {
+        CHECK(cache.find_file(id) == nullptr);
+        CHECK(!cache.find_listing(id));
+    }
+    // Another identity, e.g. the file was written since.
+    auto changed{settled};
+    changed.mtime += 1;
+    CHECK(cache.find_file(changed) == nullptr);
+}
+
+// A rescan with the cache of an earlier one reads nothing that didn't
+// change, and comes out the same as a scan without it.
+void rescan()
+{
+    ScratchDir const dir{"hash_cache_rescan"};
+    auto const root{dir / "root"};
+    write_text(root / "a", "aaaa");
+    write_text(root / "sub" / "b", "bbbbbbbb");
+    // Written just now, the files would not be recorded: the ctime can't
+    // be set back.
+    std::this_thread::sleep_for(2100ms);
+
+    auto const path{dir / "cache"};
+    auto scan{[&](HashCache *cache) {
+        BuildOptions options;
+        options.hash_mode = HashMode::content;
+        options.cache = cache;
+        return MerkleTree::from_directory(root.string(), options);
+    }};
+    {
+        HashCache cache{path};
+        Metrics::reset();
+        scan(&cache);
+        CHECK(Metrics::get(Counter::bytes_hashed) == 12);
+        cache.save(path);
+    }
+    {
+        HashCache cache{path};
+        Metrics::reset();
+        auto cached{scan(&cache)};
+        CHECK(Metrics::get(Counter::bytes_hashed) == 0);
+        auto fresh{scan(nullptr)};
+        CHECK(cached.isSame(&fresh));
+        cache.save(path);
+    }
+
+    write_text(root / "sub" / "b", "changed");
+    HashCache cache{path};
+    Metrics::reset();
+    auto cached{scan(&cache)};
+    CHECK(Metrics::get(Counter::bytes_hashed) == 7);
+    auto fresh{scan(nullptr)};
+    CHECK(cached.isSame(&fresh));
+}
+
+} // namespace
+
+int main()
+{
+    settle_rule();
+    rescan();
+    return check_result();
+}
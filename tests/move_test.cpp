@@ -0,0 +1,140 @@
+// Files the destination already has under another name are moved there,
+// not copied again.
+#include "tests/check.hpp"
+
+#include <libtree/tree.hpp>
+
+#include <algorithm>
+#include <filesystem>
+
+namespace {
+
+namespace fs = std::filesystem;
+
+BuildOptions content_options()
+{
+    BuildOptions options;
+    options.hash_mode = HashMode::content;
+    return options;
+}
+
+bool moves(SyncPlan const &plan, fs::path const &from, fs::path const &to)
+{
+    return std::ranges::any_of(plan.moves, [&](SyncPlan::Move const &m) {
+        return m.from == from && m.to == to && !m.copy;
+    });
+}
+
+// Syncs `dir`/dst from `dir`/src, checks that nothing was copied from the
+// source and that the destination is the source now.
+void sync_by_moving(ScratchDir const &dir, SyncPlan const &plan)
+{
+    auto const options{content_options()};
+    auto const src{MerkleTree::from_directory((dir / "src").string(), options)};
+    auto dst{MerkleTree::from_directory((dir / "dst").string(), options)};
+    CHECK(plan.creates.empty() ||
+          std::ranges::all_of(plan.creates, &SyncPlan::Entry::folder));
+    CHECK(plan.modifies.empty());
+    Metrics::reset();
+    dst.sync_from(src);
+    CHECK(Metrics::get(Counter::bytes_copied) == 0);
+    auto const again{
+        MerkleTree::from_directory((dir / "dst").string(), options)};
+    CHECK(again.plan_sync_from(src).empty());
+}
+
+SyncPlan plan(ScratchDir const &dir)
+{
+    auto const options{content_options()};
+    auto const src{MerkleTree::from_directory((dir / "src").string(), options)};
+    auto const dst{
+        MerkleTree::from_directory((dir / "dst").string(), options)};
+    return dst.plan_sync_from(src);
+}
+
+void renamed()
+{
+    ScratchDir const dir{"move_renamed"};
+    write_text(dir / "src" / "new" / "f", "content");
+    write_text(dir / "dst" / "old" / "f", "content");
+    auto const p{plan(dir)};
+    CHECK(p.moves.size() == 1);
+    CHECK(moves(p, fs::path{"old"} / "f", fs::path{"new"} / "f"));
+    sync_by_moving(dir, p);
+    CHECK(read_text(dir / "dst" / "new" / "f") == "content");
+    CHECK(!fs::exists(dir / "dst" / "old"));
+}
+
+// Two files that traded contents: each is moved out of the other's way.
+void swapped()
+{
+    ScratchDir const dir{"move_swapped"};
+    write_text(dir / "src" / "a", "bbbb");
+    write_text(dir / "src" / "b", "aaaa");
+    write_text(dir / "dst" / "a", "aaaa");
+    write_text(dir / "dst" / "b", "bbbb");
+    auto const p{plan(dir)};
+    CHECK(p.moves.size() == 2);
+    CHECK(moves(p, "a", "b"));
+    CHECK(moves(p, "b", "a"));
+    sync_by_moving(dir, p);
+    CHECK(read_text(dir / "dst" / "a") == "bbbb");
+    CHECK(read_text(dir / "dst" / "b") == "aaaa");
+}
+
+// Moved out of a folder that is deleted, before it is.
+void out_of_deleted_folder()
+{
+    ScratchDir const dir{"move_deleted_folder"};
+    write_text(dir / "src" / "kept" / "f", "content");
+    write_text(dir / "dst" / "gone" / "deeper" / "f", "content");
+    write_text(dir / "dst" / "gone" / "other", "other");
+    auto const p{plan(dir)};
+    CHECK(moves(p, fs::path{"gone"} / "deeper" / "f",
+                fs::path{"kept"} / "f"));
+    sync_by_moving(dir, p);
+    CHECK(read_text(dir / "dst" / "kept" / "f") == "content");
+    CHECK(!fs::exists(dir / "dst" / "gone"));
+}
+
+// The content wanted twice: moved once, then copied within the
+// destination.
+void wanted_twice()
+{
+    ScratchDir const dir{"move_twice"};
+    write_text(dir / "src" / "a", "content");
+    write_text(dir / "src" / "b", "content");
+    write_text(dir / "dst" / "old", "content");
+    auto const p{plan(dir)};
+    CHECK(p.moves.size() == 2);
+    CHECK(std::ranges::count(p.moves, true, &SyncPlan::Move::copy) == 1);
+    sync_by_moving(dir, p);
+    CHECK(read_text(dir / "dst" / "a") == "content");
+    CHECK(read_text(dir / "dst" / "b") == "content");
+    CHECK(!fs::exists(dir / "dst" / "old"));
+}
+
+// Matching is by content: mtime mode has no content to match.
+void not_in_mtime_mode()
+{
+    ScratchDir const dir{"move_mtime"};
+    write_text(dir / "src" / "new", "content");
+    write_text(dir / "dst" / "old", "content");
+    auto const src{MerkleTree::from_directory((dir / "src").string())};
+    auto const dst{MerkleTree::from_directory((dir / "dst").string())};
+    auto const p{dst.plan_sync_from(src)};
+    CHECK(p.moves.empty());
+    CHECK(p.creates.size() == 1);
+}
+
+} // namespace
+
+int main()
+{
+    renamed();
+    swapped();
+    out_of_deleted_folder();
+    wanted_twice();
+    not_in_mtime_mode();
+    return check_result();
+}
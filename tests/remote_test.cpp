@@ -0,0 +1,341 @@
+// The remote protocol: its framing, and syncing from a tree served on the
+// other end of a socket.
+#include "tests/check.hpp"
+
+#include <libtree/remote.hpp>
+#include <libtree/tree.hpp>
+
+#include <algorithm>
+#include <array>
+#include <cstdint>
+#include <filesystem>
+#include <format>
+#include <span>
+#include <stdexcept>
+#include <string>
+#include <thread>
+#include <vector>
+
+#if !defined(_WIN32)
+#include <csignal>
+#include <sys/socket.h>
+#include <unistd.h>
+#endif
+
+namespace {
+
+namespace fs = std::filesystem;
+
+void wire_round_trip()
+{
+    Digest digest{};
+    digest[0] = 1;
+    digest[31] = 2;
+    WireWriter out;
+    out.u8(7);
+    out.u32(0xDEADBEEF);
+    out.u64(1ULL << 40);
+    out.i64(-5);
+    out.string("name");
+    out.digest(digest);
+
+    WireReader in{out.data()};
+    CHECK(in.u8() == 7);
+    CHECK(in.u32() == 0xDEADBEEF);
+    CHECK(in.u64() == 1ULL << 40);
+    CHECK(in.i64() == -5);
+    CHECK(in.string() == "name");
+    CHECK(in.digest() == digest);
+    CHECK(in.at_end());
+
+    // Little endian, whatever the host.
+    WireWriter word;
+    word.u32(0x01020304);
+    CHECK(std::ranges::equal(word.data(),
+                             std::array<unsigned char, 4>{4, 3, 2, 1}));
+
+    bool threw{false};
+    try {
+        in.u8();
+    }
+    catch (std::runtime_error const &) {
+        threw = true;
+    }
+    CHECK(threw);
+}
+
+#if !defined(_WIN32)
+
+std::array<int, 2> socket_pair()
+{
+    std::array<int, 2> fds{};
+    if (::socketpair(AF_UNIX, SOCK_STREAM, 0, fds.data()) != 0) {
+        throw std::runtime_error{"can't create a socket pair"};
+    }
+    return fds;
+}
+
+// Whether receiving from `channel` throws.
+bool receive_throws(Channel &channel)
+{
+    std::vector<unsigned char> payload;
+    try {
+        channel.next(payload);
+    }
+    catch (std::runtime_error const &) {
+        return true;
+    }
+    return false;
+}
+
+void framing()
+{
+    auto const fds{socket_pair()};
+    Channel a{fds[0], fds[0]};
+    Channel b{fds[1], fds[1]};
+
+    WireWriter out;
+    out.string("payload");
+    a.send(Message::list, out);
+    a.send(Message::done);
+    a.flush();
+    Message type{};
+    std::vector<unsigned char> payload;
+    CHECK(b.receive(type, payload) && type == Message::list);
+    CHECK(WireReader{payload}.string() == "payload");
+    CHECK(b.receive(type, payload) && type == Message::done &&
+          payload.empty());
+
+    // An error from the other side is thrown, with what it said.
+    out.clear();
+    out.string("no such folder");
+    a.send(Message::error, out);
+    a.flush();
+    try {
+        b.next(payload);
+        CHECK(false);
+    }
+    catch (std::runtime_error const &e) {
+        CHECK(std::string{e.what()} == "remote: no such folder");
+    }
+}
+
+// Writes `bytes` raw to a fresh socket, closes it, and says whether
+// receiving a message from the other end throws.
+bool corrupt_stream_throws(std::span<unsigned char const> bytes)
+{
+    auto const fds{socket_pair()};
+    Channel channel{fds[1], fds[1]};
+    CHECK(::write(fds[0], bytes.data(), bytes.size()) ==
+          static_cast<::ssize_t>(bytes.size()));
+    ::close(fds[0]);
+    return receive_throws(channel);
+}
+
+void corrupt_frames()
+{
+    // A type past the last one.
+    CHECK(corrupt_stream_throws(std::array<unsigned char, 5>{0, 0, 0, 0, 99}));
+    // Longer than a frame can be.
+    CHECK(corrupt_stream_throws(
+        std::array<unsigned char, 5>{0, 0, 0, 0x80, 0}));
+    // The stream ends inside the header, and inside the payload.
+    CHECK(corrupt_stream_throws(std::array<unsigned char, 3>{4, 0, 0}));
+    CHECK(corrupt_stream_throws(
+        std::array<unsigned char, 7>{4, 0, 0, 0, 1, 'a', 'b'}));
+
+    // Ending between messages is a clean end.
+    auto const fds{socket_pair()};
+    Channel channel{fds[1], fds[1]};
+    ::close(fds[0]);
+    Message type{};
+    std::vector<unsigned char> payload;
+    CHECK(!channel.receive(type, payload));
+}
+
+// Serves `src` on one end of a socket pair while `receive` is given the
+// other, opened as a session.
+template <typename F> void with_served(MerkleTree const &src, F receive)
+{
+    auto const fds{socket_pair()};
+    std::jthread const server{[&src, fd{fds[0]}] {
+        Channel channel{fd, fd};
+        try {
+            src.serve(channel);
+        }
+        catch (std::exception const &) {
+            // The receiver gave up.
+        }
+    }};
+    Channel channel{fds[1], fds[1]};
+    auto const mode{static_cast<std::uint8_t>(HashMode::content)};
+    auto const served{
+        open_session(channel, MerkleTree::hash_algorithm, mode)};
+    receive(channel, served);
+}
+
+// Answers a receiver like a sender would, with a root holding one file of
+// one byte named `name`.
+void serve_listing(int fd, std::string const &name)
+{
+    Channel channel{fd, fd};
+    std::vector<unsigned char> payload;
+    try {
+        channel.expect(Message::hello, payload);
+        Digest hash{};
+        hash[0] = 1;
+        WireWriter out;
+        out.u32(protocol_version);
+        out.u32(MerkleTree::hash_algorithm);
+        out.u8(static_cast<std::uint8_t>(HashMode::content));
+        out.u32(0);
+        out.digest(hash);
+        out.string("/remote");
+        out.string("");
+        channel.send(Message::hello, out);
+
+        channel.expect(Message::list, payload);
+        out.clear();
+        out.u32(1);
+        out.u32(1);
+        out.string(name);
+        out.u8(static_cast<std::uint8_t>(FileType::regular));
+        out.u8(0);
+        out.u64(1);
+        out.i64(0);
+        out.u32(1);
+        out.digest(hash);
+        channel.send(Message::listing, out);
+        Message type{};
+        while (channel.receive(type, payload) && type == Message::fetch) {
+            out.clear();
+            out.u32(1);
+            channel.send(Message::file, out);
+            std::array<unsigned char, 1> const data{'x'};
+            channel.send(Message::data, data);
+            channel.send(Message::file_end);
+        }
+    }
+    catch (std::exception const &) {
+        // The receiver gave up.
+    }
+}
+
+BuildOptions content_options()
+{
+    BuildOptions options;
+    options.hash_mode = HashMode::content;
+    return options;
+}
+
+// A served tree that was refreshed has free slots among its nodes: ids past
+// the number of nodes in use are still good ones.
+void sync_refreshed_tree()
+{
+    ScratchDir const dir{"remote_refreshed"};
+    for (int i{}; i != 10; ++i) {
+        write_text(dir / "src" / "a" / std::format("f{}", i), "a");
+    }
+    write_text(dir / "src" / "b" / "x", "x");
+    auto src{
+        MerkleTree::from_directory((dir / "src").string(), content_options())};
+    fs::remove_all(dir / "src" / "a");
+    std::vector<fs::path> const root{""};
+    src.refresh(root);
+
+    fs::create_directory(dir / "dst");
+    auto dst{MerkleTree::empty((dir / "dst").string(), content_options())};
+    with_served(src, [&](Channel &channel, ServedTree const &served) {
+        dst.sync_from(channel, served);
+    });
+    CHECK(read_text(dir / "dst" / "b" / "x") == "x");
+    CHECK(!fs::exists(dir / "dst" / "a"));
+}
+
+// A file that changed on the sender since it was listed doesn't match what
+// was listed: it isn't put in place, and what was there stays.
+void file_changed_since_listed()
+{
+    ScratchDir const dir{"remote_changed"};
+    write_text(dir / "src" / "f", "new");
+    write_text(dir / "dst" / "f", "old");
+    auto const src{
+        MerkleTree::from_directory((dir / "src").string(), content_options())};
+    write_text(dir / "src" / "f", "changed since");
+
+    auto dst{
+        MerkleTree::from_directory((dir / "dst").string(), content_options())};
+    bool threw{false};
+    with_served(src, [&](Channel &channel, ServedTree const &served) {
+        try {
+            dst.sync_from(channel, served);
+        }
+        catch (std::runtime_error const &) {
+            threw = true;
+        }
+    });
+    CHECK(threw);
+    CHECK(read_text(dir / "dst" / "f") == "old");
+    CHECK(std::ranges::distance(fs::directory_iterator{dir / "dst"}) == 1);
+}
+
+// Names from the other side are single path components: a listing that
+// would lead out of the destination is refused before anything is written.
+void names_are_checked()
+{
+    ScratchDir const good{"remote_good_name"};
+    fs::create_directory(good / "dst");
+    auto dst{MerkleTree::empty((good / "dst").string(), content_options())};
+    auto const fds{socket_pair()};
+    std::jthread const server{serve_listing, fds[0], "f"};
+    {
+        Channel channel{fds[1], fds[1]};
+        auto const mode{static_cast<std::uint8_t>(HashMode::content)};
+        dst.sync_from(channel,
+                      open_session(channel, MerkleTree::hash_algorithm, mode));
+    }
+    CHECK(read_text(good / "dst" / "f") == "x");
+
+    std::array<std::string, 6> const names{
+        "..", ".", "", "a/b", "../up", std::string{"a\0b", 3}};
+    for (auto const &name : names) {
+        ScratchDir const dir{"remote_names"};
+        fs::create_directory(dir / "dst");
+        auto dst{MerkleTree::empty((dir / "dst").string(), content_options())};
+        auto const fds{socket_pair()};
+        std::jthread const server{serve_listing, fds[0], name};
+        Channel channel{fds[1], fds[1]};
+        bool threw{false};
+        try {
+            auto const mode{static_cast<std::uint8_t>(HashMode::content)};
+            auto const served{
+                open_session(channel, MerkleTree::hash_algorithm, mode)};
+            dst.sync_from(channel, served);
+        }
+        catch (std::runtime_error const &) {
+            threw = true;
+        }
+        CHECK(threw);
+        CHECK(fs::is_empty(dir / "dst"));
+        CHECK(std::ranges::distance(fs::directory_iterator{dir.path()}) == 1);
+    }
+}
+
+#endif
+
+} // namespace
+
+int main()
+{
+    wire_round_trip();
+#if !defined(_WIN32)
+    // A receiver that gives up closes the socket under the sender.
+    std::signal(SIGPIPE, SIG_IGN);
+    framing();
+    corrupt_frames();
+    names_are_checked();
+    sync_refreshed_tree();
+    file_changed_since_listed();
+#endif
+    return check_result();
+}
@@ -0,0 +1,93 @@
+// Snapshots streamed to disk while scanning hold the same tree as a scan
+// written out whole.
+#include "tests/check.hpp"
+
+#include <libtree/filter.hpp>
+#include <libtree/tree.hpp>
+
+#include <cstddef>
+#include <filesystem>
+#include <format>
+#include <string>
+
+namespace {
+
+namespace fs = std::filesystem;
+
+// Wide and deep enough that folders are written out long before the scan
+// is done, with empty folders and files among them.
+void make_tree(fs::path const &root)
+{
+    for (int i{}; i != 30; ++i) {
+        auto dir{root / std::format("d{}", i)};
+        for (int depth{}; depth != i % 5; ++depth) {
+            dir /= std::format("sub{}", depth);
+            for (int f{}; f != 20; ++f) {
+                write_text(dir / std::format("f{}.txt", f),
+                           std::string(static_cast<std::size_t>(i + f), 'x'));
+                write_text(dir / std::format("f{}.o", f), "o");
+            }
+        }
+        fs::create_directories(dir / "empty");
+    }
+    write_text(root / "top", "top");
+}
+
+// Compares the snapshot `save_directory` streams with what `writeTree`
+// writes for a scan: both are read back, and written out again, byte for
+// byte the same.
+void same_as_written(ScratchDir const &dir, BuildOptions const &options)
+{
+    auto const root{(dir / "root").string()};
+    auto const streamed{(dir / "streamed.snap").string()};
+    auto const written{(dir / "written.snap").string()};
+    MerkleTree::save_directory(root, streamed, options);
+    auto scanned{MerkleTree::from_directory(root, options)};
+    scanned.writeTree(written);
+
+    auto fromStreamed{MerkleTree::from_file(streamed)};
+    auto fromWritten{MerkleTree::from_file(written)};
+    CHECK(fromStreamed.plan_sync_from(fromWritten).empty());
+    CHECK(fromStreamed.isSame(&scanned));
+
+    auto const again{(dir / "again.snap").string()};
+    fromStreamed.writeTree(again);
+    CHECK(read_text(again) == read_text(written));
+    CHECK(fromStreamed.filter().rules() == scanned.filter().rules());
+}
+
+void streamed_save()
+{
+    ScratchDir const dir{"save_streamed"};
+    make_tree(dir / "root");
+
+    BuildOptions options;
+    same_as_written(dir, options);
+    options.jobs = 4;
+    same_as_written(dir, options);
+    options.hash_mode = HashMode::content;
+    same_as_written(dir, options);
+
+    PathFilter const filter{"*.o\n"
+                            "sub3/\n"};
+    options.filter = &filter;
+    same_as_written(dir, options);
+    options.jobs = 1;
+    same_as_written(dir, options);
+}
+
+void empty_directory()
+{
+    ScratchDir const dir{"save_empty"};
+    fs::create_directory(dir / "root");
+    same_as_written(dir, {});
+}
+
+} // namespace
+
+int main()
+{
+    streamed_save();
+    empty_directory();
+    return check_result();
+}
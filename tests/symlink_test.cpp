@@ -0,0 +1,107 @@
+// Symlinks stand for what they link to: files are compared and copied by
+// their content, directories scanned and copied as directories, as long as
+// they don't lead back up the tree.
+#include "tests/check.hpp"
+
+#include <libtree/copy_engine.hpp>
+#include <libtree/tree.hpp>
+
+#include <algorithm>
+#include <filesystem>
+#include <stdexcept>
+
+namespace {
+
+namespace fs = std::filesystem;
+
+bool creates(SyncPlan const &plan, fs::path const &path, bool folder)
+{
+    return std::ranges::any_of(plan.creates, [&](SyncPlan::Entry const &e) {
+        return e.path == path && e.folder == folder;
+    });
+}
+
+void links_to_directories()
+{
+    ScratchDir const dir{"symlink_directories"};
+    write_text(dir / "src" / "d" / "f", "f");
+    write_text(dir / "src" / "g", "g");
+    fs::create_directory_symlink("d", dir / "src" / "dlink");
+    fs::create_symlink("g", dir / "src" / "glink");
+
+    auto const src{MerkleTree::from_directory((dir / "src").string())};
+    fs::create_directory(dir / "dst");
+    auto dst{MerkleTree::empty((dir / "dst").string())};
+    auto const plan{dst.plan_sync_from(src)};
+    CHECK(creates(plan, "dlink", true));
+    CHECK(creates(plan, fs::path{"dlink"} / "f", false));
+    CHECK(creates(plan, "glink", false));
+
+    dst.sync_from(src);
+    CHECK(fs::is_directory(dir / "dst" / "dlink") &&
+          !fs::is_symlink(dir / "dst" / "dlink"));
+    CHECK(read_text(dir / "dst" / "dlink" / "f") == "f");
+    CHECK(read_text(dir / "dst" / "glink") == "g");
+    auto const again{MerkleTree::from_directory((dir / "dst").string())};
+    CHECK(again.plan_sync_from(src).empty());
+
+    // Streamed to a snapshot the same.
+    auto const snap{(dir / "src.snap").string()};
+    MerkleTree::save_directory((dir / "src").string(), snap);
+    auto streamed{MerkleTree::from_file(snap)};
+    auto scanned{MerkleTree::from_directory((dir / "src").string())};
+    CHECK(streamed.isSame(&scanned));
+}
+
+// Links to the directory they are in, or above it, aren't followed: the
+// scan ends, and the link is a leaf that can't be copied.
+void links_that_loop()
+{
+    ScratchDir const dir{"symlink_loops"};
+    write_text(dir / "src" / "a" / "f", "f");
+    fs::create_directory_symlink(".", dir / "src" / "self");
+    fs::create_directory_symlink("..", dir / "src" / "a" / "up");
+
+    auto const src{MerkleTree::from_directory((dir / "src").string())};
+    fs::create_directory(dir / "dst");
+    auto dst{MerkleTree::empty((dir / "dst").string())};
+    auto const plan{dst.plan_sync_from(src)};
+    CHECK(plan.creates.size() == 4);
+    CHECK(creates(plan, "self", false));
+    CHECK(creates(plan, fs::path{"a"} / "up", false));
+
+    bool threw{false};
+    try {
+        dst.sync_from(src);
+    }
+    catch (std::exception const &) {
+        threw = true;
+    }
+    CHECK(threw);
+}
+
+// Nothing but files is copied: a directory isn't half copied.
+void copy_only_files()
+{
+    ScratchDir const dir{"symlink_copy"};
+    fs::create_directory(dir / "d");
+    bool threw{false};
+    try {
+        transfer_file(dir / "d", dir / "copy");
+    }
+    catch (fs::filesystem_error const &) {
+        threw = true;
+    }
+    CHECK(threw);
+    CHECK(!fs::exists(dir / "copy"));
+}
+
+} // namespace
+
+int main()
+{
+    links_to_directories();
+    links_that_loop();
+    copy_only_files();
+    return check_result();
+}
@@ -0,0 +1,263 @@
+// Syncing and diffing against directories and snapshots, snapshots read
+// lazily with nested folders among them, and to several destinations at
+// once.
+#include "tests/check.hpp"
+
+#include <libtree/tree.hpp>
+
+#include <chrono>
+#include <cstdint>
+#include <filesystem>
+#include <format>
+#include <span>
+#include <string>
+#include <vector>
+
+namespace {
+
+namespace fs = std::filesystem;
+using namespace std::chrono_literals;
+
+// Writes a few levels of folders with files of known sizes below `root`.
+// Returns the number of bytes written.
+std::uint64_t make_nested(fs::path const &root)
+{
+    std::uint64_t bytes{};
+    for (int i{}; i != 4; ++i) {
+        auto dir{root};
+        for (int depth{}; depth != 4; ++depth) {
+            dir /= std::format("d{}_{}", i, depth);
+            for (int f{}; f != 8; ++f) {
+                std::string const text(static_cast<std::size_t>(f * 10 + i),
+                                       'x');
+                write_text(dir / std::format("f{}", f), text);
+                fs::last_write_time(dir / std::format("f{}", f), test_mtime);
+                bytes += text.size();
+            }
+        }
+    }
+    write_text(root / "top", "top");
+    fs::last_write_time(root / "top", test_mtime);
+    return bytes + 3;
+}
+
+bool same(fs::path const &a, fs::path const &b)
+{
+    auto ta{MerkleTree::from_directory(a.string())};
+    auto tb{MerkleTree::from_directory(b.string())};
+    return ta.isSame(&tb);
+}
+
+// A snapshot is read lazily: its folders are only loaded as a sync walks
+// into them, which grows the arena under the walk.
+void sync_from_nested_snapshot()
+{
+    ScratchDir const dir{"sync_snapshot"};
+    auto const bytes{make_nested(dir / "src")};
+    auto const snap{(dir / "src.snap").string()};
+    MerkleTree::from_directory((dir / "src").string()).writeTree(snap);
+
+    fs::create_directory(dir / "dst");
+    auto const src{MerkleTree::from_file(snap)};
+    auto dst{MerkleTree::empty((dir / "dst").string())};
+    auto const plan{dst.plan_sync_from(src)};
+    CHECK(plan.deletes.empty() && plan.modifies.empty());
+    CHECK(plan.creates.size() == 4 * 4 + 4 * 4 * 8 + 1);
+    CHECK(plan.create_bytes == bytes);
+
+    dst.sync_from(MerkleTree::from_file(snap));
+    CHECK(same(dir / "src", dir / "dst"));
+}
+
+// Diffing a directory against an older snapshot of it, from which a whole
+// nested folder has gone since.
+void diff_with_snapshot()
+{
+    ScratchDir const dir{"diff_snapshot"};
+    make_nested(dir / "src");
+    auto const snap{(dir / "old.snap").string()};
+    MerkleTree::from_directory((dir / "src").string()).writeTree(snap);
+
+    auto const gone{dir / "src" / "d1_0" / "d1_1"};
+    std::uint64_t gone_bytes{};
+    for (auto const &entry : fs::recursive_directory_iterator{gone}) {
+        if (entry.is_regular_file()) {
+            gone_bytes += entry.file_size();
+        }
+    }
+    fs::remove_all(gone);
+
+    auto const src{MerkleTree::from_directory((dir / "src").string())};
+    auto const old{MerkleTree::from_file(snap)};
+    auto const plan{old.plan_sync_from(src)};
+    CHECK(plan.deletes.size() == 1);
+    CHECK(!plan.deletes.empty() &&
+          plan.deletes.front().path == fs::path{"d1_0"} / "d1_1");
+    CHECK(plan.delete_bytes == gone_bytes);
+    CHECK(plan.creates.empty() && plan.modifies.empty());
+
+    // And nothing between a snapshot and the directory it was taken of.
+    auto const again{(dir / "new.snap").string()};
+    src.writeTree(again);
+    CHECK(MerkleTree::from_file(again).plan_sync_from(src).empty());
+}
+
+// Between directories: a file added, one removed, one changed.
+void sync_directories()
+{
+    ScratchDir const dir{"sync_directories"};
+    make_nested(dir / "src");
+    make_nested(dir / "dst");
+    write_text(dir / "src" / "d0_0" / "new", "new");
+    fs::remove(dir / "src" / "d2_0" / "f3");
+    write_text(dir / "src" / "d3_0" / "d3_1" / "f1", "changed");
+
+    auto const src{MerkleTree::from_directory((dir / "src").string())};
+    auto dst{MerkleTree::from_directory((dir / "dst").string())};
+    auto const plan{dst.plan_sync_from(src)};
+    CHECK(plan.creates.size() == 1);
+    CHECK(plan.deletes.size() == 1);
+    CHECK(plan.modifies.size() == 1);
+
+    dst.sync_from(src);
+    CHECK(same(dir / "src", dir / "dst"));
+    CHECK(read_text(dir / "dst" / "d3_0" / "d3_1" / "f1") == "changed");
+    CHECK(dst.plan_sync_from(src).empty());
+}
+
+// Children are compared in one pass over both sorted lists: names only one
+// side has, interleaved with shared ones, and entries whose type changed.
+void interleaved_names()
+{
+    ScratchDir const dir{"sync_interleaved"};
+    for (auto const *name : {"A", "b", "c", "e", "g", "z"}) {
+        write_text(dir / "src" / name, name);
+    }
+    for (auto const *name : {"B", "a", "c", "d", "f", "g"}) {
+        write_text(dir / "dst" / name, name);
+    }
+    write_text(dir / "src" / "was_file" / "now_in_dir", "x");
+    write_text(dir / "dst" / "was_file", "file");
+    write_text(dir / "src" / "was_dir", "file");
+    write_text(dir / "dst" / "was_dir" / "inside", "x");
+    for (auto const *file : {"src/c", "dst/c", "src/g", "dst/g"}) {
+        fs::last_write_time(dir / file, test_mtime);
+    }
+
+    auto const src{MerkleTree::from_directory((dir / "src").string())};
+    auto dst{MerkleTree::from_directory((dir / "dst").string())};
+    auto const plan{dst.plan_sync_from(src)};
+    // A, b, e, z, was_file/, was_file/now_in_dir, was_dir.
+    CHECK(plan.creates.size() == 7);
+    // B, a, d, f, was_file, was_dir/.
+    CHECK(plan.deletes.size() == 6);
+    CHECK(plan.modifies.empty());
+
+    dst.sync_from(src);
+    CHECK(same(dir / "src", dir / "dst"));
+    CHECK(fs::is_directory(dir / "dst" / "was_file"));
+    CHECK(read_text(dir / "dst" / "was_dir") == "file");
+}
+
+std::vector<fs::path> paths(std::span<SyncPlan::Entry const> entries)
+{
+    std::vector<fs::path> result;
+    for (auto const &e : entries) {
+        result.push_back(e.path);
+    }
+    return result;
+}
+
+// Folders large enough are planned as tasks of their own: the plan comes
+// out the same, in the same order, and applying it with several I/O jobs
+// gives the same result.
+void in_parallel()
+{
+    ScratchDir const dir{"sync_parallel"};
+    for (int d{}; d != 3; ++d) {
+        for (int f{}; f != 2500; ++f) {
+            auto const name{fs::path{std::format("d{}", d)} /
+                            std::format("s{}", f % 4) / std::format("f{}", f)};
+            write_text(dir / "src" / name, "src");
+            fs::last_write_time(dir / "src" / name, test_mtime);
+            if (f % 7 != 0) {
+                bool const outdated{f % 5 == 0};
+                write_text(dir / "dst" / name, outdated ? "old" : "src");
+                fs::last_write_time(dir / "dst" / name,
+                                    outdated ? test_mtime - 1h : test_mtime);
+            }
+            if (f % 11 == 0) {
+                write_text(dir / "dst" / name.parent_path() /
+                               std::format("gone{}", f),
+                           "gone");
+            }
+        }
+    }
+
+    auto const src{MerkleTree::from_directory((dir / "src").string())};
+    auto dst{MerkleTree::from_directory((dir / "dst").string())};
+    auto const serial{dst.plan_sync_from(src)};
+    auto const parallel{dst.plan_sync_from(src, 4)};
+    CHECK(!serial.creates.empty() && !serial.deletes.empty() &&
+          !serial.modifies.empty());
+    CHECK(paths(parallel.creates) == paths(serial.creates));
+    CHECK(paths(parallel.deletes) == paths(serial.deletes));
+    CHECK(paths(parallel.modifies) == paths(serial.modifies));
+    CHECK(parallel.create_bytes == serial.create_bytes);
+
+    SyncOptions options;
+    options.jobs = 4;
+    options.io_jobs = 8;
+    dst.sync_from(src, options);
+    CHECK(same(dir / "src", dir / "dst"));
+    CHECK(dst.plan_sync_from(src, 4).empty());
+}
+
+// One source to several destinations, each in its own state: every one of
+// them gets what its own plan says, a file wanted by several is copied to
+// all of them in one go, and what a destination already has isn't written.
+void sync_several()
+{
+    ScratchDir const dir{"sync_several"};
+    auto const bytes{make_nested(dir / "src")};
+    fs::create_directory(dir / "empty");
+    make_nested(dir / "behind");
+    write_text(dir / "behind" / "top", "old!");
+    make_nested(dir / "extra");
+    write_text(dir / "extra" / "d1_0" / "extra", "extra");
+    auto const kept{dir / "behind" / "d0_0" / "f1"};
+    auto const keptTime{fs::last_write_time(kept)};
+    write_text(kept, std::string(10, 'y'));
+    fs::last_write_time(kept, keptTime);
+
+    auto const src{MerkleTree::from_directory((dir / "src").string())};
+    std::vector<MerkleTree> dests;
+    for (auto const *name : {"empty", "behind", "extra"}) {
+        dests.push_back(MerkleTree::from_directory((dir / name).string()));
+    }
+    Metrics::reset();
+    auto const written{MerkleTree::sync_all(dests, src)};
+    CHECK(written == bytes + 3);
+    CHECK(Metrics::get(Counter::files_copied) == 4 * 4 * 8 + 1 + 1);
+    for (auto const *name : {"empty", "behind", "extra"}) {
+        CHECK(same(dir / "src", dir / name));
+    }
+    // Same size and mtime: not written over.
+    CHECK(read_text(kept) == std::string(10, 'y'));
+    for (auto const &dest : dests) {
+        CHECK(dest.plan_sync_from(src).empty());
+    }
+}
+
+} // namespace
+
+int main()
+{
+    sync_from_nested_snapshot();
+    diff_with_snapshot();
+    sync_directories();
+    interleaved_names();
+    in_parallel();
+    sync_several();
+    return check_result();
+}
@@ -0,0 +1,88 @@
+// Refreshing a tree from what a DirectoryWatcher reports.
+#include "tests/check.hpp"
+
+#include <libtree/tree.hpp>
+#include <libtree/watcher.hpp>
+
+#include <algorithm>
+#include <chrono>
+#include <filesystem>
+#include <vector>
+
+namespace {
+
+namespace fs = std::filesystem;
+
+#if defined(__linux__)
+
+using namespace std::chrono_literals;
+
+bool same_as_scanned(MerkleTree &tree, fs::path const &dir)
+{
+    auto scanned{MerkleTree::from_directory(dir.string())};
+    return tree.isSame(&scanned);
+}
+
+// A directory moved in over one of the same name is another directory,
+// though nothing changed inside it since.
+void directory_moved_in()
+{
+    ScratchDir const dir{"watch_moved_in"};
+    auto const root{dir / "root"};
+    write_text(root / "sub" / "old", "old");
+    write_text(dir / "other" / "new", "new");
+
+    DirectoryWatcher watcher{root};
+    auto tree{MerkleTree::from_directory(root.string())};
+    fs::remove_all(root / "sub");
+    fs::rename(dir / "other", root / "sub");
+    auto const changes{watcher.wait(50ms)};
+    CHECK(std::ranges::binary_search(changes.replaced, fs::path{"sub"}));
+    CHECK(!changes.root_gone);
+
+    tree.refresh(changes.dirs, changes.replaced);
+    CHECK(same_as_scanned(tree, root));
+}
+
+// Created again under the same name, and filled in.
+void directory_created_again()
+{
+    ScratchDir const dir{"watch_created"};
+    auto const root{dir / "root"};
+    write_text(root / "sub" / "f", "old");
+
+    DirectoryWatcher watcher{root};
+    auto tree{MerkleTree::from_directory(root.string())};
+    fs::remove_all(root / "sub");
+    write_text(root / "sub" / "g", "new");
+    auto const changes{watcher.wait(50ms)};
+    tree.refresh(changes.dirs, changes.replaced);
+    CHECK(same_as_scanned(tree, root));
+}
+
+void root_removed()
+{
+    ScratchDir const dir{"watch_root"};
+    write_text(dir / "root" / "f", "f");
+    DirectoryWatcher watcher{dir / "root"};
+    fs::rename(dir / "root", dir / "moved");
+    CHECK(watcher.wait(50ms).root_gone);
+
+    DirectoryWatcher again{dir / "moved"};
+    fs::remove_all(dir / "moved");
+    CHECK(again.wait(50ms).root_gone);
+}
+
+#endif
+
+} // namespace
+
+int main()
+{
+#if defined(__linux__)
+    directory_moved_in();
+    directory_created_again();
+    root_removed();
+#endif
+    return check_result();
+}
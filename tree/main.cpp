@@ -1,8 +1,27 @@
+#include <algorithm>
+#include <charconv>
+#include <chrono>
+#include <csignal>
+#include <cstddef>
 #include <cstdlib>
 #include <filesystem>
+#include <format>
+#include <fstream>
+#include <iostream>
+#include <libtree/chunk_store.hpp>
+#include <libtree/filter.hpp>
+#include <libtree/metrics.hpp>
 #include <libtree/print.hpp>
+#include <libtree/remote.hpp>
 #include <libtree/tree.hpp>
+#include <libtree/watcher.hpp>
+#include <optional>
+#include <stdexcept>
+#include <sstream>
+#include <string>
 #include <string_view>
+#include <thread>
+#include <vector>
 
 int main(int argc, char **argv)
 {
@@ -17,16 +36,80 @@ int main(int argc, char **argv)
     std::span args{argv, static_cast<std::size_t>(argc)};
     auto it{args.begin()};
     auto next_arg{[&it]() { return *it++; }};
+    // Whether the command has its `n` arguments, not counting optional ones.
+    auto has_args{[&it, &args](std::ptrdiff_t n) {
+        return args.end() - it >= n;
+    }};
 
     auto show_usage = [program_path{next_arg()}]() {
-        errorln("Usage: {} <command> args...", program_path);
+        errorln("Usage: {} [options] <command> args...", program_path);
         errorln("commands:");
         errorln("    sync   Synchronizes source to destination dir. If source "
                 "is a file, the program reads dir info from it. If destination "
-                "doesn't exist, it will be created");
-        errorln("        args: <source> <dest-dir>");
-        errorln("    save   Saves a directory info to file");
+                "doesn't exist, it will be created. A source of 'fd:N' or "
+                "'exec:COMMAND' is a tree served by 'serve' on file "
+                "descriptor N or on the stdin and stdout of COMMAND, e.g. "
+                "'exec:ssh host tree serve /data'. Several destinations "
+                "share one scan of the source, and each file is read once "
+                "for all of them");
+        errorln("        args: <source> <dest-dir>...");
+        errorln("    diff   Prints what sync would delete, create, move and "
+                "modify, without changing anything. A destination may also "
+                "be a snapshot: two snapshots are compared without touching "
+                "the directories, skipping equal subtrees unread");
+        errorln("        args: <source> <dest>...");
+        errorln("    watch  Syncs source to destination dir, then keeps "
+                "mirroring changes to source as they happen (Linux only)");
+        errorln("        args: <source-dir> <dest-dir>");
+        errorln("    serve  Serves source on stdin and stdout to a sync or diff "
+                "with an 'fd:' or 'exec:' source. Both ends need the same "
+                "--hash");
+        errorln("        args: <source>");
+        errorln("    save   Saves a directory info to file, writing it as the "
+                "scan goes: memory doesn't grow with the number of files");
         errorln("        args: <source-dir> <saving-file>");
+        errorln("    hash   Prints the hash of a path in a snapshot (of the "
+                "root without one), and a file's content digest if the "
+                "snapshot has them. Reads a few records per path level");
+        errorln("        args: <snapshot> [<path>]");
+        errorln("    backup Stores what's new in source in a deduplicating "
+                "chunk store, and its snapshot as the store's next version. "
+                "Only file contents the store doesn't have are chunked and "
+                "only chunks it doesn't have are written");
+        errorln("        args: <source-dir> <store-dir>");
+        errorln("    restore Makes destination dir the given version of a "
+                "chunk store (a number, or 'latest'), writing only what "
+                "differs");
+        errorln("        args: <store-dir> <version> <dest-dir>");
+        errorln("    prune  Keeps the newest n versions of a chunk store and "
+                "deletes what only older ones needed");
+        errorln("        args: <store-dir> <n>");
+        errorln("options:");
+        errorln("    -j, --jobs <n>  Scans and compares directories with n "
+                "threads, 0 means one per core (default: 1)");
+        errorln("    --io-jobs <n>   Keeps up to n deletions, folder creations "
+                "and file copies in flight while syncing, 0 means one per "
+                "core (default: 1)");
+        errorln("    --hash <mode>   Leaf hashes from file 'mtime' (default) or "
+                "'content'. Content mode only re-reads files whose size or "
+                "mtime changed");
+        errorln("    --cache <file>  Keeps hashes of unchanged files and "
+                "listings of unchanged directories between runs");
+        errorln("    --delta         Updates modified files of 16 MiB or more "
+                "in place, writing only the blocks that changed");
+        errorln("    --dry-run       Makes sync print its plan like diff "
+                "instead of applying it");
+        errorln("    --exclude <pattern>  Skips matching files and "
+                "directories, with gitignore syntax. Rules from "
+                "<source-dir>/.treeignore come first. Snapshots and 'serve' "
+                "record the rules, a sync from them uses the same");
+        errorln("    --include <pattern>  Scans matching entries that an "
+                "earlier rule excluded");
+        errorln("    --stats <fmt>   Prints phase times and counters to stdout "
+                "when done, as 'json' (one line) or 'text'. Watch prints them "
+                "after every batch of changes");
+        errorln("    -v, --verbose   Also logs every file and folder touched");
+        errorln("    -q, --quiet     Only logs errors");
     };
 
     if (argc == 1) {
@@ -34,43 +117,498 @@ int main(int argc, char **argv)
         return EXIT_FAILURE;
     }
 
+    BuildOptions build_options;
+    SyncOptions sync_options;
+    std::optional<fs::path> cache_path;
+    std::optional<std::string_view> stats_format;
+    std::vector<std::string> filter_rules;
+    bool dry_run{false};
+
+    // Matches `arg` against an option taking a value. Accepts "-xVALUE",
+    // "-x VALUE", "--name=VALUE" and "--name VALUE".
+    auto option_value{[&](std::string_view arg, std::string_view short_name,
+                          std::string_view long_name)
+                          -> std::optional<std::string_view> {
+        auto take_next{[&]() -> std::string_view {
+            if (it == args.end()) {
+                throw std::invalid_argument{
+                    std::format("option {} requires a value", arg)};
+            }
+            return next_arg();
+        }};
+        if (!short_name.empty() && arg.starts_with(short_name)) {
+            return arg.size() == short_name.size()
+                       ? take_next()
+                       : arg.substr(short_name.size());
+        }
+        if (arg == long_name) {
+            return take_next();
+        }
+        if (arg.starts_with(long_name) && arg[long_name.size()] == '=') {
+            return arg.substr(long_name.size() + 1);
+        }
+        return std::nullopt;
+    }};
+
+    // Job count, 0 meaning one per core.
+    auto parse_jobs{[](std::string_view value) -> std::size_t {
+        std::size_t jobs{};
+        auto const [ptr, ec] =
+            std::from_chars(value.data(), value.data() + value.size(), jobs);
+        if (ec != std::errc{} || ptr != value.data() + value.size()) {
+            throw std::invalid_argument{
+                std::format("invalid job count {}", value)};
+        }
+        return jobs == 0 ? std::max(1U, std::thread::hardware_concurrency())
+                         : jobs;
+    }};
+
     // Processes options
-    while (*it != nullptr && (*it)[0] == '-') {
-        char const *arg{next_arg()};
-        // Intentionally left blank, because we don't have any options to parse.
-        ++it;
+    try {
+        while (it != args.end() && (*it)[0] == '-') {
+            std::string_view const arg{next_arg()};
+            if (auto const value{option_value(arg, "-j", "--jobs")}) {
+                build_options.jobs = parse_jobs(*value);
+                sync_options.jobs = build_options.jobs;
+            }
+            else if (auto const value{option_value(arg, "", "--io-jobs")}) {
+                sync_options.io_jobs = parse_jobs(*value);
+            }
+            else if (auto const value{option_value(arg, "", "--hash")}) {
+                if (*value == "mtime") {
+                    build_options.hash_mode = HashMode::mtime;
+                }
+                else if (*value == "content") {
+                    build_options.hash_mode = HashMode::content;
+                }
+                else {
+                    throw std::invalid_argument{
+                        std::format("unknown hash mode {}", *value)};
+                }
+            }
+            else if (auto const value{option_value(arg, "", "--cache")}) {
+                cache_path = *value;
+            }
+            else if (auto const value{option_value(arg, "", "--exclude")}) {
+                filter_rules.emplace_back(*value);
+                PathFilter{}.add(filter_rules.back());
+            }
+            else if (auto const value{option_value(arg, "", "--include")}) {
+                filter_rules.push_back("!"s + std::string{*value});
+                PathFilter{}.add(filter_rules.back());
+            }
+            else if (arg == "--delta") {
+                sync_options.delta = true;
+            }
+            else if (arg == "--dry-run") {
+                dry_run = true;
+            }
+            else if (auto const value{option_value(arg, "", "--stats")}) {
+                if (*value != "json" && *value != "text") {
+                    throw std::invalid_argument{
+                        std::format("unknown stats format {}", *value)};
+                }
+                stats_format = *value;
+            }
+            else if (arg == "-v" || arg == "--verbose") {
+                log_level = LogLevel::debug;
+            }
+            else if (arg == "-q" || arg == "--quiet") {
+                log_level = LogLevel::error;
+            }
+            else {
+                throw std::invalid_argument{
+                    std::format("unknown option {}", arg)};
+            }
+        }
+    }
+    catch (std::invalid_argument const &e) {
+        errorln("{}", e.what());
+        show_usage();
+        return EXIT_FAILURE;
+    }
+
+    if (it == args.end()) {
+        show_usage();
+        return EXIT_FAILURE;
+    }
+
+    // Prints what was measured since the last report.
+    std::ostream *stats_out{&std::cout};
+    auto report_stats{[&stats_format, &stats_out] {
+        if (!stats_format) {
+            return;
+        }
+        if (*stats_format == "json") {
+            std::println(*stats_out, "{}", Metrics::to_json());
+        }
+        else {
+            std::print(*stats_out, "{}", Metrics::to_text());
+        }
+        stats_out->flush();
+        Metrics::reset();
+    }};
+
+    // Sources served by `serve` on the other end of a stream.
+    auto is_remote{[](std::string_view source) {
+        return source.starts_with("fd:") || source.starts_with("exec:");
+    }};
+#if !defined(_WIN32)
+    // A remote end that goes away is reported as an error, not by SIGPIPE.
+    std::signal(SIGPIPE, SIG_IGN);
+#endif
+
+    // The rules for scanning `source`: its .treeignore, if it is a
+    // directory that has one, then those given on the command line.
+    PathFilter filter;
+    auto load_filter{[&](fs::path const &source) {
+        if (std::ifstream in{source / ".treeignore"}) {
+            std::ostringstream text;
+            text << in.rdbuf();
+            filter.add_rules(text.str());
+        }
+        for (auto const &rule : filter_rules) {
+            filter.add(rule);
+        }
+        build_options.filter = &filter;
+    }};
+
+    std::optional<HashCache> cache;
+    if (cache_path) {
+        cache.emplace(*cache_path);
+        build_options.cache = &*cache;
     }
 
-    if (std::string_view command{next_arg()}; command == "sync") {
+    if (std::string_view command{next_arg()};
+        command == "sync" || command == "diff") {
+        // A source and at least one destination.
+        if (!has_args(2)) {
+            show_usage();
+            return EXIT_FAILURE;
+        }
         char const *from{next_arg()};
-        char const *to{next_arg()};
+        // Everything after the source is a destination.
+        std::vector<fs::path> const dests(it, args.end());
+        it = args.end();
+        for (std::size_t i{}; i != dests.size(); ++i) {
+            for (std::size_t j{}; j != i; ++j) {
+                if (fs::weakly_canonical(dests[i]) ==
+                    fs::weakly_canonical(dests[j])) {
+                    errorln("{} is given twice", dests[i].string());
+                    return EXIT_FAILURE;
+                }
+            }
+        }
+        dry_run = dry_run || command == "diff";
+
+        // A snapshot destination is only compared with, e.g. to see what
+        // changed between two snapshots without touching the file system.
+        auto const is_snapshot{[](fs::path const &path) {
+            return fs::is_regular_file(path) &&
+                   SnapshotView::is_snapshot(path);
+        }};
+        if (!dry_run && std::ranges::any_of(dests, is_snapshot)) {
+            errorln("Can't sync to a snapshot, only diff with one");
+            return EXIT_FAILURE;
+        }
 
-        errorln("Syncing {} to {} ...", from, to);
+        if (!dry_run) {
+            for (auto const &to : dests) {
+                infoln("Syncing {} to {} ...", from, to.string());
+                if (!fs::exists(to)) {
+                    fs::create_directory(to);
+                }
+            }
+        }
+
+        // Where the rules come from the source, more of them can't be added
+        // here.
+        bool const recorded_filter{is_remote(from) || !fs::is_directory(from)};
+        if (recorded_filter && !filter_rules.empty()) {
+            errorln("--exclude and --include only apply when scanning a "
+                    "source directory");
+            return EXIT_FAILURE;
+        }
+
+        if (is_remote(from)) {
+            if (dests.size() != 1) {
+                errorln("A remote source syncs to one destination at a time");
+                return EXIT_FAILURE;
+            }
+            auto const to{dests.front().string()};
+            auto channel{Channel::connect(from)};
+            // The dest is scanned with the sender's rules.
+            auto const served{open_session(
+                channel, MerkleTree::hash_algorithm,
+                static_cast<std::uint8_t>(build_options.hash_mode))};
+            filter = PathFilter{served.filter};
+            build_options.filter = &filter;
+            auto dest{fs::exists(to)
+                          ? MerkleTree::from_directory(to, build_options)
+                          : MerkleTree::empty(to, build_options)};
+            if (dry_run) {
+                dest.plan_sync_from(channel, served).print(std::cout);
+            }
+            else {
+                auto const written{dest.sync_from(channel, served)};
+                infoln("Sync ok, {} bytes written", written);
+            }
+        }
+        else {
+            if (!recorded_filter) {
+                load_filter(from);
+            }
+            // One scan of the source serves every destination.
+            auto const src{MerkleTree::from_path(from, build_options)};
+            auto dest_options{build_options};
+            dest_options.filter = &src.filter();
+            std::vector<MerkleTree> trees;
+            trees.reserve(dests.size());
+            for (auto const &to : dests) {
+                trees.push_back(
+                    is_snapshot(to) ? MerkleTree::from_file(to.string())
+                    : fs::exists(to)
+                        ? MerkleTree::from_directory(to.string(), dest_options)
+                        : MerkleTree::empty(to.string(), dest_options));
+            }
+
+            if (dry_run) {
+                for (std::size_t i{}; i != trees.size(); ++i) {
+                    if (trees.size() > 1) {
+                        std::println("{}:", dests[i].string());
+                    }
+                    trees[i]
+                        .plan_sync_from(src, sync_options.jobs)
+                        .print(std::cout);
+                }
+            }
+            else {
+                auto const written{
+                    MerkleTree::sync_all(trees, src, sync_options)};
+                infoln("Sync ok, {} bytes written", written);
+            }
+        }
+    }
+    else if (command == "watch") {
+        if (!has_args(2)) {
+            show_usage();
+            return EXIT_FAILURE;
+        }
+        char const *from{next_arg()};
+        char const *to{next_arg()};
 
         if (!fs::exists(to)) {
             fs::create_directory(to);
         }
 
-        auto const src{MerkleTree::from_path(from)};
-        auto dest{MerkleTree::from_directory(to)};
+        load_filter(from);
+        // Watches are in place before the first scan, so nothing that
+        // changes in between is missed. Excluded directories are watched
+        // too, their changes come to nothing.
+        DirectoryWatcher watcher{from};
+        auto src{MerkleTree::from_directory(from, build_options)};
+        auto dest{MerkleTree::from_directory(to, build_options)};
+        dest.sync_from(src, sync_options);
+        report_stats();
 
-        dest.sync_from(src);
+        infoln("Watching {} ...", from);
+        for (;;) {
+            auto const changes{watcher.wait(std::chrono::milliseconds{200})};
+            if (changes.root_gone) {
+                errorln("{} was removed or moved away, stopped watching",
+                        from);
+                return EXIT_FAILURE;
+            }
+            if (changes.overflow) {
+                infoln("Missed events, rescanning {} ...", from);
+                src = MerkleTree::from_directory(from, build_options);
+            }
+            else {
+                src.refresh(changes.dirs, changes.replaced);
+            }
+            auto const written{dest.sync_from(src, sync_options)};
+            infoln("Synced {} changed directories, {} bytes written",
+                   changes.dirs.size(), written);
+            report_stats();
+        }
+    }
+    else if (command == "serve") {
+        if (!has_args(1)) {
+            show_usage();
+            return EXIT_FAILURE;
+        }
+        char const *source{next_arg()};
 
-        errorln("Sync ok");
+        // stdout is the stream to the receiver.
+        stats_out = &std::cerr;
+        if (fs::is_directory(source)) {
+            load_filter(source);
+        }
+        auto const src{MerkleTree::from_path(source, build_options)};
+        Channel channel{0, 1};
+        src.serve(channel);
     }
     else if (command == "save") {
+        if (!has_args(2)) {
+            show_usage();
+            return EXIT_FAILURE;
+        }
         char const *source{next_arg()};
         char const *saving_filepath{next_arg()};
 
-        auto const src{MerkleTree::from_directory(source)};
-        src.writeTree(saving_filepath);
+        load_filter(source);
+        // Written as it's scanned, the tree is never held whole.
+        MerkleTree::save_directory(source, saving_filepath, build_options);
+
+        infoln("File saved to {}", saving_filepath);
+    }
+    else if (command == "hash") {
+        if (!has_args(1)) {
+            show_usage();
+            return EXIT_FAILURE;
+        }
+        char const *snapshot_path{next_arg()};
+        fs::path const relative{it != args.end() ? next_arg() : ""};
+
+        if (!fs::is_regular_file(snapshot_path) ||
+            !SnapshotView::is_snapshot(snapshot_path)) {
+            errorln("{} isn't a snapshot", snapshot_path);
+            return EXIT_FAILURE;
+        }
+        // Only the records on the way to the path are read.
+        SnapshotView const snapshot{snapshot_path,
+                                    SnapshotView::Check::layout};
+        auto const index{snapshot.find(relative)};
+        if (!index) {
+            errorln("{} has no {}", snapshot_path, relative.string());
+            return EXIT_FAILURE;
+        }
+        auto const &node{snapshot.nodes()[*index]};
+        if ((node.flags & SnapshotNode::has_content) != 0 &&
+            !snapshot.contents().empty()) {
+            std::println("{} {}", to_hex(snapshot.hashes()[*index]),
+                         to_hex(snapshot.contents()[*index]));
+        }
+        else {
+            std::println("{}", to_hex(snapshot.hashes()[*index]));
+        }
+    }
+    else if (command == "backup") {
+        if (!has_args(2)) {
+            show_usage();
+            return EXIT_FAILURE;
+        }
+        char const *source{next_arg()};
+        char const *store_dir{next_arg()};
 
-        errorln("File saved to {}", saving_filepath);
+        load_filter(source);
+        ChunkStore store{store_dir};
+        // Files whose size and mtime are those of the last backup of the
+        // same directory aren't read again.
+        build_options.hash_mode = HashMode::content;
+        std::optional<MerkleTree> previous;
+        if (auto const latest{store.latest_of(fs::absolute(source))};
+            latest != 0) {
+            previous.emplace(
+                MerkleTree::from_file(store.version_path(latest).string()));
+            build_options.reference = &*previous;
+        }
+        auto const src{MerkleTree::from_directory(source, build_options)};
+        auto const version{src.backup_to(store)};
+        infoln("Saved version {}, {} new bytes stored", version,
+               Metrics::get(Counter::bytes_stored));
+    }
+    else if (command == "restore") {
+        if (!has_args(3)) {
+            show_usage();
+            return EXIT_FAILURE;
+        }
+        char const *store_dir{next_arg()};
+        std::string_view const which{next_arg()};
+        char const *to{next_arg()};
+
+        if (!ChunkStore::is_store(store_dir)) {
+            errorln("{} isn't a chunk store", store_dir);
+            return EXIT_FAILURE;
+        }
+        if (!filter_rules.empty()) {
+            errorln("--exclude and --include only apply when scanning a "
+                    "source directory");
+            return EXIT_FAILURE;
+        }
+        ChunkStore const store{store_dir};
+        auto const versions{store.versions()};
+        std::uint64_t version{};
+        if (which == "latest" && !versions.empty()) {
+            version = versions.back();
+        }
+        else {
+            std::from_chars(which.data(), which.data() + which.size(),
+                            version);
+        }
+        if (!std::ranges::binary_search(versions, version)) {
+            errorln("{} has no version {}", store_dir, which);
+            return EXIT_FAILURE;
+        }
+        auto const snapshot{
+            MerkleTree::from_file(store.version_path(version).string())};
+
+        if (!dry_run) {
+            infoln("Restoring version {} to {} ...", version, to);
+            if (!fs::exists(to)) {
+                fs::create_directory(to);
+            }
+        }
+        // Every file there is read: only its bytes tell whether it still
+        // has the version's content.
+        build_options.hash_mode = HashMode::content;
+        auto dest_options{build_options};
+        dest_options.filter = &snapshot.filter();
+        auto dest{fs::exists(to) ? MerkleTree::from_directory(to, dest_options)
+                                 : MerkleTree::empty(to, dest_options)};
+        if (dry_run) {
+            dest.plan_sync_from(snapshot, sync_options.jobs).print(std::cout);
+        }
+        else {
+            auto const written{
+                dest.restore_from(store, snapshot, sync_options)};
+            infoln("Restore ok, {} bytes written", written);
+        }
+    }
+    else if (command == "prune") {
+        if (!has_args(2)) {
+            show_usage();
+            return EXIT_FAILURE;
+        }
+        char const *store_dir{next_arg()};
+        std::string_view const count{next_arg()};
+
+        std::size_t keep{};
+        auto const [ptr, ec] =
+            std::from_chars(count.data(), count.data() + count.size(), keep);
+        if (ec != std::errc{} || ptr != count.data() + count.size()) {
+            errorln("invalid version count {}", count);
+            return EXIT_FAILURE;
+        }
+        if (!ChunkStore::is_store(store_dir)) {
+            errorln("{} isn't a chunk store", store_dir);
+            return EXIT_FAILURE;
+        }
+        ChunkStore store{store_dir};
+        auto const pruned{store.prune(keep)};
+        infoln("Pruned {} versions, {} file contents and {} chunks, {} bytes "
+               "freed",
+               pruned.versions, pruned.files, pruned.chunks, pruned.bytes);
     }
     else {
         show_usage();
         return EXIT_FAILURE;
     }
 
+    if (cache) {
+        cache->save(*cache_path);
+    }
+    report_stats();
+
     return EXIT_SUCCESS;
 }
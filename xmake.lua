@@ -11,8 +11,21 @@ end
 
 target("libtree")
 set_kind("static")
-add_files("libtree/tree.cpp")
-add_headerfiles("libtree/tree.hpp", "libtree/print.hpp")
+add_files("libtree/tree.cpp", "libtree/thread_pool.cpp", "libtree/hash.cpp",
+          "libtree/file_reader.cpp", "libtree/snapshot.cpp",
+          "libtree/hash_cache.cpp", "libtree/sync_plan.cpp",
+          "libtree/copy_engine.cpp", "libtree/watcher.cpp",
+          "libtree/metrics.cpp", "libtree/directory.cpp",
+          "libtree/name_pool.cpp", "libtree/remote.cpp",
+          "libtree/filter.cpp", "libtree/chunk_store.cpp")
+add_headerfiles("libtree/tree.hpp", "libtree/print.hpp", "libtree/thread_pool.hpp",
+                "libtree/hash.hpp", "libtree/file_reader.hpp",
+                "libtree/node_arena.hpp", "libtree/snapshot.hpp",
+                "libtree/hash_cache.hpp", "libtree/sync_plan.hpp",
+                "libtree/copy_engine.hpp", "libtree/watcher.hpp",
+                "libtree/metrics.hpp", "libtree/directory.hpp",
+                "libtree/name_pool.hpp", "libtree/remote.hpp",
+                "libtree/filter.hpp", "libtree/chunk_store.hpp")
 add_includedirs(".")
 add_packages("boost", "openssl")
 
@@ -22,3 +35,24 @@ add_files("tree/main.cpp")
 add_includedirs(".")
 add_deps("libtree")
 add_packages("boost", "openssl")
+
+target("tree_bench")
+set_kind("binary")
+set_default(false)
+add_files("bench/main.cpp")
+add_includedirs(".")
+add_deps("libtree")
+add_packages("boost", "openssl")
+
+-- One binary per tests/*_test.cpp, run by `xmake test`.
+for _, file in ipairs(os.files("tests/*_test.cpp")) do
+    target(path.basename(file))
+    set_kind("binary")
+    set_default(false)
+    set_group("tests")
+    add_files(file)
+    add_includedirs(".")
+    add_deps("libtree")
+    add_packages("boost", "openssl")
+    add_tests("default")
+end